@@ -22,6 +22,13 @@
  */
 
 #include <algorithm>
+#include <cstring> // memcpy
+#include <list>
+#include <memory> // auto_ptr
+#include <cstddef> // size_t
+#include <cstdlib> // getenv, atoi
+#include <sys/types.h>
+#include <sys/stat.h> // stat
 #ifdef DEBUG
 #include <iostream>
 #endif
@@ -37,11 +44,31 @@
 
 #include <ImfPixelType.h>
 #include <ImfChannelList.h>
-#include <ImfInputFile.h>
+#include <ImfMultiPartInputFile.h>
+#include <ImfInputPart.h>
+#include <ImfTiledInputPart.h>
+#include <ImfDeepScanLineInputPart.h>
+#include <ImfDeepFrameBuffer.h>
+#include <ImfPartType.h>
+#include <ImfStandardAttributes.h>
+#include <ImfThreading.h>
 #include <IlmThreadPool.h>
 
-#ifdef OFX_IO_MT_EXR
 #include <ofxsMultiThread.h>
+#include <ofxsMultiPlane.h>
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
 #endif
 
 #include "GenericOCIO.h"
@@ -61,6 +88,10 @@ using std::map;
 using std::pair;
 using std::make_pair;
 
+template<typename T>
+static inline void
+unused(const T&) {}
+
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginName "ReadEXR"
@@ -80,7 +111,19 @@ namespace Imf_ = OPENEXR_IMF_NAMESPACE;
 #define kSupportsRGB false
 #define kSupportsXY false
 #define kSupportsAlpha false
-#define kSupportsTiles false
+#define kSupportsTiles true
+#define kIsMultiPlanar true
+
+#define kParamExrThreads "exrThreads"
+#define kParamExrThreadsLabel "Decoding Threads"
+#define kParamExrThreadsHint "Number of threads used by OpenEXR to decompress the blocks of lines of an image in parallel " \
+    "(0 leaves the thread count set by the host, or the OpenEXR default, unchanged). OpenEXR has a single thread pool, so " \
+    "this setting is global: it is applied when it is edited, and it is shared by all the OpenEXR readers and writers."
+
+#define kExrMaxOpenFiles 32 // default maximum number of EXR files kept open by the reader (unless more are being decoded), see OFX_EXR_MAX_OPEN_FILES
+#define kExrHeaderCacheMaxEntries 16384 // maximum number of file headers kept in the header cache
+#define kExrMinStripLines 32 // minimum number of lines decoded at once when only part of each line is needed
+#define kExrDeepDepthLayer "depth" // the layer holding the depth of the front and back samples of deep files
 
 class ReadEXRPlugin
     : public GenericReaderPlugin
@@ -92,12 +135,18 @@ public:
     virtual ~ReadEXRPlugin();
 
     virtual void changedParam(const InstanceChangedArgs &args, const string &paramName) OVERRIDE FINAL;
+    virtual void getClipComponents(const ClipComponentsArguments& args, ClipComponentsSetter& clipComponents) OVERRIDE FINAL;
+    virtual void clearAnyCache() OVERRIDE FINAL;
 
 private:
 
+    IntParam* _exrThreads;
+
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
 
-    virtual void decode(const string& filename, OfxTime time, int /*view*/, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual void decodePlane(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                             PixelComponentEnum pixelComponents, int pixelComponentCount, const string& rawComponents, int rowBytes) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& /*filename*/, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
     /**
@@ -133,6 +182,18 @@ enum Channel
     Channel_none
 };
 
+// Set the number of threads used by OpenEXR. 0 leaves the current thread count unchanged
+static void
+setThreadCount(int threads)
+{
+    if (threads <= 0) {
+        return;
+    }
+    if (Imf_::globalThreadCount() != threads) {
+        Imf_::setGlobalThreadCount(threads);
+    }
+}
+
 static Channel
 fromExrChannel(const string& from)
 {
@@ -282,6 +343,9 @@ private:
             }
         }
 
+        if ( newSplits.empty() ) {
+            return false;
+        }
         if (newSplits.size() > 1) {
             for (size_t i = 0; i < (newSplits.size() - 1); ++i) {
                 vector<string>::const_iterator foundView = std::find(views.begin(), views.end(), newSplits[i]);
@@ -313,77 +377,170 @@ private:
     }
 };
 
-struct File
+#ifdef _WIN32
+static inline wstring
+s2ws(const string& s)
 {
-    File(const string& filename);
+    int len;
+    int slength = (int)s.length() + 1;
 
+    len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
+    wchar_t* buf = new wchar_t[len];
+    MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
+    wstring r(buf);
+    delete[] buf;
 
-    ~File();
+    return r;
+}
+
+#endif
+
+// Get the modification time and size of a file, used to detect files that were modified
+static bool
+getFileStamp(const string& filename,
+             long long* mtime,
+             long long* size)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_wstat64(s2ws(filename).c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    *mtime = (long long)st.st_mtime;
+    *size = (long long)st.st_size;
 
-    Imf::InputFile* inputfile;
+    return true;
+}
+
+// A channel of a file
+struct ChannelInfo
+{
+    string name; // the full name of the channel in the file
+    int part; // the part holding the channel
+    int xSampling;
+    int ySampling;
+    string layer; // the layer, view and channel names, as extracted by ChannelExtractor
+    string view; // empty for the default view
+    string chan;
+    Channel mappedChannel; // the color channel, or Channel_none
+};
+
+// The header information of a file: this is all getFrameBounds(), guessParamsFromFilename() and
+// getClipComponents() need, and it is cached by the FileManager so that the file does not have to be opened again.
+// The windows and the pixel aspect ratio are those of the first part.
+struct FileInfo
+{
+    FileInfo();
+
+    // convert the headers of all the parts to our representation
+    void readHeaders(const Imf_::MultiPartInputFile& file);
+
+    // get the view of the file to read for a host view: views which are not in the file are read from the default view
+    string getView(const string& viewName) const;
+
+    // find a channel of a layer (empty for the layer without name) in a view returned by getView()
+    const ChannelInfo* findChannel(const string& layer, const string& view, const string& chan) const;
+
+    // the names of the channels of a layer, in the order of the file
+    vector<string> getLayerChannels(const string& layer) const;
+
+    // is the depth layer read from the deep part?
+    bool isDeepDepth() const
+    {
+        return !deepZ.empty() && !findChannel(kExrDeepDepthLayer, string(), "Z");
+    }
 
     typedef map<Channel, string> ChannelsMap;
-    ChannelsMap channel_map;
+    ChannelsMap channel_map; // the RGBA channels of colorLayer in the default view (or of the deep part if deepColor)
+    vector<ChannelInfo> channels; // all the channels of all the parts, deep parts excluded
+    string colorLayer; // the layer read as the color plane
+    vector<string> layers; // the other layers, in the order of the file
     int dataOffset;
-    vector<string> views;
+    vector<string> views; // the first one is the default view
     OfxRectI displayWindow;
     OfxRectI dataWindow;
     float pixelAspectRatio;
-#if defined(_WIN32) && !defined(__MINGW32__)
-    std::ifstream* inputStr;
-    Imf::StdIFStream* inputStdStream;
-#endif
-#ifdef OFX_IO_MT_EXR
-    MultiThread::Mutex lock;
-#endif
-#ifdef _WIN32
-    inline wstring s2ws(const string& s)
-    {
-        int len;
-        int slength = (int)s.length() + 1;
-
-        len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
-        wchar_t* buf = new wchar_t[len];
-        MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
-        wstring r(buf);
-        delete[] buf;
-
-        return r;
-    }
+    int deepPart; // the first deep scan line part, or -1
+    string deepChannels[4]; // the R, G, B and A channels of deepPart, empty if absent
+    string deepZ; // the Z and ZBack channels of deepPart, empty if absent
+    string deepZBack;
+    bool deepColor; // the file has no flat color channels: the color plane is read by flattening deepPart
 
-#endif
+private:
+    void readDeepHeader(const Imf_::Header& header, int part);
 };
 
-File::File(const string& filename)
-    : inputfile(0)
-    , channel_map()
+FileInfo::FileInfo()
+    : channel_map()
+    , channels()
+    , colorLayer()
+    , layers()
     , dataOffset(0)
     , views()
     , displayWindow()
     , dataWindow()
     , pixelAspectRatio(1.)
-#if defined(_WIN32) && !defined(__MINGW32__)
-    , inputStr(0)
-    , inputStdStream(0)
-#endif
-#ifdef OFX_IO_MT_EXR
-    , lock()
-#endif
+    , deepPart(-1)
+    , deepZ()
+    , deepZBack()
+    , deepColor(false)
 {
-    try{
-#if defined(_WIN32) && !defined(__MINGW32__)
-        inputStr = new std::ifstream(s2ws(filename), std::ios_base::binary);
-        inputStdStream = new Imf_::StdIFStream( *inputStr, filename.c_str() );
-        inputfile = new Imf_::InputFile(*inputStdStream);
-#else
+}
 
-        inputfile = new Imf_::InputFile( filename.c_str() );
-#endif
+void
+FileInfo::readDeepHeader(const Imf_::Header& header,
+                         int part)
+{
+    deepPart = part;
+    const Imf_::ChannelList& imfchannels = header.channels();
+    for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
+        ChannelExtractor exrExctractor(chan.name(), views);
+        if ( !exrExctractor._layer.empty() ) {
+            // only the main layer of deep images is read
+            continue;
+        }
+        if ( exrExctractor.isValid() && (exrExctractor._mappedChannel != Channel_none) ) {
+            deepChannels[exrExctractor._mappedChannel] = chan.name();
+        } else if (exrExctractor._chan == "Z") {
+            deepZ = chan.name();
+        } else if (exrExctractor._chan == "ZBack") {
+            deepZBack = chan.name();
+        }
+    }
+}
 
+void
+FileInfo::readHeaders(const Imf_::MultiPartInputFile& file)
+{
+    const Imf_::Header& header = file.header(0);
 
-        // convert exr channels to our channels
-        const Imf_::ChannelList& imfchannels = inputfile->header().channels();
+    // the views: from the multiView attribute of single-part files, or from the view attribute of each part
+    if ( Imf_::hasMultiView(header) ) {
+        views = Imf_::multiView(header);
+    }
+    for (int part = 0; part < file.parts(); ++part) {
+        if ( file.header(part).hasView() && ( std::find( views.begin(), views.end(), file.header(part).view() ) == views.end() ) ) {
+            views.push_back( file.header(part).view() );
+        }
+    }
 
+    // convert exr channels to our channels
+    for (int part = 0; part < file.parts(); ++part) {
+        const Imf_::Header& partHeader = file.header(part);
+        if ( partHeader.hasType() && ( ( partHeader.type() == Imf_::DEEPSCANLINE) || ( partHeader.type() == Imf_::DEEPTILE) ) ) {
+            // deep parts have no flat channels: only the first deep scan line part can be flattened
+            if ( (partHeader.type() == Imf_::DEEPSCANLINE) && (deepPart < 0) ) {
+                readDeepHeader(partHeader, part);
+            }
+            continue;
+        }
+        const Imf_::ChannelList& imfchannels = partHeader.channels();
         for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
             string chanName( chan.name() );
 
@@ -394,87 +551,290 @@ File::File(const string& filename)
 
             ///convert the channel to ours
             ChannelExtractor exrExctractor(chan.name(), views);
-
-            ///if we successfully extracted the channels
-            if ( exrExctractor.isValid() ) {
-                ///register the extracted channel
-                channel_map.insert( make_pair(exrExctractor._mappedChannel, exrExctractor._chan) );
-            } else {
+            if ( exrExctractor._chan.empty() ) {
 #                 ifdef DEBUG
                 std::cout << "Cannot decode channel " << chan.name() << std::endl;
 #                 endif
+                continue;
+            }
+            ChannelInfo c;
+            c.name = chanName;
+            c.part = part;
+            c.xSampling = chan.channel().xSampling;
+            c.ySampling = chan.channel().ySampling;
+            c.layer = exrExctractor._layer;
+            c.view = exrExctractor._view;
+            if ( c.view.empty() && partHeader.hasView() ) {
+                c.view = partHeader.view();
+            }
+            if ( !views.empty() && (c.view == views[0]) ) {
+                c.view.clear();
             }
+            c.chan = exrExctractor._chan;
+            ///if we successfully extracted the channels
+            c.mappedChannel = exrExctractor.isValid() ? exrExctractor._mappedChannel : Channel_none;
+            channels.push_back(c);
         }
+    }
+
+    // the color plane is the layer without name, or else the first layer with a color channel
+    bool foundColor = false;
+    for (std::size_t i = 0; i < channels.size() && !foundColor; ++i) {
+        if ( channels[i].layer.empty() && (channels[i].mappedChannel != Channel_none) ) {
+            foundColor = true;
+        }
+    }
+    for (std::size_t i = 0; i < channels.size() && !foundColor; ++i) {
+        if (channels[i].mappedChannel != Channel_none) {
+            colorLayer = channels[i].layer;
+            foundColor = true;
+        }
+    }
+    for (std::size_t i = 0; i < channels.size(); ++i) {
+        const ChannelInfo& c = channels[i];
+        if (c.layer == colorLayer) {
+            if ( c.view.empty() && (c.mappedChannel != Channel_none) ) {
+                ///register the extracted channel
+                channel_map.insert( make_pair(c.mappedChannel, c.name) );
+            }
+        } else if ( std::find(layers.begin(), layers.end(), c.layer) == layers.end() ) {
+            layers.push_back(c.layer);
+        }
+    }
+    if (deepPart >= 0) {
+        if (!foundColor) {
+            for (int i = 0; i < 4; ++i) {
+                if ( !deepChannels[i].empty() ) {
+                    deepColor = true;
+                    channel_map.insert( make_pair( (Channel)i, deepChannels[i] ) );
+                }
+            }
+        }
+        if ( !deepZ.empty() && ( std::find(layers.begin(), layers.end(), kExrDeepDepthLayer) == layers.end() ) ) {
+            layers.push_back(kExrDeepDepthLayer);
+        }
+    }
+
+    const Imath::Box2i& datawin = header.dataWindow();
+    const Imath::Box2i& dispwin = header.displayWindow();
+    Imath::Box2i formatwin(dispwin);
+    formatwin.min.x = 0;
+    formatwin.min.y = 0;
+    dataOffset = 0;
+
+    if (dispwin.min.x != 0) {
+        // Shift both to get dispwindow over to 0,0.
+        dataOffset = -dispwin.min.x;
+        formatwin.max.x = dispwin.max.x + dataOffset;
+    }
+    formatwin.max.y = dispwin.max.y - dispwin.min.y;
+
+    displayWindow.x1 = 0;
+    displayWindow.y1 = 0;
+    displayWindow.x2 = formatwin.max.x + 1;
+    displayWindow.y2 = formatwin.max.y;
+
+    int left = datawin.min.x + dataOffset;
+    int bottom = dispwin.max.y - datawin.max.y;
+    int right = datawin.max.x + dataOffset;
+    int top = dispwin.max.y - datawin.min.y;
+    if ( ( datawin.min.x != dispwin.min.x) || ( datawin.max.x != dispwin.max.x) ||
+         ( datawin.min.y != dispwin.min.y) || ( datawin.max.y != dispwin.max.y) ) {
+        --left;
+        --bottom;
+        ++right;
+        ++top;
+    }
+    dataWindow.x1 = left;
+    dataWindow.x2 = right + 1;
+    dataWindow.y1 = bottom;
+    dataWindow.y2 = top + 1;
+
+    pixelAspectRatio = header.pixelAspectRatio();
+} // FileInfo::readHeaders
+
+string
+FileInfo::getView(const string& viewName) const
+{
+    if ( views.empty() || (viewName == views[0]) || ( std::find(views.begin(), views.end(), viewName) == views.end() ) ) {
+        // the default view
+        return string();
+    }
+
+    return viewName;
+}
+
+const ChannelInfo*
+FileInfo::findChannel(const string& layer,
+                      const string& view,
+                      const string& chan) const
+{
+    for (std::size_t i = 0; i < channels.size(); ++i) {
+        if ( (channels[i].layer == layer) && (channels[i].view == view) && (channels[i].chan == chan) ) {
+            return &channels[i];
+        }
+    }
+
+    return NULL;
+}
+
+vector<string>
+FileInfo::getLayerChannels(const string& layer) const
+{
+    vector<string> ret;
+
+    if ( (layer == kExrDeepDepthLayer) && isDeepDepth() ) {
+        ret.push_back("Z");
+        if ( !deepZBack.empty() ) {
+            ret.push_back("ZBack");
+        }
+
+        return ret;
+    }
+
+    for (std::size_t i = 0; i < channels.size(); ++i) {
+        if ( (channels[i].layer == layer) && ( std::find(ret.begin(), ret.end(), channels[i].chan) == ret.end() ) ) {
+            ret.push_back(channels[i].chan);
+        }
+    }
+
+    return ret;
+}
+
+struct File
+    : public FileInfo
+{
+    File(const string& filename);
+
+
+    ~File();
+
+    Imf_::MultiPartInputFile* inputfile;
+    vector<Imf_::InputPart*> parts; // scan line parts, NULL for other parts
+    vector<Imf_::TiledInputPart*> tiledParts; // tiled parts, only the tiles intersecting the render window are read
+    Imf_::DeepScanLineInputPart* deepInputPart; // deepPart, read by blocks of lines
 
-        const Imath::Box2i& datawin = inputfile->header().dataWindow();
-        const Imath::Box2i& dispwin = inputfile->header().displayWindow();
-        Imath::Box2i formatwin(dispwin);
-        formatwin.min.x = 0;
-        formatwin.min.y = 0;
-        dataOffset = 0;
-
-        if (dispwin.min.x != 0) {
-            // Shift both to get dispwindow over to 0,0.
-            dataOffset = -dispwin.min.x;
-            formatwin.max.x = dispwin.max.x + dataOffset;
-        }
-        formatwin.max.y = dispwin.max.y - dispwin.min.y;
-
-        displayWindow.x1 = 0;
-        displayWindow.y1 = 0;
-        displayWindow.x2 = formatwin.max.x + 1;
-        displayWindow.y2 = formatwin.max.y;
-
-        int left = datawin.min.x + dataOffset;
-        int bottom = dispwin.max.y - datawin.max.y;
-        int right = datawin.max.x + dataOffset;
-        int top = dispwin.max.y - datawin.min.y;
-        if ( ( datawin.min.x != dispwin.min.x) || ( datawin.max.x != dispwin.max.x) ||
-             ( datawin.min.y != dispwin.min.y) || ( datawin.max.y != dispwin.max.y) ) {
-            --left;
-            --bottom;
-            ++right;
-            ++top;
-        }
-        dataWindow.x1 = left;
-        dataWindow.x2 = right + 1;
-        dataWindow.y1 = bottom;
-        dataWindow.y2 = top + 1;
-
-        pixelAspectRatio = inputfile->header().pixelAspectRatio();
-    }catch (const std::exception& e) {
 #if defined(_WIN32) && !defined(__MINGW32__)
-        delete inputStr;
-        delete inputStdStream;
+    std::ifstream* inputStr;
+    Imf::StdIFStream* inputStdStream;
 #endif
-        delete inputfile;
-        inputfile = 0;
+    Mutex lock; // setFrameBuffer() and readPixels()/readTiles() on the shared parts are not reentrant
+
+private:
+    void close();
+};
+
+File::File(const string& filename)
+    : FileInfo()
+    , inputfile(0)
+    , parts()
+    , tiledParts()
+    , deepInputPart(0)
+#if defined(_WIN32) && !defined(__MINGW32__)
+    , inputStr(0)
+    , inputStdStream(0)
+#endif
+    , lock()
+{
+    try{
+#if defined(_WIN32) && !defined(__MINGW32__)
+        inputStr = new std::ifstream(s2ws(filename), std::ios_base::binary);
+        inputStdStream = new Imf_::StdIFStream( *inputStr, filename.c_str() );
+        inputfile = new Imf_::MultiPartInputFile(*inputStdStream);
+#else
+
+        inputfile = new Imf_::MultiPartInputFile( filename.c_str() );
+#endif
+
+        readHeaders(*inputfile);
+        parts.resize(inputfile->parts(), NULL);
+        tiledParts.resize(inputfile->parts(), NULL);
+        for (int part = 0; part < inputfile->parts(); ++part) {
+            const Imf_::Header& header = inputfile->header(part);
+            if ( header.hasType() && ( ( header.type() == Imf_::DEEPSCANLINE) || ( header.type() == Imf_::DEEPTILE) ) ) {
+                continue;
+            }
+            if ( header.hasTileDescription() ) {
+                tiledParts[part] = new Imf_::TiledInputPart(*inputfile, part);
+            } else {
+                parts[part] = new Imf_::InputPart(*inputfile, part);
+            }
+        }
+        if (deepPart >= 0) {
+            deepInputPart = new Imf_::DeepScanLineInputPart(*inputfile, deepPart);
+        }
+    }catch (const std::exception& e) {
+        close();
         throw e;
     }
 }
 
 File::~File()
 {
+    close();
+}
+
+void
+File::close()
+{
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        delete parts[i];
+        delete tiledParts[i];
+    }
+    parts.clear();
+    tiledParts.clear();
+    delete deepInputPart;
+    deepInputPart = 0;
+    delete inputfile;
+    inputfile = 0;
 #if defined(_WIN32) && !defined(__MINGW32__)
-    delete inputStr;
     delete inputStdStream;
+    inputStdStream = 0;
+    delete inputStr;
+    inputStr = 0;
 #endif
-    delete inputfile;
 }
 
-// Keeps track of all Exr::File mapped against file name.
+// Keeps track of the Exr::File objects, which hold an open file each, and of the headers of all the
+// files that were read, mapped against file name.
+// At most kExrMaxOpenFiles files (or the value of the OFX_EXR_MAX_OPEN_FILES environment variable)
+// are kept open: the least recently used ones that are not being
+// decoded are closed. The headers are kept in a separate cache of at most kExrHeaderCacheMaxEntries
+// entries, keyed by file name and modification time, so that getting the bounds of every frame of
+// a sequence does not keep one file open per frame.
 class FileManager
 {
-    typedef map<string, File*> FilesMap;
+    struct OpenFile
+    {
+        string filename;
+        long long mtime;
+        long long size;
+        File* file;
+        int users; // number of decodes using the file, it may only be closed when this is 0
+    };
+
+    typedef std::list<OpenFile> FilesList;
 
-    FilesMap _files;
+    struct HeaderEntry
+    {
+        string filename;
+        long long mtime;
+        long long size;
+        FileInfo info;
+    };
+
+    typedef std::list<HeaderEntry> HeadersList;
+    typedef map<string, HeadersList::iterator> HeadersMap;
+
+    FilesList _files; // open files, most recently used first
+    HeadersList _headers; // cached headers, most recently used first
+    HeadersMap _headersIndex; // maps file names to _headers entries
+    std::size_t _maxOpenFiles;
     bool _isLoaded;    ///< register all "global" flags to ffmpeg outside of the constructor to allow
     /// all OpenFX related stuff (which depend on another singleton) to be allocated.
 
-#ifdef OFX_IO_MT_EXR
-    // internal lock
-    MultiThread::Mutex *_lock;
-#endif
+    // internal lock, the files and headers are shared by all instances and render threads
+    Mutex *_lock;
 
 public:
 
@@ -488,8 +848,52 @@ public:
 
     void initialize();
 
-    // get a specific reader
-    File* get(const string& filename);
+    // get a specific reader, opening the file if necessary. The file stays open until release() is called.
+    // Throws if the file cannot be opened
+    File* acquire(const string& filename);
+
+    // release a file returned by acquire()
+    void release(File* file);
+
+    // get the header information of a file, from the cache if the file was not modified since it was read.
+    // Returns false and sets the error if the file cannot be opened
+    bool getInfo(const string& filename, FileInfo* info, string* error);
+
+    // close all the files that are not being decoded, and clear the header cache
+    void purge();
+
+private:
+    ///Private should not lock
+    void cacheHeader(const string& filename, long long mtime, long long size, const FileInfo& info);
+
+    ///Private should not lock
+    void closeUnusedFiles(std::size_t maxOpenFiles);
+};
+
+// Releases a file acquired from the FileManager when going out of scope
+class FileLease
+{
+    File* _file;
+
+public:
+    FileLease(const string& filename)
+        : _file( FileManager::s_readerManager.acquire(filename) )
+    {
+    }
+
+    ~FileLease()
+    {
+        FileManager::s_readerManager.release(_file);
+    }
+
+    File* get() const
+    {
+        return _file;
+    }
+
+private:
+    FileLease(const FileLease&);
+    FileLease& operator=(const FileLease&);
 };
 
 FileManager FileManager::s_readerManager;
@@ -497,50 +901,176 @@ FileManager FileManager::s_readerManager;
 // constructor
 FileManager::FileManager()
     : _files()
+    , _headers()
+    , _headersIndex()
+    , _maxOpenFiles(kExrMaxOpenFiles)
     , _isLoaded(false)
-#ifdef OFX_IO_MT_EXR
     , _lock(0)
-#endif
 {
 }
 
 FileManager::~FileManager()
 {
-    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
-        delete it->second;
+    for (FilesList::iterator it = _files.begin(); it != _files.end(); ++it) {
+        delete it->file;
     }
-#ifdef OFX_IO_MT_EXR
     delete _lock;
-#endif
 }
 
 void
 FileManager::initialize()
 {
     if (!_isLoaded) {
-#ifdef OFX_IO_MT_EXR
-        _lock = new MultiThread::Mutex();
-#endif
+        _lock = new Mutex();
+        // the number of open files may be overridden from the environment
+        const char* maxOpenFiles = std::getenv("OFX_EXR_MAX_OPEN_FILES");
+        if ( maxOpenFiles && (std::atoi(maxOpenFiles) > 0) ) {
+            _maxOpenFiles = (std::size_t)std::atoi(maxOpenFiles);
+        }
         _isLoaded = true;
     }
 }
 
 // get a specific reader
 File*
-FileManager::get(const string& filename)
+FileManager::acquire(const string& filename)
 {
     assert(_isLoaded);
-#ifdef OFX_IO_MT_EXR
-    MultiThread::AutoMutex g(*_lock);
-#endif
-    FilesMap::iterator it = _files.find(filename);
-    if ( it == _files.end() ) {
-        pair<FilesMap::iterator, bool> ret = _files.insert( make_pair( string(filename), new File(filename) ) );
-        assert(ret.second);
+    AutoMutex g(*_lock);
+    long long mtime = 0;
+    long long size = 0;
+    getFileStamp(filename, &mtime, &size);
+    for (FilesList::iterator it = _files.begin(); it != _files.end(); ++it) {
+        if (it->filename != filename) {
+            continue;
+        }
+        if ( (it->mtime == mtime) && (it->size == size) ) {
+            ++it->users;
+            // move it to the front of the list
+            _files.splice(_files.begin(), _files, it);
 
-        return ret.first->second;
-    } else {
-        return it->second;
+            return it->file;
+        }
+        if (it->users == 0) {
+            // the file was modified since it was opened
+            delete it->file;
+            _files.erase(it);
+        }
+        break;
+    }
+
+    OpenFile f;
+    f.filename = filename;
+    f.mtime = mtime;
+    f.size = size;
+    f.file = new File(filename); // may throw
+    f.users = 1;
+    _files.push_front(f);
+    cacheHeader(filename, mtime, size, *f.file);
+    closeUnusedFiles(_maxOpenFiles);
+
+    return f.file;
+}
+
+void
+FileManager::release(File* file)
+{
+    AutoMutex g(*_lock);
+    for (FilesList::iterator it = _files.begin(); it != _files.end(); ++it) {
+        if (it->file == file) {
+            assert(it->users > 0);
+            --it->users;
+            break;
+        }
+    }
+    closeUnusedFiles(_maxOpenFiles);
+}
+
+bool
+FileManager::getInfo(const string& filename,
+                     FileInfo* info,
+                     string* error)
+{
+    assert(_isLoaded);
+    {
+        AutoMutex g(*_lock);
+        long long mtime = 0;
+        long long size = 0;
+        getFileStamp(filename, &mtime, &size);
+        HeadersMap::iterator found = _headersIndex.find(filename);
+        if ( ( found != _headersIndex.end() ) && (found->second->mtime == mtime) && (found->second->size == size) ) {
+            // move it to the front of the list
+            _headers.splice(_headers.begin(), _headers, found->second);
+            *info = found->second->info;
+
+            return true;
+        }
+    }
+
+    // not in the cache: read the header. The file is kept open, so that it can be decoded next
+    try {
+        FileLease lease(filename);
+        *info = *lease.get();
+    } catch (const std::exception& e) {
+        if (error) {
+            *error = string("OpenEXR error") + ": " + e.what();
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+void
+FileManager::cacheHeader(const string& filename,
+                         long long mtime,
+                         long long size,
+                         const FileInfo& info)
+{
+    ///Private should not lock
+
+    HeadersMap::iterator found = _headersIndex.find(filename);
+    if ( found != _headersIndex.end() ) {
+        _headers.erase(found->second);
+        _headersIndex.erase(found);
+    }
+    HeaderEntry h;
+    h.filename = filename;
+    h.mtime = mtime;
+    h.size = size;
+    h.info = info;
+    _headers.push_front(h);
+    _headersIndex[filename] = _headers.begin();
+    while (_headersIndex.size() > (std::size_t)kExrHeaderCacheMaxEntries) {
+        _headersIndex.erase(_headers.back().filename);
+        _headers.pop_back();
+    }
+}
+
+void
+FileManager::purge()
+{
+    AutoMutex g(*_lock);
+    // files being decoded are closed when released
+    closeUnusedFiles(0);
+    _headers.clear();
+    _headersIndex.clear();
+}
+
+void
+FileManager::closeUnusedFiles(std::size_t maxOpenFiles)
+{
+    ///Private should not lock
+
+    // close the least recently used files first, but never a file that is being decoded
+    FilesList::iterator it = _files.end();
+    while ( _files.size() > maxOpenFiles && it != _files.begin() ) {
+        --it;
+        if (it->users == 0) {
+            delete it->file;
+            it = _files.erase(it);
+        }
     }
 }
 } // namespace Exr
@@ -548,9 +1078,13 @@ FileManager::get(const string& filename)
 
 ReadEXRPlugin::ReadEXRPlugin(OfxImageEffectHandle handle,
                              const vector<string>& extensions)
-    : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
+    : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles,
+                          (getImageEffectHostDescription() && getImageEffectHostDescription()->isMultiPlanar) ? kIsMultiPlanar : false)
+    , _exrThreads(0)
 {
     Exr::FileManager::s_readerManager.initialize();
+    _exrThreads = fetchIntParam(kParamExrThreads);
+    assert(_exrThreads);
 }
 
 ReadEXRPlugin::~ReadEXRPlugin()
@@ -561,21 +1095,383 @@ void
 ReadEXRPlugin::changedParam(const InstanceChangedArgs &args,
                             const string &paramName)
 {
-    GenericReaderPlugin::changedParam(args, paramName);
+    if (paramName == kParamExrThreads) {
+        // the thread pool is global: only change it when the user asks for it, so that instances
+        // do not override each other (or the host setting) when they are created
+        if (args.reason == eChangeUserEdit) {
+            Exr::setThreadCount( _exrThreads->getValue() );
+        }
+    } else {
+        GenericReaderPlugin::changedParam(args, paramName);
+    }
+}
+
+void
+ReadEXRPlugin::clearAnyCache()
+{
+    // close the files and forget the headers, e.g. when the host purges its caches
+    Exr::FileManager::s_readerManager.purge();
 }
 
-struct DecodingChannelsMap
+// The number of lines compressed together in a block
+static int
+linesPerBlock(Imf_::Compression compression)
+{
+    switch (compression) {
+    case Imf_::NO_COMPRESSION:
+    case Imf_::RLE_COMPRESSION:
+    case Imf_::ZIPS_COMPRESSION:
+
+        return 1;
+    case Imf_::ZIP_COMPRESSION:
+    case Imf_::PXR24_COMPRESSION:
+
+        return 16;
+    case Imf_::PIZ_COMPRESSION:
+    case Imf_::B44_COMPRESSION:
+    case Imf_::B44A_COMPRESSION:
+
+        return 32;
+    default:
+
+        // DWAA uses 32 lines, DWAB 256 lines
+        return 256;
+    }
+}
+
+// A channel to read, and the index of its component in the destination pixels
+struct ChannelSlice
+{
+    string name;
+    int component;
+    int xSampling;
+    int ySampling;
+};
+
+typedef vector<ChannelSlice> ChannelSlices;
+
+// Insert the channels in a frame buffer of float pixels, where the exr pixel (x, y)
+// is at origin + x * xStride + y * yStride
+static void
+insertSlices(const ChannelSlices& slices,
+             char* origin,
+             std::ptrdiff_t xStride,
+             std::ptrdiff_t yStride,
+             Imf_::FrameBuffer* fbuf)
+{
+    for (ChannelSlices::const_iterator it = slices.begin(); it != slices.end(); ++it) {
+        char* base = origin + it->component * sizeof(float);
+        // subsampled channels have one sample every xSampling pixels and every ySampling lines
+        fbuf->insert( it->name.c_str(),
+                      Imf_::Slice(Imf_::FLOAT, base, it->xSampling * xStride, it->ySampling * yStride, it->xSampling, it->ySampling) );
+    }
+}
+
+// Copy the exr pixels [x1, x2] x [y1, y2] between two buffers
+static void
+copyPixels(const char* srcOrigin,
+           std::ptrdiff_t srcYStride,
+           char* dstOrigin,
+           std::ptrdiff_t dstYStride,
+           std::ptrdiff_t pixelBytes,
+           int x1,
+           int x2,
+           int y1,
+           int y2)
+{
+    for (int y = y1; y <= y2; ++y) {
+        std::memcpy( dstOrigin + y * dstYStride + x1 * pixelBytes, srcOrigin + y * srcYStride + x1 * pixelBytes, (x2 - x1 + 1) * pixelBytes );
+    }
+}
+
+// Read the lines [y1, y2] of a scan line part. Only the pixels [x1, x2] of each line are written to the
+// destination buffer, which covers the exr pixels [bufX1, bufX2] of each line.
+static void
+readLines(Imf_::InputPart& part,
+          const ChannelSlices& slices,
+          int x1,
+          int x2,
+          int y1,
+          int y2,
+          char* origin,
+          std::ptrdiff_t pixelBytes,
+          std::ptrdiff_t yStride,
+          int bufX1,
+          int bufX2)
+{
+    const Imath::Box2i& datawin = part.header().dataWindow();
+
+    if ( (bufX1 <= datawin.min.x) && (datawin.max.x <= bufX2) ) {
+        // whole lines fit in the destination buffer: read all the lines at once, so that OpenEXR can
+        // decompress the line blocks in parallel
+        Imf_::FrameBuffer fbuf;
+        insertSlices(slices, origin, pixelBytes, yStride, &fbuf);
+        part.setFrameBuffer(fbuf);
+        part.readPixels(y1, y2);
+
+        return;
+    }
+
+    // Lines are compressed as a whole: read strips of whole lines in a temporary buffer, and only copy
+    // the requested part of each line. Strips end on a block boundary, so that each block is only decompressed once.
+    int width = datawin.max.x - datawin.min.x + 1;
+    int stripLines = std::max( (int)kExrMinStripLines, linesPerBlock( part.header().compression() ) );
+    vector<char> strip( (std::size_t)width * stripLines * pixelBytes, 0 );
+    for (int sy1 = y1; sy1 <= y2; ) {
+        // blocks start at the top of the data window
+        int sy2 = std::min(datawin.min.y + ( (sy1 - datawin.min.y) / stripLines + 1 ) * stripLines - 1, y2);
+        char* stripOrigin = &strip[0] - ( (std::ptrdiff_t)sy1 * width + datawin.min.x ) * pixelBytes;
+        Imf_::FrameBuffer fbuf;
+        insertSlices(slices, stripOrigin, pixelBytes, width * pixelBytes, &fbuf);
+        part.setFrameBuffer(fbuf);
+        part.readPixels(sy1, sy2);
+        copyPixels(stripOrigin, width * pixelBytes, origin, yStride, pixelBytes, x1, x2, sy1, sy2);
+        sy1 = sy2 + 1;
+    }
+} // readLines
+
+// Read the tiles of a tiled part intersecting the pixels [x1, x2] x [y1, y2]. Only these pixels are
+// written to the destination buffer, which covers the exr pixels [bufX1, bufX2] x [bufY1, bufY2].
+static void
+readTiles(Imf_::TiledInputPart& part,
+          const ChannelSlices& slices,
+          int x1,
+          int x2,
+          int y1,
+          int y2,
+          char* origin,
+          std::ptrdiff_t pixelBytes,
+          std::ptrdiff_t yStride,
+          int bufX1,
+          int bufX2,
+          int bufY1,
+          int bufY2)
 {
-    float* buf;
-    bool subsampled;
-    string channelName;
+    const Imath::Box2i& datawin = part.header().dataWindow();
+    int tileWidth = part.tileXSize();
+    int tileHeight = part.tileYSize();
+    // tiles start at the top left corner of the data window
+    int dx1 = (x1 - datawin.min.x) / tileWidth;
+    int dx2 = (x2 - datawin.min.x) / tileWidth;
+    int dy1 = (y1 - datawin.min.y) / tileHeight;
+    int dy2 = (y2 - datawin.min.y) / tileHeight;
+    // the pixels covered by these tiles
+    int tx1 = datawin.min.x + dx1 * tileWidth;
+    int tx2 = std::min(datawin.min.x + (dx2 + 1) * tileWidth - 1, datawin.max.x);
+    int ty1 = datawin.min.y + dy1 * tileHeight;
+    int ty2 = std::min(datawin.min.y + (dy2 + 1) * tileHeight - 1, datawin.max.y);
+
+    if ( (bufX1 <= tx1) && (tx2 <= bufX2) && (bufY1 <= ty1) && (ty2 <= bufY2) ) {
+        // the tiles fit in the destination buffer: read them all at once
+        Imf_::FrameBuffer fbuf;
+        insertSlices(slices, origin, pixelBytes, yStride, &fbuf);
+        part.setFrameBuffer(fbuf);
+        part.readTiles(dx1, dx2, dy1, dy2);
+
+        return;
+    }
+
+    // read one row of tiles at a time in a temporary buffer, and only copy the requested pixels
+    int width = tx2 - tx1 + 1;
+    vector<char> strip( (std::size_t)width * tileHeight * pixelBytes, 0 );
+    for (int dy = dy1; dy <= dy2; ++dy) {
+        int sy1 = datawin.min.y + dy * tileHeight;
+        int sy2 = std::min(sy1 + tileHeight - 1, datawin.max.y);
+        char* stripOrigin = &strip[0] - ( (std::ptrdiff_t)sy1 * width + tx1 ) * pixelBytes;
+        Imf_::FrameBuffer fbuf;
+        insertSlices(slices, stripOrigin, pixelBytes, width * pixelBytes, &fbuf);
+        part.setFrameBuffer(fbuf);
+        part.readTiles(dx1, dx2, dy, dy);
+        copyPixels( stripOrigin, width * pixelBytes, origin, yStride, pixelBytes, x1, x2, std::max(sy1, y1), std::min(sy2, y2) );
+    }
+} // readTiles
+
+// The values computed by flattening deep samples
+enum DeepOutputEnum
+{
+    eDeepOutputRed = 0,
+    eDeepOutputGreen,
+    eDeepOutputBlue,
+    eDeepOutputAlpha,
+    eDeepOutputZ, // the depth of the front sample
+    eDeepOutputZBack, // the back depth of the farthest sample
+    eDeepOutputCount
+};
+
+// Flattens the samples of a block of deep lines, compositing them front to back with the over operator.
+// Lines are processed in parallel.
+class DeepFlattener
+    : public MultiThread::Processor
+{
+    const unsigned int* _sampleCounts;
+    const vector<float*>* _samplePointers; // eDeepOutputCount vectors, empty for absent channels
+    int _width; // the width of the data window
+    int _dataX1; // the first column of the data window
+    int _stripY1; // the first line of the strip
+    const vector<int>& _outputs; // the output computed for each component of the destination pixels, or -1
+    int _x1;
+    int _x2;
+    int _y1;
+    int _y2;
+    char* _origin;
+    std::ptrdiff_t _pixelBytes;
+    std::ptrdiff_t _yStride;
+
+public:
+    DeepFlattener(const unsigned int* sampleCounts,
+                  const vector<float*>* samplePointers,
+                  int width,
+                  int dataX1,
+                  int stripY1,
+                  const vector<int>& outputs,
+                  int x1,
+                  int x2,
+                  int y1,
+                  int y2,
+                  char* origin,
+                  std::ptrdiff_t pixelBytes,
+                  std::ptrdiff_t yStride)
+        : _sampleCounts(sampleCounts)
+        , _samplePointers(samplePointers)
+        , _width(width)
+        , _dataX1(dataX1)
+        , _stripY1(stripY1)
+        , _outputs(outputs)
+        , _x1(x1)
+        , _x2(x2)
+        , _y1(y1)
+        , _y2(y2)
+        , _origin(origin)
+        , _pixelBytes(pixelBytes)
+        , _yStride(yStride)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        const vector<float*>& zPointers = _samplePointers[eDeepOutputZ];
+        const vector<float*>& zBackPointers = _samplePointers[eDeepOutputZBack];
+        const vector<float*>& alphaPointers = _samplePointers[eDeepOutputAlpha];
+        vector<std::pair<float, unsigned int> > order;
+
+        for (int y = _y1 + (int)threadIndex; y <= _y2; y += (int)threadMax) {
+            float* dstRow = (float*)(_origin + y * _yStride + _x1 * _pixelBytes);
+            for (int x = _x1; x <= _x2; ++x, dstRow = (float*)( (char*)dstRow + _pixelBytes )) {
+                std::size_t p = (std::size_t)(y - _stripY1) * _width + (x - _dataX1);
+                unsigned int n = _sampleCounts[p];
+
+                // sort the samples front to back
+                order.resize(n);
+                for (unsigned int i = 0; i < n; ++i) {
+                    order[i] = std::make_pair(zPointers.empty() ? 0.f : zPointers[p][i], i);
+                }
+                if ( !zPointers.empty() ) {
+                    std::sort( order.begin(), order.end() );
+                }
+
+                float values[eDeepOutputCount] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+                if (n > 0) {
+                    if ( !zPointers.empty() ) {
+                        values[eDeepOutputZ] = order[0].first;
+                    }
+                    for (unsigned int k = 0; k < n; ++k) {
+                        unsigned int i = order[k].second;
+                        // samples are premultiplied: behind = 1 - alpha of the samples in front
+                        float behind = 1.f - values[eDeepOutputAlpha];
+                        for (int c = eDeepOutputRed; c <= eDeepOutputBlue; ++c) {
+                            if ( !_samplePointers[c].empty() ) {
+                                values[c] += behind * _samplePointers[c][p][i];
+                            }
+                        }
+                        // samples without alpha are opaque
+                        values[eDeepOutputAlpha] += behind * ( alphaPointers.empty() ? 1.f : alphaPointers[p][i] );
+                        float zBack = zBackPointers.empty() ? ( zPointers.empty() ? 0.f : zPointers[p][i] ) : zBackPointers[p][i];
+                        values[eDeepOutputZBack] = (k == 0) ? zBack : std::max(values[eDeepOutputZBack], zBack);
+                    }
+                }
+                for (std::size_t c = 0; c < _outputs.size(); ++c) {
+                    if (_outputs[c] >= 0) {
+                        dstRow[c] = values[_outputs[c]];
+                    }
+                }
+            }
+        }
+    }
 };
 
+// Read the lines [y1, y2] of a deep scan line part, and flatten the pixels [x1, x2] of each line to the destination
+// buffer. Lines are read by blocks, so that only the samples of one block are in memory at a time.
+static void
+readDeepLines(Imf_::DeepScanLineInputPart& part,
+              const string channelNames[eDeepOutputCount],
+              const vector<int>& outputs,
+              int x1,
+              int x2,
+              int y1,
+              int y2,
+              char* origin,
+              std::ptrdiff_t pixelBytes,
+              std::ptrdiff_t yStride)
+{
+    const Imath::Box2i& datawin = part.header().dataWindow();
+    const int width = datawin.max.x - datawin.min.x + 1;
+    const int stripLines = std::max( (int)kExrMinStripLines, linesPerBlock( part.header().compression() ) );
+    vector<unsigned int> sampleCounts( (std::size_t)width * stripLines );
+    vector<float*> samplePointers[eDeepOutputCount];
+    vector<float> samples[eDeepOutputCount];
+
+    for (int sy1 = y1; sy1 <= y2; ) {
+        // strips end on a block boundary, so that each block is only decompressed once
+        int sy2 = std::min(datawin.min.y + ( (sy1 - datawin.min.y) / stripLines + 1 ) * stripLines - 1, y2);
+        std::size_t stripPixels = (std::size_t)width * (sy2 - sy1 + 1);
+        // the strip buffers start at the pixel (datawin.min.x, sy1)
+        std::ptrdiff_t offset = (std::ptrdiff_t)sy1 * width + datawin.min.x;
+
+        Imf_::DeepFrameBuffer fbuf;
+        fbuf.insertSampleCountSlice( Imf_::Slice( Imf_::UINT, (char*)&sampleCounts[0] - offset * (std::ptrdiff_t)sizeof(unsigned int),
+                                                  sizeof(unsigned int), sizeof(unsigned int) * width ) );
+        for (int c = 0; c < eDeepOutputCount; ++c) {
+            if ( !channelNames[c].empty() ) {
+                samplePointers[c].resize(stripPixels);
+                fbuf.insert( channelNames[c].c_str(),
+                             Imf_::DeepSlice( Imf_::FLOAT, (char*)&samplePointers[c][0] - offset * (std::ptrdiff_t)sizeof(float*),
+                                              sizeof(float*), sizeof(float*) * width, sizeof(float) ) );
+            }
+        }
+        part.setFrameBuffer(fbuf);
+        part.readPixelSampleCounts(sy1, sy2);
+
+        // allocate the samples of the strip only
+        std::size_t totalSamples = 0;
+        for (std::size_t p = 0; p < stripPixels; ++p) {
+            totalSamples += sampleCounts[p];
+        }
+        for (int c = 0; c < eDeepOutputCount; ++c) {
+            if ( !channelNames[c].empty() ) {
+                samples[c].resize( std::max(totalSamples, (std::size_t)1) );
+                float* sample = &samples[c][0];
+                for (std::size_t p = 0; p < stripPixels; ++p) {
+                    samplePointers[c][p] = sample;
+                    sample += sampleCounts[p];
+                }
+            }
+        }
+        part.readPixels(sy1, sy2);
+
+        DeepFlattener flattener(&sampleCounts[0], samplePointers, width, datawin.min.x, sy1, outputs,
+                                x1, x2, sy1, sy2, origin, pixelBytes, yStride);
+        flattener.multiThread( std::min( (unsigned int)(sy2 - sy1 + 1), MultiThread::getNumCPUs() ) );
+
+        sy1 = sy2 + 1;
+    }
+} // readDeepLines
+
 void
 ReadEXRPlugin::decode(const string& filename,
-                      OfxTime /*time*/,
-                      int /*view*/,
-                      bool /*isPlayback*/,
+                      OfxTime time,
+                      int view,
+                      bool isPlayback,
                       const OfxRectI& renderWindow,
                       float *pixelData,
                       const OfxRectI& bounds,
@@ -583,69 +1479,187 @@ ReadEXRPlugin::decode(const string& filename,
                       int pixelComponentCount,
                       int rowBytes)
 {
-    /// we only support RGBA output clip
-    if ( (pixelComponents != ePixelComponentRGBA) || (pixelComponentCount != 4) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
+    decodePlane(filename, time, view, isPlayback, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, kOfxImageComponentRGBA, rowBytes);
+}
+
+void
+ReadEXRPlugin::decodePlane(const string& filename,
+                           OfxTime /*time*/,
+                           int view,
+                           bool /*isPlayback*/,
+                           const OfxRectI& renderWindow,
+                           float *pixelData,
+                           const OfxRectI& bounds,
+                           PixelComponentEnum pixelComponents,
+                           int pixelComponentCount,
+                           const string& rawComponents,
+                           int rowBytes)
+{
+    std::auto_ptr<Exr::FileLease> lease;
+    try {
+        lease.reset( new Exr::FileLease(filename) );
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
+    Exr::File* file = lease->get();
 
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    OfxRectI roi = bounds; // used to be dstImg->getRegionOfDefinition(); why?
-    assert( kSupportsTiles || (renderWindow.x1 == file->dataWindow.x1 && renderWindow.x2 == file->dataWindow.x2 && renderWindow.y1 == file->dataWindow.y1 && renderWindow.y2 == file->dataWindow.y2) );
-
-    for (int y = roi.y1; y < roi.y2; ++y) {
-        map<Exr::Channel, DecodingChannelsMap > channels;
-        for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it != file->channel_map.end(); ++it) {
-            DecodingChannelsMap d;
+    // the view of the file to read
+    string viewName;
+    if ( !file->views.empty() ) {
+        try {
+            viewName = file->getView( getViewName(view) );
+        } catch (const std::exception&) {
+            // the host does not give view names: read the default view
+        }
+    }
 
-            ///This line means we only support FLOAT dst images with the RGBA format.
-            d.buf = (float*)( (char*)pixelData + (y - roi.y1) * rowBytes ) + (int)it->first;
+    // the channels to read, by part: only the channels of the requested plane are decompressed
+    map<int, ChannelSlices> partSlices;
+    // the deep output of each component, if the plane is read from the deep part
+    vector<int> deepOutputs;
+#ifdef OFX_EXTENSIONS_NATRON
+    if (pixelComponents == ePixelComponentCustom) {
+        // a layer of the file
+        vector<string> layerChannels = mapPixelComponentCustomToLayerChannels(rawComponents);
+        if ( ( layerChannels.size() < 2) || ( (int)layerChannels.size() - 1 != pixelComponentCount ) ) {
+            setPersistentMessage(Message::eMessageError, "", "Cannot read the layer " + rawComponents);
+            throwSuiteStatusException(kOfxStatErrFormat);
+
+            return;
+        }
+        if ( (layerChannels[0] == kExrDeepDepthLayer) && file->isDeepDepth() ) {
+            // the depth of the deep samples
+            for (int i = 0; i < pixelComponentCount; ++i) {
+                deepOutputs.push_back( (layerChannels[i + 1] == "Z") ? eDeepOutputZ : (layerChannels[i + 1] == "ZBack") ? eDeepOutputZBack : -1 );
+            }
+        }
+        for (int i = 0; i < pixelComponentCount && deepOutputs.empty(); ++i) {
+            const Exr::ChannelInfo* c = file->findChannel(layerChannels[0], viewName, layerChannels[i + 1]);
+            if (!c) {
+                setPersistentMessage(Message::eMessageError, "", "Could not find channel named " + layerChannels[i + 1]);
+                throwSuiteStatusException(kOfxStatFailed);
 
-            d.subsampled = it->second == "BY" || it->second == "RY";
-            d.channelName = it->second;
-            channels.insert( make_pair(it->first, d) );
+                return;
+            }
+            ChannelSlice slice = { c->name, i, c->xSampling, c->ySampling };
+            partSlices[c->part].push_back(slice);
         }
+    } else
+#else
+    unused(rawComponents);
+#endif
+    {
+        /// we only support RGBA for the color plane
+        if ( (pixelComponents != ePixelComponentRGBA) || (pixelComponentCount != 4) ) {
+            throwSuiteStatusException(kOfxStatErrFormat);
 
-        const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
-        const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
-        int exrY = dispwin.max.y - y;
-        //int r = roi.x2;
-        //int x = roi.x1;
+            return;
+        }
+        if (file->deepColor) {
+            // flatten the deep part
+            for (int i = 0; i < 4; ++i) {
+                deepOutputs.push_back(eDeepOutputRed + i);
+            }
+        }
+        for (vector<Exr::ChannelInfo>::const_iterator c = file->channels.begin(); c != file->channels.end() && deepOutputs.empty(); ++c) {
+            if ( (c->layer == file->colorLayer) && (c->view == viewName) && (c->mappedChannel != Exr::Channel_none) ) {
+                ChannelSlice slice = { c->name, (int)c->mappedChannel, c->xSampling, c->ySampling };
+                partSlices[c->part].push_back(slice);
+            }
+        }
+    }
 
-        //const int X = std::max(x, datawin.min.x + file->dataOffset);
-        //const int R = std::min(r, datawin.max.x + file->dataOffset + 1);
+    assert(bounds.x1 <= renderWindow.x1 && renderWindow.x2 <= bounds.x2 && bounds.y1 <= renderWindow.y1 && renderWindow.y2 <= bounds.y2);
+    const Imath::Box2i& dispwin = file->inputfile->header(0).displayWindow();
+    const std::ptrdiff_t pixelBytes = pixelComponentCount * sizeof(float);
+    // exr pixel (x, y) goes to the OFX pixel (x + dataOffset, dispwin.max.y - y): exr lines are numbered
+    // from the top, so the buffer is flipped by using a negative y stride.
+    char* origin = (char*)pixelData + (std::ptrdiff_t)(dispwin.max.y - bounds.y1) * rowBytes + (std::ptrdiff_t)(file->dataOffset - bounds.x1) * pixelBytes;
+    std::ptrdiff_t yStride = -(std::ptrdiff_t)rowBytes;
+    // the part of the destination buffer, in exr coordinates
+    int bufX1 = bounds.x1 - file->dataOffset;
+    int bufX2 = bounds.x2 - 1 - file->dataOffset;
+    int bufY1 = dispwin.max.y - (bounds.y2 - 1);
+    int bufY2 = dispwin.max.y - bounds.y1;
+
+    // tiles of the same file may be decoded concurrently
+    AutoMutex locker(file->lock);
+    if ( !deepOutputs.empty() ) {
+        assert(file->deepInputPart);
+        const Imath::Box2i& datawin = file->deepInputPart->header().dataWindow();
+        int exrX1 = std::max(datawin.min.x, renderWindow.x1 - file->dataOffset);
+        int exrX2 = std::min(datawin.max.x, renderWindow.x2 - 1 - file->dataOffset);
+        int exrY1 = std::max(datawin.min.y, dispwin.max.y - (renderWindow.y2 - 1));
+        int exrY2 = std::min(datawin.max.y, dispwin.max.y - renderWindow.y1);
+        if ( (exrX1 > exrX2) || (exrY1 > exrY2) ) {
+            return;
+        }
+        const string channelNames[eDeepOutputCount] = {
+            file->deepChannels[0], file->deepChannels[1], file->deepChannels[2], file->deepChannels[3], file->deepZ, file->deepZBack
+        };
+        try {
+            readDeepLines(*file->deepInputPart, channelNames, deepOutputs, exrX1, exrX2, exrY1, exrY2, origin, pixelBytes, yStride);
+        } catch (const std::exception& e) {
+            setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        }
 
-        // if we're below or above the data window
-        if ( (exrY < datawin.min.y) || (exrY > datawin.max.y) /* || R <= X*/ ) {
+        return;
+    }
+    for (map<int, ChannelSlices>::const_iterator it = partSlices.begin(); it != partSlices.end(); ++it) {
+        const Imath::Box2i& datawin = file->inputfile->header(it->first).dataWindow();
+        // the part of the data window covered by the render window, in exr coordinates
+        int exrX1 = std::max(datawin.min.x, renderWindow.x1 - file->dataOffset);
+        int exrX2 = std::min(datawin.max.x, renderWindow.x2 - 1 - file->dataOffset);
+        int exrY1 = std::max(datawin.min.y, dispwin.max.y - (renderWindow.y2 - 1));
+        int exrY2 = std::min(datawin.max.y, dispwin.max.y - renderWindow.y1);
+        if ( (exrX1 > exrX2) || (exrY1 > exrY2) ) {
+            // the render window is outside of the data window
             continue;
         }
-
-        Imf_::FrameBuffer fbuf;
-        for (map<Exr::Channel, DecodingChannelsMap >::const_iterator z = channels.begin(); z != channels.end(); ++z) {
-            if (!z->second.subsampled) {
-                fbuf.insert( z->second.channelName.c_str(),
-                             Imf_::Slice(Imf_::FLOAT, (char*)(z->second.buf /*+ file->dataOffset*/), sizeof(float) * 4, 0) );
+        try {
+            if (file->tiledParts[it->first]) {
+                readTiles(*file->tiledParts[it->first], it->second, exrX1, exrX2, exrY1, exrY2, origin, pixelBytes, yStride, bufX1, bufX2, bufY1, bufY2);
             } else {
-                fbuf.insert( z->second.channelName.c_str(),
-                             Imf_::Slice(Imf_::FLOAT, (char*)(z->second.buf /*+ file->dataOffset*/), sizeof(float) * 4, 0, 2, 2) );
+                assert(file->parts[it->first]);
+                readLines(*file->parts[it->first], it->second, exrX1, exrX2, exrY1, exrY2, origin, pixelBytes, yStride, bufX1, bufX2);
             }
+        } catch (const std::exception& e) {
+            setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+
+            return;
         }
-        {
-#ifdef OFX_IO_MT_EXR
-            MultiThread::AutoMutex locker(file->lock);
-#endif
-            try {
-                file->inputfile->setFrameBuffer(fbuf);
-                file->inputfile->readPixels(exrY);
-            } catch (const std::exception& e) {
-                setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+    }
+} // ReadEXRPlugin::decodePlane
 
-                return;
-            }
+void
+ReadEXRPlugin::getClipComponents(const ClipComponentsArguments& args,
+                                 ClipComponentsSetter& clipComponents)
+{
+    //Should only be called if multi-planar
+    assert( isMultiPlanar() );
+
+    clipComponents.addClipComponents( *_outputClip, getOutputComponents() );
+    clipComponents.setPassThroughClip(NULL, args.time, args.view);
+
+    // the layers of the file at this time, from the header cache
+    string filename;
+    Exr::FileInfo info;
+    if ( (getFilenameAtTime(args.time, &filename) != kOfxStatOK) || !Exr::FileManager::s_readerManager.getInfo(filename, &info, NULL) ) {
+        return;
+    }
+    for (vector<string>::const_iterator it = info.layers.begin(); it != info.layers.end(); ++it) {
+        vector<string> layerChannels = info.getLayerChannels(*it);
+        //WARNING: We do NOT allow layers with more than 4 channels
+        if ( layerChannels.empty() || (layerChannels.size() > 4) ) {
+            continue;
         }
+        clipComponents.addClipComponents( *_outputClip, MultiPlane::Utils::makeNatronCustomChannel(*it, layerChannels) );
     }
-} // ReadEXRPlugin::decode
+}
+
 
 /**
  * @brief Called when the input image/video file changed.
@@ -675,10 +1689,11 @@ ReadEXRPlugin::guessParamsFromFilename(const string& newFile,
 {
     assert(colorspace && filePremult && components && componentCount);
 
-    Exr::File* file = newFile.empty() ? NULL : Exr::FileManager::s_readerManager.get(newFile);
-    if (!file) {
+    Exr::FileInfo info;
+    if ( newFile.empty() || !Exr::FileManager::s_readerManager.getInfo(newFile, &info, NULL) ) {
         return false;
     }
+    const Exr::FileInfo* file = &info;
 
 # ifdef OFX_IO_USING_OCIO
     // Unless otherwise specified, exr files are assumed to be linear.
@@ -738,14 +1753,11 @@ ReadEXRPlugin::getFrameBounds(const string& filename,
                               int* tile_height)
 {
     assert(bounds && par);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    if (!file) {
-        if (error) {
-            *error = "No such file";
-        }
-
+    Exr::FileInfo info;
+    if ( !Exr::FileManager::s_readerManager.getInfo(filename, &info, error) ) {
         return false;
     }
+    const Exr::FileInfo* file = &info;
     bounds->x1 = file->dataWindow.x1;
     bounds->x2 = file->dataWindow.x2;
     bounds->y1 = file->dataWindow.y1;
@@ -779,7 +1791,7 @@ ReadEXRPluginFactory::load()
 void
 ReadEXRPluginFactory::describe(ImageEffectDescriptor &desc)
 {
-    GenericReaderDescribe(desc, _extensions, kPluginEvaluation, kSupportsTiles, false);
+    GenericReaderDescribe(desc, _extensions, kPluginEvaluation, kSupportsTiles, kIsMultiPlanar);
     // basic labels
     desc.setLabel("ReadEXROFX");
     desc.setPluginDescription("Read EXR images using OpenEXR.");
@@ -799,6 +1811,18 @@ ReadEXRPluginFactory::describeInContext(ImageEffectDescriptor &desc,
     PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(),
                                                                     kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, true);
 
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamExrThreads);
+        param->setLabel(kParamExrThreadsLabel);
+        param->setHint(kParamExrThreadsHint);
+        param->setAnimates(false);
+        param->setDefault(0);
+        param->setRange(0, 64);
+        param->setDisplayRange(0, 16);
+        param->setLayoutHint(eLayoutHintDivider);
+        page->addChild(*param);
+    }
+
     GenericReaderDescribeInContextEnd(desc, context, page, "scene_linear", "scene_linear");
 }
 
@@ -21,21 +21,28 @@
  * Writes a an output image using the OpenEXR library.
  */
 
+#include <algorithm>
 #include <memory>
-#include <ImfChannelList.h>
-#include <ImfArray.h>
-#include <ImfOutputFile.h>
-#include <half.h>
-
+#include <vector>
+#include <list>
+#include <map>
+#include <cstddef> // size_t, ptrdiff_t
 
 #include <ImfChannelList.h>
 #include <IlmThreadPool.h>
-#include <ImfArray.h>
-#include <ImfOutputFile.h>
+#include <ImfMultiPartOutputFile.h>
+#include <ImfTiledOutputPart.h>
+#include <ImfPartType.h>
+#include <ImfStandardAttributes.h>
+#include <ImfThreading.h>
 #include <half.h>
 
+#include <ofxsMultiThread.h>
+#include <ofxsMultiPlane.h>
+
 #include "GenericOCIO.h"
 #include "GenericWriter.h"
+#include "WriteEXRPart.h"
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -45,6 +52,7 @@ namespace OCIO = OCIO_NAMESPACE;
 
 using std::string;
 using std::vector;
+using std::map;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
@@ -59,6 +67,62 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamWriteEXRCompression "compression"
 #define kParamWriteEXRDataType "dataType"
 
+#define kParamExrThreads "exrThreads"
+#define kParamExrThreadsLabel "Encoding Threads"
+#define kParamExrThreadsHint "Number of threads used by OpenEXR to compress the blocks of lines of an image in parallel " \
+    "(0 leaves the thread count set by the host, or the OpenEXR default, unchanged). OpenEXR has a single thread pool, so " \
+    "this setting is global: it is applied when it is edited, and it is shared by all the OpenEXR readers and writers."
+
+#define kParamTileSize "tileSize"
+#define kParamTileSizeLabel "Tile Size"
+#define kParamTileSizeHint "Size of a tile in the output file. If scan-line based, the file is written by lines. " \
+    "Tiled files let readers only decode the part of the image they need."
+#define kParamTileSizeOptionScanLineBased "Scan-Line Based"
+#define kParamTileSizeOption64 "64"
+#define kParamTileSizeOption128 "128"
+#define kParamTileSizeOption256 "256"
+#define kParamTileSizeOption512 "512"
+
+enum EParamTileSize
+{
+    eParamTileSizeScanLineBased = 0,
+    eParamTileSize64,
+    eParamTileSize128,
+    eParamTileSize256,
+    eParamTileSize512
+};
+
+#define kParamMipmap "mipmap"
+#define kParamMipmapLabel "Mipmap"
+#define kParamMipmapHint "Also write reduced resolution versions of the image (mipmap levels), computed with a box filter, " \
+    "so that readers can fetch the image at a lower resolution. Only available for tiled files."
+
+#define kParamOutputChannels kNatronOfxParamOutputChannels
+#define kParamOutputChannelsChoice kParamOutputChannels "Choice"
+#define kParamOutputChannelsLabel "Layer(s)"
+#define kParamOutputChannelsHint "Select which layer to write to the file. This is either All or a single layer."
+
+#define kParamPartsSplitting "partSplitting"
+#define kParamPartsSplittingLabel "Parts"
+#define kParamPartsSplittingHint "Defines whether to separate views/layers in different EXR parts or not. " \
+    "Note that multi-part files are only supported by OpenEXR >= 2"
+
+#define kParamPartsSinglePart "Single Part"
+#define kParamPartsSinglePartHint "All views and layers will be in the same part, ensuring compatibility with OpenEXR 1.x"
+
+#define kParamPartsSlitViews "Split Views"
+#define kParamPartsSlitViewsHint "All views will have its own part, and each part will contain all layers. This will produce an EXR optimized in size that " \
+    "can be opened only with applications supporting OpenEXR 2"
+
+#define kParamPartsSplitViewsLayers "Split Views,Layers"
+#define kParamPartsSplitViewsLayersHint "Each layer of each view will have its own part. This will produce an EXR optimized for decoding speed that " \
+    "can be opened only with applications supporting OpenEXR 2"
+
+#define kParamViewsSelector "viewsSelector"
+#define kParamViewsSelectorLabel "Views"
+#define kParamViewsSelectorHint "Select the views to render. When choosing All, make sure the output filename does not have a %v or %V view " \
+    "pattern in which case each view would be written to a separate file."
+
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
@@ -72,6 +136,18 @@ namespace Imf_ = OPENEXR_IMF_NAMESPACE;
 
 
 namespace Exr {
+// Set the number of threads used by OpenEXR. 0 leaves the current thread count unchanged
+static void
+setThreadCount(int threads)
+{
+    if (threads <= 0) {
+        return;
+    }
+    if (Imf_::globalThreadCount() != threads) {
+        Imf_::setGlobalThreadCount(threads);
+    }
+}
+
 static const char* compressionNames[6] = {
     "No compression",
     "Zip (1 scanline)",
@@ -110,7 +186,35 @@ depthNameToInt(const string& name)
         return 32;
     }
 }
+
+// Reduce an image of nComps interleaved floats to the size of the next mipmap level (half the size,
+// rounded down) with a box filter
+static void
+halveImage(const vector<float>& src,
+           int srcWidth,
+           int srcHeight,
+           int nComps,
+           vector<float>* dst,
+           int dstWidth,
+           int dstHeight)
+{
+    dst->resize( (std::size_t)dstWidth * dstHeight * nComps );
+    for (int y = 0; y < dstHeight; ++y) {
+        const float* row0 = &src[(std::size_t)std::min(2 * y, srcHeight - 1) * srcWidth * nComps];
+        const float* row1 = &src[(std::size_t)std::min(2 * y + 1, srcHeight - 1) * srcWidth * nComps];
+        float* dstRow = &(*dst)[(std::size_t)y * dstWidth * nComps];
+        for (int x = 0; x < dstWidth; ++x) {
+            int x0 = std::min(2 * x, srcWidth - 1) * nComps;
+            int x1 = std::min(2 * x + 1, srcWidth - 1) * nComps;
+            for (int c = 0; c < nComps; ++c) {
+                dstRow[x * nComps + c] = 0.25f * (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c]);
+            }
+        }
+    }
 }
+} // namespace Exr
+
+struct WriteEXREncodePartsData;
 
 class WriteEXRPlugin
     : public GenericWriterPlugin
@@ -122,10 +226,14 @@ public:
 
     virtual ~WriteEXRPlugin();
 
-    //virtual void changedParam(const InstanceChangedArgs &args, const string &paramName);
+    virtual void changedParam(const InstanceChangedArgs &args, const string &paramName) OVERRIDE FINAL;
+    virtual void getClipPreferences(ClipPreferencesSetter &clipPreferences) OVERRIDE FINAL;
+    virtual void getClipComponents(const ClipComponentsArguments& args, ClipComponentsSetter& clipComponents) OVERRIDE FINAL;
 
 private:
 
+    virtual LayerViewsPartsEnum getPartsSplittingPreference() const OVERRIDE FINAL;
+    virtual int getViewToRender() const OVERRIDE FINAL;
     virtual void encode(const string& filename,
                         const OfxTime time,
                         const string& viewName,
@@ -136,12 +244,40 @@ private:
                         const int dstNCompsStartIndex,
                         const int dstNComps,
                         const int rowBytes) OVERRIDE FINAL;
+    virtual void beginEncodeParts(void* user_data,
+                                  const string& filename,
+                                  OfxTime time,
+                                  float pixelAspectRatio,
+                                  LayerViewsPartsEnum partsSplitting,
+                                  const map<int, string>& viewsToRender,
+                                  const std::list<string>& planes,
+                                  const bool packingRequired,
+                                  const vector<int>& packingMapping,
+                                  const OfxRectI& bounds) OVERRIDE FINAL;
+    virtual void encodePart(void* user_data, const string& filename, const float *pixelData, int pixelDataNComps, int planeIndex, int rowBytes) OVERRIDE FINAL;
+    virtual void endEncodeParts(void* user_data) OVERRIDE FINAL;
+    void encodeTiledPart(WriteEXREncodePartsData* data, const float *pixelData, int pixelDataNComps, int planeIndex, int rowBytes);
+    virtual void* allocateEncodePlanesUserData() OVERRIDE FINAL;
+    virtual void destroyEncodePlanesUserData(void* data) OVERRIDE FINAL;
     virtual bool isImageFile(const string& fileExtension) const OVERRIDE FINAL;
     virtual PreMultiplicationEnum getExpectedInputPremultiplication() const OVERRIDE FINAL { return eImagePreMultiplied; }
 
     virtual void onOutputFileChanged(const string& newFile, bool setColorSpace) OVERRIDE FINAL;
+
+    // Append the channels of a plane to a part, prefix is prepended to the channel names (e.g. "left.").
+    // If packingRequired, only the channels of packingMapping are written, and if packedComponents the
+    // pixels only hold these channels.
+    void addPlaneChannels(const string& plane, const string& prefix, bool packingRequired, const vector<int>& packingMapping, bool packedComponents, Exr::PartChannels* part) const;
+
     ChoiceParam* _compression;
     ChoiceParam* _bitDepth;
+    ChoiceParam* _tileSize;
+    BooleanParam* _mipmap;
+    IntParam* _exrThreads;
+    ChoiceParam* _outputLayers;
+    ChoiceParam* _parts;
+    ChoiceParam* _views;
+    std::list<string> _availableViews;
 };
 
 WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle,
@@ -149,114 +285,558 @@ WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle,
     : GenericWriterPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha)
     , _compression(0)
     , _bitDepth(0)
+    , _tileSize(0)
+    , _mipmap(0)
+    , _exrThreads(0)
+    , _outputLayers(0)
+    , _parts(0)
+    , _views(0)
+    , _availableViews()
 {
+# if OFX_EXTENSIONS_NATRON && OFX_EXTENSIONS_NUKE
+    const bool enableMultiPlaneFeature = ( getImageEffectHostDescription()->supportsDynamicChoices &&
+                                           getImageEffectHostDescription()->isMultiPlanar &&
+                                           fetchSuite(kFnOfxImageEffectPlaneSuite, 2, true) );
+# else
+    const bool enableMultiPlaneFeature = false;
+# endif
     _compression = fetchChoiceParam(kParamWriteEXRCompression);
     _bitDepth = fetchChoiceParam(kParamWriteEXRDataType);
+    _tileSize = fetchChoiceParam(kParamTileSize);
+    _mipmap = fetchBooleanParam(kParamMipmap);
+    _exrThreads = fetchIntParam(kParamExrThreads);
+    assert(_tileSize && _mipmap && _exrThreads);
+    _mipmap->setEnabled(_tileSize->getValue() != eParamTileSizeScanLineBased);
+    if (enableMultiPlaneFeature) {
+        _outputLayers = fetchChoiceParam(kParamOutputChannels);
+        fetchDynamicMultiplaneChoiceParameter(kParamOutputChannels, _outputClip);
+        _parts = fetchChoiceParam(kParamPartsSplitting);
+        _views = fetchChoiceParam(kParamViewsSelector);
+    }
 }
 
 WriteEXRPlugin::~WriteEXRPlugin()
 {
 }
 
-//void WriteEXRPlugin::changedParam(const InstanceChangedArgs &/*args*/, const string &paramName)
-//{
-//}
+static bool
+hasListChanged(const std::list<string>& oldList,
+               const std::list<string>& newList)
+{
+    if ( oldList.size() != newList.size() ) {
+        return true;
+    }
+
+    std::list<string>::const_iterator itNew = newList.begin();
+    for (std::list<string>::const_iterator it = oldList.begin(); it != oldList.end(); ++it, ++itNew) {
+        if (*it != *itNew) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+WriteEXRPlugin::changedParam(const InstanceChangedArgs &args,
+                             const string &paramName)
+{
+    if (paramName == kParamExrThreads) {
+        // the thread pool is global: only change it when the user asks for it, so that instances
+        // do not override each other (or the host setting) when they are created
+        if (args.reason == eChangeUserEdit) {
+            Exr::setThreadCount( _exrThreads->getValue() );
+        }
+
+        return;
+    }
+    if (paramName == kParamTileSize) {
+        _mipmap->setEnabled(_tileSize->getValue() != eParamTileSizeScanLineBased);
+
+        return;
+    }
+    if ( handleChangedParamForAllDynamicChoices(paramName, args.reason) ) {
+        return;
+    }
+    GenericWriterPlugin::changedParam(args, paramName);
+}
+
+void
+WriteEXRPlugin::getClipPreferences(ClipPreferencesSetter &clipPreferences)
+{
+    if ( _outputLayers && !_outputLayers->getIsSecret() ) {
+        // exr files can hold any number of channels
+        buildChannelMenus(string(), true /*mergeMenus*/, true /*supportsNChannels*/);
+
+        string ofxPlane, ofxComponents;
+        getPlaneNeededInOutput(&ofxPlane, &ofxComponents);
+
+        if (ofxComponents == kPlaneLabelAll) {
+            _outputComponents->setIsSecretAndDisabled(true);
+            for (int i = 0; i < 4; ++i) {
+                _processChannels[i]->setIsSecretAndDisabled(true);
+            }
+        } else {
+            _outputComponents->setIsSecretAndDisabled(false);
+        }
+    }
+
+    if (_views) {
+        //Now build the views choice
+        std::list<string> views;
+        int nViews = getViewCount();
+        for (int i = 0; i < nViews; ++i) {
+            string view = getViewName(i);
+            views.push_back(view);
+        }
+        if ( hasListChanged(_availableViews, views) ) {
+            _availableViews = views;
+            _views->resetOptions();
+            _views->appendOption("All");
+            for (std::list<string>::iterator it = views.begin(); it != views.end(); ++it) {
+                _views->appendOption(*it);
+            }
+        }
+    }
+    GenericWriterPlugin::getClipPreferences(clipPreferences);
+}
+
+void
+WriteEXRPlugin::getClipComponents(const ClipComponentsArguments& /*args*/,
+                                  ClipComponentsSetter& clipComponents)
+{
+    if ( _outputLayers && !_outputLayers->getIsSecret() ) {
+        string ofxPlane, ofxComp;
+        getPlaneNeededInOutput(&ofxPlane, &ofxComp);
 
+        if (ofxPlane == kPlaneLabelAll) {
+            const vector<string>& components = getCachedComponentsPresent(_outputClip);
+            for (vector<string>::const_iterator it = components.begin(); it != components.end(); ++it) {
+                clipComponents.addClipComponents(*_inputClip, *it);
+                clipComponents.addClipComponents(*_outputClip, *it);
+            }
+        } else {
+            clipComponents.addClipComponents(*_inputClip, ofxComp);
+            clipComponents.addClipComponents(*_outputClip, ofxComp);
+        }
+    } else {
+        PixelComponentEnum inputComponents = _inputClip->getPixelComponents();
+        clipComponents.addClipComponents(*_inputClip, inputComponents);
+        PixelComponentEnum outputComponents = _outputClip->getPixelComponents();
+        clipComponents.addClipComponents(*_outputClip, outputComponents);
+    }
+}
+
+int
+WriteEXRPlugin::getViewToRender() const
+{
+    if ( !_views || _views->getIsSecret() ) {
+        return kGenericWriterViewDefault;
+    } else {
+        int view_i;
+        _views->getValue(view_i);
+
+        return view_i - 1;
+    }
+}
+
+LayerViewsPartsEnum
+WriteEXRPlugin::getPartsSplittingPreference() const
+{
+    if ( !_parts || _parts->getIsSecret() ) {
+        return eLayerViewsSinglePart;
+    }
+    int index;
+    _parts->getValue(index);
+    string option;
+    _parts->getOption(index, option);
+    if (option == kParamPartsSinglePart) {
+        return eLayerViewsSinglePart;
+    } else if (option == kParamPartsSlitViews) {
+        return eLayerViewsSplitViews;
+    } else if (option == kParamPartsSplitViewsLayers) {
+        return eLayerViewsSplitViewsLayers;
+    }
+
+    return eLayerViewsSinglePart;
+}
+
+struct WriteEXREncodePartsData
+{
+    std::auto_ptr<Imf_::MultiPartOutputFile> file;
+    vector<Exr::PartChannels> parts;
+    Imf_::PixelType pixelType;
+    OfxRectI bounds;
+    bool tiled;
+    bool mipmap;
+};
 
 void
 WriteEXRPlugin::encode(const string& filename,
-                       const OfxTime /*time*/,
-                       const string& /*viewName*/,
+                       const OfxTime time,
+                       const string& viewName,
                        const float *pixelData,
                        const OfxRectI& bounds,
                        const float pixelAspectRatio,
                        const int pixelDataNComps,
-                       const int /*dstNCompsStartIndex*/,
-                       const int /*dstNComps*/,
+                       const int dstNCompsStartIndex,
+                       const int dstNComps,
                        const int rowBytes)
 {
-    ///FIXME: WriteEXR should not disregard dstNComps
+    string plane;
 
-    if ( (pixelDataNComps != 4) && (pixelDataNComps != 3) && (pixelDataNComps != 1) ) {
+    switch (dstNComps) {
+    case 1:
+        plane = kOfxImageComponentAlpha;
+        break;
+    case 3:
+        plane = kOfxImageComponentRGB;
+        break;
+    case 4:
+        plane = kOfxImageComponentRGBA;
+        break;
+    default:
         setPersistentMessage(Message::eMessageError, "", "EXR: can only write RGBA, RGB, or Alpha components images");
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
     }
+    assert(dstNCompsStartIndex + dstNComps <= pixelDataNComps);
 
-    assert(pixelDataNComps);
-    try {
-        int compressionIndex;
-        _compression->getValue(compressionIndex);
-
-        Imf_::Compression compression( Exr::stringToCompression(Exr::compressionNames[compressionIndex]) );
+    // a single part with the written components
+    std::list<string> planes;
+    planes.push_back(plane);
+    map<int, string> viewsToRender;
+    viewsToRender[0] = viewName;
+    EncodePlanesLocalData_RAII data(this);
+    beginEncodeParts(data.getData(), filename, time, pixelAspectRatio, eLayerViewsSinglePart, viewsToRender, planes, false, vector<int>(), bounds);
+    // the written components start at dstNCompsStartIndex in the pixels (e.g. Alpha packed in RGBA)
+    WriteEXREncodePartsData* partsData = (WriteEXREncodePartsData*)data.getData();
+    for (std::size_t i = 0; i < partsData->parts.size(); ++i) {
+        vector<int>& components = partsData->parts[i].components;
+        for (std::size_t c = 0; c < components.size(); ++c) {
+            components[c] += dstNCompsStartIndex;
+        }
+    }
+    encodePart(data.getData(), filename, pixelData, pixelDataNComps, 0, rowBytes);
+    endEncodeParts( data.getData() );
+}
 
-        int depthIndex;
-        _bitDepth->getValue(depthIndex);
+void*
+WriteEXRPlugin::allocateEncodePlanesUserData()
+{
+    WriteEXREncodePartsData* data = new WriteEXREncodePartsData;
 
-        int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
-        Imath::Box2i exrDataW;
+    return data;
+}
 
-        exrDataW.min.x = bounds.x1;
-        exrDataW.min.y = bounds.y1;
-        exrDataW.max.x = bounds.x2 - 1;
-        exrDataW.max.y = bounds.y2 - 1;
+void
+WriteEXRPlugin::destroyEncodePlanesUserData(void* data)
+{
+    assert(data);
+    WriteEXREncodePartsData* d = (WriteEXREncodePartsData*)data;
+    delete d;
+}
 
-        Imath::Box2i exrDispW;
-        exrDispW.min.x = 0;
-        exrDispW.min.y = 0;
-        exrDispW.max.x = (bounds.x2 - bounds.x1);
-        exrDispW.max.y = (bounds.y2 - bounds.y1);
+void
+WriteEXRPlugin::addPlaneChannels(const string& plane,
+                                 const string& prefix,
+                                 bool packingRequired,
+                                 const vector<int>& packingMapping,
+                                 bool packedComponents,
+                                 Exr::PartChannels* part) const
+{
+    string layer, pairedLayer;
+    vector<string> planeChannels;
+    string rawComponents;
 
-        Imf_::Header exrheader(exrDispW, exrDataW, pixelAspectRatio,
-                               Imath::V2f(0, 0), 1, Imf_::INCREASING_Y, compression);
+    if (plane == kFnOfxImagePlaneColour) {
+        rawComponents = _inputClip->getPixelComponentsProperty();
+    } else {
+        rawComponents = plane;
+    }
+    MultiPlane::Utils::extractChannelsFromComponentString(rawComponents, &layer, &pairedLayer, &planeChannels);
+    if ( !layer.empty() ) {
+        for (std::size_t i = 0; i < planeChannels.size(); ++i) {
+            planeChannels[i] = layer + "." + planeChannels[i];
+        }
+    }
 
-        Imf_::PixelType pixelType;
-        if (depth == 32) {
-            pixelType = Imf_::FLOAT;
-        } else {
-            assert(depth == 16);
-            pixelType = Imf_::HALF;
+    // the components of the part are numbered from the beginning of the part pixels
+    int first = part->names.empty() ? 0 : part->components.back() + 1;
+    if (!packingRequired) {
+        for (std::size_t i = 0; i < planeChannels.size(); ++i) {
+            part->names.push_back(prefix + planeChannels[i]);
+            part->components.push_back( first + (int)i );
+        }
+    } else {
+        assert( planeChannels.size() >= packingMapping.size() );
+        for (std::size_t i = 0; i < packingMapping.size(); ++i) {
+            part->names.push_back(prefix + planeChannels[packingMapping[i]]);
+            part->components.push_back( first + (packedComponents ? (int)i : packingMapping[i]) );
         }
+    }
+}
+
+void
+WriteEXRPlugin::beginEncodeParts(void* user_data,
+                                 const string& filename,
+                                 OfxTime /*time*/,
+                                 float pixelAspectRatio,
+                                 LayerViewsPartsEnum partsSplitting,
+                                 const map<int, string>& viewsToRender,
+                                 const std::list<string>& planes,
+                                 const bool packingRequired,
+                                 const vector<int>& packingMapping,
+                                 const OfxRectI& bounds)
+{
+    assert( (packingRequired && planes.size() == 1) || !packingRequired );
+    assert( !viewsToRender.empty() );
+    assert( !planes.empty() );
+    assert(user_data);
+    WriteEXREncodePartsData* data = (WriteEXREncodePartsData*)user_data;
+
+    int compressionIndex;
+    _compression->getValue(compressionIndex);
+    Imf_::Compression compression( Exr::stringToCompression(Exr::compressionNames[compressionIndex]) );
+
+    int depthIndex;
+    _bitDepth->getValue(depthIndex);
+    int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
+    if (depth == 32) {
+        data->pixelType = Imf_::FLOAT;
+    } else {
+        assert(depth == 16);
+        data->pixelType = Imf_::HALF;
+    }
+    data->bounds = bounds;
+
+    int tileSize = 0;
+    switch ( (EParamTileSize)_tileSize->getValue() ) {
+    case eParamTileSize64:
+        tileSize = 64;
+        break;
+    case eParamTileSize128:
+        tileSize = 128;
+        break;
+    case eParamTileSize256:
+        tileSize = 256;
+        break;
+    case eParamTileSize512:
+        tileSize = 512;
+        break;
+    case eParamTileSizeScanLineBased:
+    default:
+        break;
+    }
+    data->tiled = (tileSize > 0);
+    data->mipmap = data->tiled && _mipmap->getValue();
 
-        const char* chanNames[4] = { "R", "G", "B", "A" };
-        if (pixelDataNComps == 1) {
-            chanNames[0] = chanNames[3];
+    Imath::Box2i exrDataW;
+    exrDataW.min.x = bounds.x1;
+    exrDataW.min.y = bounds.y1;
+    exrDataW.max.x = bounds.x2 - 1;
+    exrDataW.max.y = bounds.y2 - 1;
+
+    Imath::Box2i exrDispW;
+    exrDispW.min.x = 0;
+    exrDispW.min.y = 0;
+    exrDispW.max.x = (bounds.x2 - bounds.x1);
+    exrDispW.max.y = (bounds.y2 - bounds.y1);
+
+    Imf_::Header exrheader(exrDispW, exrDataW, pixelAspectRatio,
+                           Imath::V2f(0, 0), 1, Imf_::INCREASING_Y, compression);
+    if (data->tiled) {
+        exrheader.setTileDescription( Imf_::TileDescription(tileSize, tileSize,
+                                                            data->mipmap ? Imf_::MIPMAP_LEVELS : Imf_::ONE_LEVEL,
+                                                            Imf_::ROUND_DOWN) );
+    }
+
+    vector<Imf_::Header> headers;
+    data->parts.clear();
+    switch (partsSplitting) {
+    case eLayerViewsSinglePart: {
+        // all views and layers in one part: the channels of the views other than the main view are prefixed by the view name
+        Exr::PartChannels part;
+        if (viewsToRender.size() > 1) {
+            Imf_::StringVector views;
+            for (map<int, string>::const_iterator view = viewsToRender.begin(); view != viewsToRender.end(); ++view) {
+                views.push_back(view->second);
+            }
+            Imf_::addMultiView(exrheader, views);
         }
-        for (int chan = 0; chan < pixelDataNComps; ++chan) {
-            exrheader.channels().insert( chanNames[chan], Imf_::Channel(pixelType) );
+        for (map<int, string>::const_iterator view = viewsToRender.begin(); view != viewsToRender.end(); ++view) {
+            string prefix = ( view == viewsToRender.begin() ) ? string() : view->second + ".";
+            for (std::list<string>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+                addPlaneChannels(*it, prefix, packingRequired, packingMapping, true, &part);
+            }
         }
+        headers.push_back(exrheader);
+        data->parts.push_back(part);
+        break;
+    }
+    case eLayerViewsSplitViews: {
+        // one part per view, with all layers
+        for (map<int, string>::const_iterator view = viewsToRender.begin(); view != viewsToRender.end(); ++view) {
+            Exr::PartChannels part;
+            for (std::list<string>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+                addPlaneChannels(*it, string(), packingRequired, packingMapping, true, &part);
+            }
+            Imf_::Header partHeader(exrheader);
+            partHeader.setName(view->second);
+            partHeader.setView(view->second);
+            headers.push_back(partHeader);
+            data->parts.push_back(part);
+        }
+        break;
+    }
+    case eLayerViewsSplitViewsLayers: {
+        // one part per layer of each view: the pixels of each plane are passed as they were fetched
+        for (map<int, string>::const_iterator view = viewsToRender.begin(); view != viewsToRender.end(); ++view) {
+            for (std::list<string>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+                Exr::PartChannels part;
+                addPlaneChannels(*it, string(), packingRequired, packingMapping, false, &part);
+                string layer, pairedLayer;
+                vector<string> planeChannels;
+                MultiPlane::Utils::extractChannelsFromComponentString(*it == kFnOfxImagePlaneColour ? _inputClip->getPixelComponentsProperty() : *it,
+                                                                      &layer, &pairedLayer, &planeChannels);
+                Imf_::Header partHeader(exrheader);
+                partHeader.setName( view->second + "." + (layer.empty() ? string("rgba") : layer) );
+                partHeader.setView(view->second);
+                headers.push_back(partHeader);
+                data->parts.push_back(part);
+            }
+        }
+        break;
+    }
+    } // switch
 
-        Imf_::OutputFile outputFile(filename.c_str(), exrheader);
+    try {
+        for (std::size_t i = 0; i < headers.size(); ++i) {
+            for (std::size_t c = 0; c < data->parts[i].names.size(); ++c) {
+                headers[i].channels().insert( data->parts[i].names[c], Imf_::Channel(data->pixelType) );
+            }
+            if (headers.size() > 1) {
+                // multi-part files need a type for each part
+                headers[i].setType(data->tiled ? Imf_::TILEDIMAGE : Imf_::SCANLINEIMAGE);
+            }
+        }
+        data->file.reset( new Imf_::MultiPartOutputFile(filename.c_str(), &headers[0], (int)headers.size()) );
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
 
-        for (int y = bounds.y1; y < bounds.y2; ++y) {
-            /*First we create a row that will serve as the output buffer.
-               We copy the scan-line (with y inverted) in the inputImage to the row.*/
-            int exrY = bounds.y2 - y - 1;
-            float* src_pixels = (float*)( (char*)pixelData + (exrY - bounds.y1) * rowBytes );
+        return;
+    }
+} // WriteEXRPlugin::beginEncodeParts
 
-            /*we create the frame buffer*/
-            Imf_::FrameBuffer fbuf;
-            if (depth == 32) {
-                for (int chan = 0; chan < pixelDataNComps; ++chan) {
-                    fbuf.insert( chanNames[chan], Imf_::Slice(Imf_::FLOAT, (char*)src_pixels + chan, sizeof(float) * pixelDataNComps, 0) );
+void
+WriteEXRPlugin::encodePart(void* user_data,
+                           const string& /*filename*/,
+                           const float *pixelData,
+                           int pixelDataNComps,
+                           int planeIndex,
+                           int rowBytes)
+{
+    assert(user_data);
+    WriteEXREncodePartsData* data = (WriteEXREncodePartsData*)user_data;
+    if ( !data->file.get() || ( planeIndex < 0) || ( planeIndex >= (int)data->parts.size() ) ) {
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    const Exr::PartChannels& part = data->parts[planeIndex];
+    const OfxRectI& bounds = data->bounds;
+
+    if (data->tiled) {
+        encodeTiledPart(data, pixelData, pixelDataNComps, planeIndex, rowBytes);
+
+        return;
+    }
+
+    try {
+        Exr::writeScanLinePart(*data->file, planeIndex, part, data->pixelType, bounds, pixelData, pixelDataNComps, rowBytes);
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+} // WriteEXRPlugin::encodePart
+
+void
+WriteEXRPlugin::encodeTiledPart(WriteEXREncodePartsData* data,
+                                const float *pixelData,
+                                int pixelDataNComps,
+                                int planeIndex,
+                                int rowBytes)
+{
+    const Exr::PartChannels& part = data->parts[planeIndex];
+    const OfxRectI& bounds = data->bounds;
+
+    try {
+        // copy the channels of the part, in exr line order: this is also the first level of the mipmap
+        int levelWidth = bounds.x2 - bounds.x1;
+        int levelHeight = bounds.y2 - bounds.y1;
+        const int nComps = (int)part.names.size();
+        vector<float> level( (std::size_t)levelWidth * levelHeight * nComps, 0.f );
+        for (int y = 0; y < levelHeight; ++y) {
+            const float* src_pixels = (const float*)( (const char*)pixelData + (std::ptrdiff_t)(levelHeight - 1 - y) * rowBytes );
+            float* dst_pixels = &level[(std::size_t)y * levelWidth * nComps];
+            for (int c = 0; c < nComps; ++c) {
+                int comp = part.components[c];
+                if (comp >= pixelDataNComps) {
+                    // not in the pixels: the channel is filled with zeroes
+                    continue;
                 }
-            } else {
-                Imf_::Array2D<half> halfwriterow(pixelDataNComps, bounds.x2 - bounds.x1);
-
-                for (int chan = 0; chan < pixelDataNComps; ++chan) {
-                    fbuf.insert( chanNames[chan],
-                                 Imf_::Slice(Imf_::HALF,
-                                             (char*)(&halfwriterow[chan][0] - exrDataW.min.x),
-                                             sizeof(halfwriterow[chan][0]), 0) );
-                    const float* from = src_pixels + chan;
-                    for (int i = exrDataW.min.x, f = exrDataW.min.x; i < exrDataW.max.x; ++i, f += pixelDataNComps) {
-                        halfwriterow[chan][i - exrDataW.min.x] = from[f];
-                    }
+                for (int x = 0; x < levelWidth; ++x) {
+                    dst_pixels[x * nComps + c] = src_pixels[x * pixelDataNComps + comp];
                 }
             }
-            outputFile.setFrameBuffer(fbuf);
-            outputFile.writePixels(1);
+        }
+
+        Imf_::TiledOutputPart outputPart(*data->file, planeIndex);
+        int nLevels = data->mipmap ? outputPart.numLevels() : 1;
+        vector<float> nextLevel;
+        vector<half> halfPixels;
+        for (int l = 0; l < nLevels; ++l) {
+            if (l > 0) {
+                const Imath::Box2i levelWindow = outputPart.dataWindowForLevel(l);
+                int width = levelWindow.max.x - levelWindow.min.x + 1;
+                int height = levelWindow.max.y - levelWindow.min.y + 1;
+                Exr::halveImage(level, levelWidth, levelHeight, nComps, &nextLevel, width, height);
+                level.swap(nextLevel);
+                levelWidth = width;
+                levelHeight = height;
+            }
+
+            char* base;
+            std::ptrdiff_t componentBytes;
+            if (data->pixelType == Imf_::FLOAT) {
+                base = (char*)&level[0];
+                componentBytes = sizeof(float);
+            } else {
+                halfPixels.resize( level.size() );
+                const std::size_t rowValues = (std::size_t)levelWidth * nComps;
+                Exr::convertToHalf(&level[0], rowValues * sizeof(float), &halfPixels[0], rowValues, levelHeight);
+                base = (char*)&halfPixels[0];
+                componentBytes = sizeof(half);
+            }
+            // all levels start at the top left corner of the data window
+            std::ptrdiff_t xStride = componentBytes * nComps;
+            std::ptrdiff_t yStride = xStride * levelWidth;
+            char* origin = base - (std::ptrdiff_t)bounds.y1 * yStride - (std::ptrdiff_t)bounds.x1 * xStride;
+
+            Imf_::FrameBuffer fbuf;
+            for (int c = 0; c < nComps; ++c) {
+                fbuf.insert( part.names[c],
+                             Imf_::Slice(data->pixelType,
+                                         origin + c * componentBytes,
+                                         xStride, yStride) );
+            }
+            outputPart.setFrameBuffer(fbuf);
+            // write all the tiles of the level at once, so that OpenEXR can compress them in parallel
+            outputPart.writeTiles(0, outputPart.numXTiles(l) - 1, 0, outputPart.numYTiles(l) - 1, l);
         }
     } catch (const std::exception& e) {
         setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
@@ -264,7 +844,23 @@ WriteEXRPlugin::encode(const string& filename,
 
         return;
     }
-} // WriteEXRPlugin::encode
+} // WriteEXRPlugin::encodeTiledPart
+
+void
+WriteEXRPlugin::endEncodeParts(void* user_data)
+{
+    assert(user_data);
+    WriteEXREncodePartsData* data = (WriteEXREncodePartsData*)user_data;
+    try {
+        // the file is closed by the destructor
+        data->file.reset();
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+}
 
 bool
 WriteEXRPlugin::isImageFile(const string& /*fileExtension*/) const
@@ -303,7 +899,7 @@ WriteEXRPluginFactory::unload()
 void
 WriteEXRPluginFactory::describe(ImageEffectDescriptor &desc)
 {
-    GenericWriterDescribe(desc, eRenderFullySafe, _extensions, kPluginEvaluation, false, false);
+    GenericWriterDescribe(desc, eRenderFullySafe, _extensions, kPluginEvaluation, true, true);
     // basic labels
     desc.setLabel(kPluginName);
     desc.setPluginDescription(kPluginDescription);
@@ -347,6 +943,92 @@ WriteEXRPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    ////////Tiles
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamTileSize);
+        param->setLabel(kParamTileSizeLabel);
+        param->setHint(kParamTileSizeHint);
+        assert(param->getNOptions() == eParamTileSizeScanLineBased);
+        param->appendOption(kParamTileSizeOptionScanLineBased);
+        assert(param->getNOptions() == eParamTileSize64);
+        param->appendOption(kParamTileSizeOption64);
+        assert(param->getNOptions() == eParamTileSize128);
+        param->appendOption(kParamTileSizeOption128);
+        assert(param->getNOptions() == eParamTileSize256);
+        param->appendOption(kParamTileSizeOption256);
+        assert(param->getNOptions() == eParamTileSize512);
+        param->appendOption(kParamTileSizeOption512);
+        param->setDefault(eParamTileSizeScanLineBased);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamMipmap);
+        param->setLabel(kParamMipmapLabel);
+        param->setHint(kParamMipmapHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ////////Threads
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamExrThreads);
+        param->setLabel(kParamExrThreadsLabel);
+        param->setHint(kParamExrThreadsHint);
+        param->setAnimates(false);
+        param->setDefault(0);
+        param->setRange(0, 64);
+        param->setDisplayRange(0, 16);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+# if OFX_EXTENSIONS_NATRON && OFX_EXTENSIONS_NUKE
+    const bool enableMultiPlaneFeature = ( getImageEffectHostDescription()->supportsDynamicChoices &&
+                                           getImageEffectHostDescription()->isMultiPlanar &&
+                                           fetchSuite(kFnOfxImageEffectPlaneSuite, 2, true) );
+# else
+    const bool enableMultiPlaneFeature = false;
+# endif
+
+    if (enableMultiPlaneFeature) {
+        {
+            ChoiceParamDescriptor* param = MultiPlane::Factory::describeInContextAddOutputLayerChoice(true, desc, page);
+            param->setLabel(kParamOutputChannelsLabel);
+            param->setHint(kParamOutputChannelsHint);
+        }
+        {
+            ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamPartsSplitting);
+            param->setLabel(kParamPartsSplittingLabel);
+            param->setHint(kParamPartsSplittingHint);
+            param->appendOption(kParamPartsSinglePart, kParamPartsSinglePartHint);
+            param->appendOption(kParamPartsSlitViews, kParamPartsSlitViewsHint);
+            param->appendOption(kParamPartsSplitViewsLayers, kParamPartsSplitViewsLayersHint);
+            param->setDefault(2);
+            param->setAnimates(false);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+        {
+            ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamViewsSelector);
+            param->setLabel(kParamViewsSelectorLabel);
+            param->setHint(kParamViewsSelectorHint);
+            param->appendOption("All");
+            param->setAnimates(false);
+            param->setDefault(0);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+    }
+
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
@@ -0,0 +1,237 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Standalone benchmark for the exr Writer plugin (not part of the plugin).
+ * Compares the write throughput of the former line by line encoder, which set a frame buffer
+ * and called writePixels(1) for each line, with the scan-line part writer of the plugin
+ * (Exr::writeScanLinePart(), used by WriteEXRPlugin::encodePart), for the ZIP, PIZ and DWAA compressions.
+ *
+ * make benchmark && ./$(OS)-$(BITS)-$(CONFIG)/WriteEXRBenchmark [width [height [threads [file]]]]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <cstddef> // size_t, ptrdiff_t
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <ImfChannelList.h>
+#include <ImfMultiPartOutputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfThreading.h>
+#include <half.h>
+
+#include "ofxsImageEffect.h"
+#include "ofxsThreadSuite.h"
+
+#include "WriteEXRPart.h"
+
+#ifndef OPENEXR_IMF_NAMESPACE
+#define OPENEXR_IMF_NAMESPACE Imf
+#endif
+namespace Imf_ = OPENEXR_IMF_NAMESPACE;
+
+using std::vector;
+
+// the support library needs the plugins of the binary: there are none
+void
+OFX::Plugin::getPluginIDs(OFX::PluginFactoryArray& /*ids*/)
+{
+}
+
+static double
+now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static int
+numCPUs()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (int)info.dwNumberOfProcessors;
+#else
+
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static const char* chanNames[4] = { "R", "G", "B", "A" };
+
+// The former encoder: a frame buffer is set for each line, and the lines are written one by one
+static void
+writeLineByLine(Imf_::OutputFile& outputFile,
+                Imf_::PixelType pixelType,
+                const float* pixelData,
+                int width,
+                int height)
+{
+    const std::size_t rowValues = (std::size_t)width * 4;
+    vector<half> halfRow(rowValues);
+
+    for (int y = 0; y < height; ++y) {
+        // the OFX image is bottom-up
+        const float* src_pixels = pixelData + (std::size_t)(height - 1 - y) * rowValues;
+        Imf_::FrameBuffer fbuf;
+        for (int chan = 0; chan < 4; ++chan) {
+            if (pixelType == Imf_::FLOAT) {
+                fbuf.insert( chanNames[chan], Imf_::Slice(Imf_::FLOAT, (char*)(src_pixels + chan), sizeof(float) * 4, 0) );
+            } else {
+                for (int x = 0; x < width; ++x) {
+                    halfRow[x * 4 + chan] = src_pixels[x * 4 + chan];
+                }
+                fbuf.insert( chanNames[chan], Imf_::Slice(Imf_::HALF, (char*)(&halfRow[0] + chan), sizeof(half) * 4, 0) );
+            }
+        }
+        outputFile.setFrameBuffer(fbuf);
+        outputFile.writePixels(1);
+    }
+}
+
+// The current encoder of the plugin
+static void
+writeWholeFrame(Imf_::MultiPartOutputFile& outputFile,
+                Imf_::PixelType pixelType,
+                const float* pixelData,
+                int width,
+                int height)
+{
+    Exr::PartChannels part;
+
+    for (int chan = 0; chan < 4; ++chan) {
+        part.names.push_back(chanNames[chan]);
+        part.components.push_back(chan);
+    }
+    OfxRectI bounds = { 0, 0, width, height };
+    Exr::writeScanLinePart(outputFile, 0, part, pixelType, bounds, pixelData, 4, width * 4 * (int)sizeof(float) );
+}
+
+// Returns the best time of a few runs
+static double
+benchmark(const char* filename,
+          Imf_::Compression compression,
+          Imf_::PixelType pixelType,
+          bool wholeFrame,
+          const float* pixelData,
+          int width,
+          int height)
+{
+    double best = 0.;
+
+    for (int run = 0; run < 3; ++run) {
+        Imf_::Header exrheader(width, height, 1.f, Imath::V2f(0, 0), 1, Imf_::INCREASING_Y, compression);
+        for (int chan = 0; chan < 4; ++chan) {
+            exrheader.channels().insert( chanNames[chan], Imf_::Channel(pixelType) );
+        }
+        double start = now();
+        if (wholeFrame) {
+            Imf_::MultiPartOutputFile outputFile(filename, &exrheader, 1);
+            writeWholeFrame(outputFile, pixelType, pixelData, width, height);
+        } else {
+            Imf_::OutputFile outputFile(filename, exrheader);
+            writeLineByLine(outputFile, pixelType, pixelData, width, height);
+        }
+        double elapsed = now() - start;
+        if ( (run == 0) || (elapsed < best) ) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+int
+main(int argc,
+     char** argv)
+{
+    int width = (argc > 1) ? std::atoi(argv[1]) : 3840;
+    int height = (argc > 2) ? std::atoi(argv[2]) : 2160;
+    int threads = (argc > 3) ? std::atoi(argv[3]) : numCPUs();
+    const char* filename = (argc > 4) ? argv[4] : "WriteEXRBenchmark.exr";
+
+    if ( (width <= 0) || (height <= 0) || (threads < 0) ) {
+        std::fprintf(stderr, "usage: %s [width [height [threads [file]]]]\n", argv[0]);
+
+        return 1;
+    }
+    Imf_::setGlobalThreadCount(threads);
+    // the half conversion of the plugin is multithreaded by the OFX thread suite: use the one of the support library
+    ofxsThreadSuiteCheck();
+
+    // smooth gradients with a little noise, like a rendered image
+    vector<float> pixels( (std::size_t)width * height * 4 );
+    unsigned int seed = 1;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            for (int chan = 0; chan < 4; ++chan) {
+                seed = seed * 1103515245u + 12345u;
+                float noise = ( (seed >> 16) & 0xff ) / 255.f - 0.5f;
+                pixels[( (std::size_t)y * width + x ) * 4 + chan] = ( chan == 3 ? 1.f :
+                                                                      std::sin(x * 0.002f * (chan + 1) + y * 0.003f) + 1.f + 0.01f * noise );
+            }
+        }
+    }
+
+    const Imf_::Compression compressions[3] = { Imf_::ZIP_COMPRESSION, Imf_::PIZ_COMPRESSION, Imf_::DWAA_COMPRESSION };
+    const char* compressionNames[3] = { "ZIP", "PIZ", "DWAA" };
+    const Imf_::PixelType pixelTypes[2] = { Imf_::HALF, Imf_::FLOAT };
+    const char* pixelTypeNames[2] = { "half", "float" };
+
+    std::printf("%dx%d RGBA, %d OpenEXR threads\n", width, height, threads);
+    std::printf("%-5s %-6s %12s %12s %8s\n", "", "", "line (MB/s)", "frame (MB/s)", "speedup");
+    for (int t = 0; t < 2; ++t) {
+        const double megabytes = (double)width * height * 4 * (pixelTypes[t] == Imf_::HALF ? sizeof(half) : sizeof(float) ) / 1e6;
+        for (int c = 0; c < 3; ++c) {
+            try {
+                double lineTime = benchmark(filename, compressions[c], pixelTypes[t], false, &pixels[0], width, height);
+                double frameTime = benchmark(filename, compressions[c], pixelTypes[t], true, &pixels[0], width, height);
+                std::printf("%-5s %-6s %12.1f %12.1f %7.2fx\n", compressionNames[c], pixelTypeNames[t],
+                            megabytes / lineTime, megabytes / frameTime, lineTime / frameTime);
+            } catch (const std::exception& e) {
+                std::fprintf(stderr, "OpenEXR error: %s\n", e.what() );
+
+                return 1;
+            }
+        }
+    }
+    std::remove(filename);
+
+    return 0;
+} // main
@@ -0,0 +1,239 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Writing of the pixels of an OFX image to a part of an exr file, shared by the exr Writer plugin
+ * and its standalone benchmark.
+ */
+
+#include "WriteEXRPart.h"
+
+#include <algorithm>
+#include <vector>
+#include <cstddef> // size_t, ptrdiff_t
+
+#include <ImfOutputPart.h>
+#include <ImfFrameBuffer.h>
+
+// The F16C instructions are used when the CPU supports them, which is checked at run time, so that the
+// plugin does not need to be built for a specific CPU. GCC and clang compile the function using them with
+// a target attribute, MSVC always provides the intrinsics.
+#if ( defined(__x86_64__) || defined(__i386__) ) && \
+    ( defined(__clang__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) )
+#include <immintrin.h>
+#include <cpuid.h>
+#define OFX_EXR_USE_F16C
+#define OFX_EXR_F16C_TARGET __attribute__( ( target("avx,f16c") ) )
+#elif defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) ) && (_MSC_VER >= 1600)
+#include <immintrin.h>
+#include <intrin.h>
+#define OFX_EXR_USE_F16C
+#define OFX_EXR_F16C_TARGET
+#endif
+
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+
+using namespace OFX;
+
+namespace Imf_ = OPENEXR_IMF_NAMESPACE;
+
+namespace Exr {
+#ifdef OFX_EXR_USE_F16C
+// true if the CPU supports F16C, and the OS saves the AVX registers it uses
+static bool
+cpuHasF16C()
+{
+    unsigned int ecx;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    ecx = (unsigned int)info[2];
+#else
+    unsigned int eax, ebx, edx;
+    if ( !__get_cpuid(1, &eax, &ebx, &ecx, &edx) ) {
+        return false;
+    }
+#endif
+    // F16C (bit 29), AVX (bit 28), OSXSAVE (bit 27)
+    const unsigned int f16cAvxOsxsave = (1u << 29) | (1u << 28) | (1u << 27);
+    if ( (ecx & f16cAvxOsxsave) != f16cAvxOsxsave ) {
+        return false;
+    }
+    // the OS must save the XMM and YMM registers (bits 1 and 2 of XCR0)
+#ifdef _MSC_VER
+    unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int xcr0Lo, xcr0Hi;
+    __asm__ __volatile__ ("xgetbv" : "=a" (xcr0Lo), "=d" (xcr0Hi) : "c" (0));
+    unsigned long long xcr0 = ( (unsigned long long)xcr0Hi << 32 ) | xcr0Lo;
+#endif
+
+    return (xcr0 & 6) == 6;
+}
+
+static const bool gHasF16C = cpuHasF16C();
+
+// Convert the first values of n floats to half, 8 at a time, with the F16C instructions.
+// Returns the number of converted values
+OFX_EXR_F16C_TARGET static std::size_t
+floatToHalfF16C(const float* src,
+                half* dst,
+                std::size_t n)
+{
+    std::size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 f = _mm256_loadu_ps(src + i);
+        __m128i h = _mm256_cvtps_ph(f, 0); // 0 = round to nearest even
+        _mm_storeu_si128( (__m128i*)(dst + i), h );
+    }
+
+    return i;
+}
+#endif // OFX_EXR_USE_F16C
+
+// Convert n floats to half, rounding to nearest
+static void
+floatToHalf(const float* src,
+            half* dst,
+            std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFX_EXR_USE_F16C
+    if (gHasF16C) {
+        i = floatToHalfF16C(src, dst, n);
+    }
+#endif
+    // the half constructor uses the exponent lookup table of the half library
+    for (; i < n; ++i) {
+        dst[i] = src[i];
+    }
+}
+
+// Converts the rows of an image of floats to half, in parallel.
+// Row y of the half image is at dst + y * rowValues, and is converted from the floats at srcRow0 + y * srcYStride bytes
+class HalfConverter
+    : public MultiThread::Processor
+{
+    const char* _srcRow0;
+    std::ptrdiff_t _srcYStride;
+    half* _dst;
+    std::size_t _rowValues;
+    int _height;
+
+public:
+    HalfConverter(const float* srcRow0,
+                  std::ptrdiff_t srcYStride,
+                  half* dst,
+                  std::size_t rowValues,
+                  int height)
+        : _srcRow0( (const char*)srcRow0 )
+        , _srcYStride(srcYStride)
+        , _dst(dst)
+        , _rowValues(rowValues)
+        , _height(height)
+    {
+    }
+
+    void process()
+    {
+        multiThread( std::min( MultiThread::getNumCPUs(), (unsigned int)std::max(_height, 1) ) );
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        int y1 = (int)( (long long)_height * threadIndex / threadMax );
+        int y2 = (int)( (long long)_height * (threadIndex + 1) / threadMax );
+
+        for (int y = y1; y < y2; ++y) {
+            floatToHalf( (const float*)(_srcRow0 + y * _srcYStride), _dst + _rowValues * y, _rowValues );
+        }
+    }
+};
+
+void
+convertToHalf(const float* srcRow0,
+              std::ptrdiff_t srcYStride,
+              half* dst,
+              std::size_t rowValues,
+              int height)
+{
+    HalfConverter converter(srcRow0, srcYStride, dst, rowValues, height);
+
+    converter.process();
+}
+
+void
+writeScanLinePart(Imf_::MultiPartOutputFile& file,
+                  int partIndex,
+                  const PartChannels& part,
+                  Imf_::PixelType pixelType,
+                  const OfxRectI& bounds,
+                  const float* pixelData,
+                  int pixelDataNComps,
+                  int rowBytes)
+{
+    // The OFX image is bottom-up and exr lines are top-down: exr line y is the OFX line
+    // bounds.y2 - 1 - (y - bounds.y1) of the image.
+    const int width = bounds.x2 - bounds.x1;
+    const int height = bounds.y2 - bounds.y1;
+    const std::size_t rowValues = (std::size_t)width * pixelDataNComps;
+    // the half image, kept for the whole part, in exr line order
+    std::vector<half> halfPixels;
+    char* origin;
+    std::ptrdiff_t componentBytes;
+    std::ptrdiff_t xStride;
+    std::ptrdiff_t yStride;
+    if (pixelType == Imf_::FLOAT) {
+        componentBytes = sizeof(float);
+        xStride = componentBytes * pixelDataNComps;
+        yStride = -(std::ptrdiff_t)rowBytes;
+        origin = (char*)pixelData + (std::ptrdiff_t)(height - 1) * rowBytes - (std::ptrdiff_t)bounds.y1 * yStride - (std::ptrdiff_t)bounds.x1 * xStride;
+    } else {
+        // convert the whole part at once into a single buffer, by bands of lines in parallel
+        halfPixels.resize(rowValues * height);
+        const float* topRow = (const float*)( (const char*)pixelData + (std::ptrdiff_t)(height - 1) * rowBytes );
+        convertToHalf(topRow, -(std::ptrdiff_t)rowBytes, &halfPixels[0], rowValues, height);
+        componentBytes = sizeof(half);
+        xStride = componentBytes * pixelDataNComps;
+        yStride = componentBytes * rowValues;
+        origin = (char*)&halfPixels[0] - (std::ptrdiff_t)bounds.y1 * yStride - (std::ptrdiff_t)bounds.x1 * xStride;
+    }
+
+    /*we create the frame buffer*/
+    Imf_::FrameBuffer fbuf;
+    for (std::size_t c = 0; c < part.names.size(); ++c) {
+        if (part.components[c] >= pixelDataNComps) {
+            // not in the pixels: the channel is filled with zeroes
+            continue;
+        }
+        fbuf.insert( part.names[c],
+                     Imf_::Slice(pixelType,
+                                 origin + part.components[c] * componentBytes,
+                                 xStride, yStride) );
+    }
+    Imf_::OutputPart outputPart(file, partIndex);
+    outputPart.setFrameBuffer(fbuf);
+    // write all the lines at once, so that OpenEXR can compress the line blocks in parallel
+    outputPart.writePixels(height);
+} // writeScanLinePart
+} // namespace Exr
@@ -0,0 +1,62 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Writing of the pixels of an OFX image to a part of an exr file, shared by the exr Writer plugin
+ * and its standalone benchmark.
+ */
+
+#ifndef WriteEXRPart_h
+#define WriteEXRPart_h
+
+#include <string>
+#include <vector>
+#include <cstddef> // size_t, ptrdiff_t
+
+#include <ImfMultiPartOutputFile.h>
+#include <ImfPixelType.h>
+#include <half.h>
+
+#include "ofxCore.h"
+
+#ifndef OPENEXR_IMF_NAMESPACE
+#define OPENEXR_IMF_NAMESPACE Imf
+#endif
+
+namespace Exr {
+
+// The channels of a part, and the component of the pixels passed to encodePart() holding each channel
+struct PartChannels
+{
+    std::vector<std::string> names;
+    std::vector<int> components;
+};
+
+// Convert the rows of an image of floats to half, in parallel, with the F16C instructions if the CPU supports them.
+// Row y of the half image is at dst + y * rowValues, and is converted from the floats at srcRow0 + y * srcYStride bytes
+void convertToHalf(const float* srcRow0, std::ptrdiff_t srcYStride, half* dst, std::size_t rowValues, int height);
+
+// Write the channels of a scan-line part from the pixels of an OFX image (bottom-up, pixelDataNComps floats per pixel,
+// rowBytes bytes per row), covering the data window |bounds| of the file. All the lines are written at once, so that
+// OpenEXR can compress the line blocks in parallel. Throws the exceptions of OpenEXR
+void writeScanLinePart(OPENEXR_IMF_NAMESPACE::MultiPartOutputFile& file, int partIndex, const PartChannels& part,
+                       OPENEXR_IMF_NAMESPACE::PixelType pixelType,
+                       const OfxRectI& bounds, const float* pixelData, int pixelDataNComps, int rowBytes);
+} // namespace Exr
+
+#endif // WriteEXRPart_h
@@ -30,10 +30,19 @@
 #include "FFmpegFile.h"
 
 #include <cmath>
+#include <cstdio>
+#include <cstring> // memcpy
+#include <cstddef> // ptrdiff_t
+#include <climits> // INT_MIN
+#include <cstdlib> // getenv, atoi, abs
 #include <iostream>
 #include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h> // stat
 
 #include <ofxsImageEffect.h>
+#include "ofxsFileOpen.h"
+#include "PixelFormat.h"
 
 #if defined(_WIN32) || defined(WIN64)
 #  include <windows.h> // for GetSystemInfo()
@@ -326,112 +335,88 @@ FFmpegFile::isCodecWhitelistedForWriting(const char* codecName)
     return (whitelistEntry && whitelistEntry->enableWriter);
 }
 
-SwsContext*
-FFmpegFile::Stream::getConvertCtx(AVPixelFormat srcPixelFormat,
-                                  int srcWidth,
-                                  int srcHeight,
-                                  int srcColorRange,
-                                  AVPixelFormat dstPixelFormat,
-                                  int dstWidth,
-                                  int dstHeight)
+void
+FFmpegFile::Stream::setupConverter(AVPixelFormat srcPixelFormat,
+                                   int srcColorRange)
 {
-    // Reset is flagged when the UI colour matrix selection is
-    // modified. This causes a new convert context to be created
-    // that reflects the UI selection.
-    if (_resetConvertCtx) {
-        _resetConvertCtx = false;
-        if (_convertCtx) {
-            sws_freeContext(_convertCtx);
-            _convertCtx = NULL;
-        }
-    }
-
-    if (!_convertCtx) {
-        //Preventing deprecated pixel format used error messages, see:
-        //https://libav.org/doxygen/master/pixfmt_8h.html#a9a8e335cf3be472042bc9f0cf80cd4c5
-        //This manually sets them to the new versions of equivalent types.
-        switch (srcPixelFormat) {
-        case AV_PIX_FMT_YUVJ420P:
-            srcPixelFormat = AV_PIX_FMT_YUV420P;
-            if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
-                srcColorRange = AVCOL_RANGE_JPEG;
-            }
-            break;
-        case AV_PIX_FMT_YUVJ422P:
-            srcPixelFormat = AV_PIX_FMT_YUV422P;
-            if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
-                srcColorRange = AVCOL_RANGE_JPEG;
-            }
-            break;
-        case AV_PIX_FMT_YUVJ444P:
-            srcPixelFormat = AV_PIX_FMT_YUV444P;
-            if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
-                srcColorRange = AVCOL_RANGE_JPEG;
-            }
-            break;
-        case AV_PIX_FMT_YUVJ440P:
-            srcPixelFormat = AV_PIX_FMT_YUV440P;
-            if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
-                srcColorRange = AVCOL_RANGE_JPEG;
-            }
-        default:
-            break;
+    //Preventing deprecated pixel format used error messages, see:
+    //https://libav.org/doxygen/master/pixfmt_8h.html#a9a8e335cf3be472042bc9f0cf80cd4c5
+    //This manually sets them to the new versions of equivalent types.
+    switch (srcPixelFormat) {
+    case AV_PIX_FMT_YUVJ420P:
+        srcPixelFormat = AV_PIX_FMT_YUV420P;
+        if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
+            srcColorRange = AVCOL_RANGE_JPEG;
         }
-
-        _convertCtx = sws_getContext(srcWidth, srcHeight, srcPixelFormat, // src format
-                                     dstWidth, dstHeight, dstPixelFormat,        // dest format
-                                     SWS_BICUBIC, NULL, NULL, NULL);
-
-        // Set up the SoftWareScaler to convert colorspaces correctly.
-        // Colorspace conversion makes no sense for RGB->RGB conversions
-        if ( !isYUV() ) {
-            return _convertCtx;
+        break;
+    case AV_PIX_FMT_YUVJ422P:
+        srcPixelFormat = AV_PIX_FMT_YUV422P;
+        if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
+            srcColorRange = AVCOL_RANGE_JPEG;
         }
-
-        int colorspace = isRec709Format() ? SWS_CS_ITU709 : SWS_CS_ITU601;
-        // Optional color space override
-        if (_colorMatrixTypeOverride > 0) {
-            if (_colorMatrixTypeOverride == 1) {
-                colorspace = SWS_CS_ITU709;
-            } else {
-                colorspace = SWS_CS_ITU601;
-            }
+        break;
+    case AV_PIX_FMT_YUVJ444P:
+        srcPixelFormat = AV_PIX_FMT_YUV444P;
+        if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
+            srcColorRange = AVCOL_RANGE_JPEG;
         }
-
-        // sws_setColorspaceDetails takes a flag indicating the white-black range of the input:
-        //     0  -  mpeg, 16..235
-        //     1  -  jpeg,  0..255
-        int srcRange;
-        // Set this flag according to the color_range reported by the codec context.
-        switch (srcColorRange) {
-        case AVCOL_RANGE_MPEG:
-            srcRange = 0;
-            break;
-        case AVCOL_RANGE_JPEG:
-            srcRange = 1;
-            break;
-        case AVCOL_RANGE_UNSPECIFIED:
-        default:
-            // If the colour range wasn't specified, set the flag according to
-            // whether the data is YUV or not.
-            srcRange = isYUV() ? 0 : 1;
-            break;
+        break;
+    case AV_PIX_FMT_YUVJ440P:
+        srcPixelFormat = AV_PIX_FMT_YUV440P;
+        if (srcColorRange == AVCOL_RANGE_UNSPECIFIED) {
+            srcColorRange = AVCOL_RANGE_JPEG;
         }
+    default:
+        break;
+    }
+
+    // Set up the SoftWareScaler to convert colorspaces correctly.
+    // Colorspace conversion makes no sense for RGB->RGB conversions
+    if ( !isYUV() ) {
+        _converter.setConversion(_width, _height, srcPixelFormat,
+                                 _width, _height, _outputPixelFormat,
+                                 NULL, 0, NULL, 0);
+
+        return;
+    }
 
-        int result = sws_setColorspaceDetails(_convertCtx,
-                                              sws_getCoefficients(colorspace), // inv_table
-                                              srcRange, // srcRange -flag indicating the white-black range of the input (1=jpeg / 0=mpeg) 0 = 16..235, 1 = 0..255
-                                              sws_getCoefficients(SWS_CS_DEFAULT), // table
-                                              1, // dstRange - 0 = 16..235, 1 = 0..255
-                                              0, // brightness fixed point, with 0 meaning no change,
-                                              1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
-                                              1 << 16); // saturation fixed point, with 1<<16 meaning no change);
+    int colorspace = isRec709Format() ? SWS_CS_ITU709 : SWS_CS_ITU601;
+    // Optional color space override
+    if (_colorMatrixTypeOverride > 0) {
+        if (_colorMatrixTypeOverride == 1) {
+            colorspace = SWS_CS_ITU709;
+        } else {
+            colorspace = SWS_CS_ITU601;
+        }
+    }
 
-        assert(result != -1);
+    // sws_setColorspaceDetails takes a flag indicating the white-black range of the input:
+    //     0  -  mpeg, 16..235
+    //     1  -  jpeg,  0..255
+    int srcRange;
+    // Set this flag according to the color_range reported by the codec context.
+    switch (srcColorRange) {
+    case AVCOL_RANGE_MPEG:
+        srcRange = 0;
+        break;
+    case AVCOL_RANGE_JPEG:
+        srcRange = 1;
+        break;
+    case AVCOL_RANGE_UNSPECIFIED:
+    default:
+        // If the colour range wasn't specified, set the flag according to
+        // whether the data is YUV or not.
+        srcRange = isYUV() ? 0 : 1;
+        break;
     }
 
-    return _convertCtx;
-} // FFmpegFile::Stream::getConvertCtx
+    _converter.setConversion(_width, _height, srcPixelFormat,
+                             _width, _height, _outputPixelFormat,
+                             sws_getCoefficients(colorspace), // inv_table
+                             srcRange, // srcRange -flag indicating the white-black range of the input (1=jpeg / 0=mpeg) 0 = 16..235, 1 = 0..255
+                             sws_getCoefficients(SWS_CS_DEFAULT), // table
+                             1); // dstRange - 0 = 16..235, 1 = 0..255
+} // FFmpegFile::Stream::setupConverter
 
 /*static*/ double
 FFmpegFile::Stream::GetStreamAspectRatio(Stream* stream)
@@ -653,17 +638,32 @@ FFmpegFile::getStreamFrames(Stream & stream)
     return frames;
 } // FFmpegFile::getStreamFrames
 
-FFmpegFile::FFmpegFile(const string & filename)
+FFmpegFile::FFmpegFile(const string & filename,
+                       int threadCount)
     : _filename(filename)
+    , _threadCount(threadCount)
     , _context(NULL)
     , _format(NULL)
     , _streams()
     , _errorMsg()
     , _invalidState(false)
     , _avPacket()
-#ifdef OFX_IO_MT_FFMPEG
     , _lock()
+#ifdef OFX_IO_MT_FFMPEG
     , _invalidStateLock()
+#endif
+    , _cacheLock()
+    , _cache()
+    , _cacheMaxFrames(-1)
+    , _lastRequestedFrame(INT_MIN)
+    , _maxRetries(0)
+#ifdef OFX_IO_MT_FFMPEG
+    , _readAheadThread(NULL)
+    , _readAheadCond()
+    , _readAheadNext(0)
+    , _readAheadLast(-1)
+    , _readAheadDecoding(INT_MIN)
+    , _readAheadQuit(false)
 #endif
 {
 #ifdef OFX_IO_MT_FFMPEG
@@ -765,7 +765,10 @@ FFmpegFile::FFmpegFile(const string & filename)
             //} else
 #          endif
             {
-                avctx->thread_count = std::min( (int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS ); // ask for the number of available cores for multithreading
+                if (_threadCount <= 0) {
+                    _threadCount = std::min( (int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS ); // ask for the number of available cores for multithreading
+                }
+                avctx->thread_count = std::min(_threadCount, OFX_FFMPEG_MAX_THREADS);
 #             ifdef AV_CODEC_CAP_SLICE_THREADS
                 if ( avctx->codec && (avctx->codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) ) {
                     // multiple threads are used to decode a single frame. Reduces delay
@@ -898,8 +901,23 @@ FFmpegFile::FFmpegFile(const string & filename)
 FFmpegFile::~FFmpegFile()
 {
 #ifdef OFX_IO_MT_FFMPEG
-    AutoMutex guard(_lock);
+    // stop the read-ahead thread first, since it needs _lock to decode
+    if (_readAheadThread) {
+        {
+            CondAutoMutex cacheGuard(_cacheLock);
+            _readAheadQuit = true;
+            _readAheadCond.notify_all();
+        }
+        if ( _readAheadThread->joinable() ) {
+            _readAheadThread->join();
+        }
+        delete _readAheadThread;
+        _readAheadThread = NULL;
+    }
 #endif
+    clearCache();
+
+    AutoMutex guard(_lock);
 
     // force to close all resources needed for all streams
     for (unsigned int i = 0; i < _streams.size(); ++i) {
@@ -1031,6 +1049,11 @@ FFmpegFile::seekFrame(int frame,
 
     avcodec_flush_buffers(stream->_codecContext);
     int64_t timestamp = stream->frameToPts(frame);
+    int keyFrame = stream->keyFrameBefore(frame);
+    if (keyFrame >= 0) {
+        // The stream is indexed: seek directly to the key frame before the desired frame.
+        timestamp = stream->_keyFrames.find(keyFrame)->second;
+    }
     int error = av_seek_frame(_context, stream->_idx, timestamp, AVSEEK_FLAG_BACKWARD);
     if (error < 0) {
         // Seek error. Abort attempt to read and decode frames.
@@ -1042,19 +1065,556 @@ FFmpegFile::seekFrame(int frame,
     return true;
 }
 
+// Build the seek index of all streams, by reading all the packets of the file without decoding them.
+void
+FFmpegFile::buildIndex()
+{
+    ///Private should not lock
+
+    if ( _streams.empty() ) {
+        return;
+    }
+    for (unsigned int i = 0; i < _streams.size(); ++i) {
+        _streams[i]->_keyFrames.clear();
+        avcodec_flush_buffers(_streams[i]->_codecContext);
+    }
+
+    // Rewind to the first key-frame of the first video stream.
+    Stream* firstStream = _streams[0];
+    if (av_seek_frame(_context, firstStream->_idx, firstStream->_startPTS, AVSEEK_FLAG_BACKWARD) >= 0) {
+        av_init_packet(&_avPacket);
+
+        // Read all packets, recording the frame index and the timestamp of every key-frame. The timestamp recorded is the
+        // one used by decode() to find out where a seek landed, so that seeking to it lands exactly on that key-frame.
+        while (av_read_frame(_context, &_avPacket) >= 0) {
+            if (_avPacket.flags & AV_PKT_FLAG_KEY) {
+                for (unsigned int i = 0; i < _streams.size(); ++i) {
+                    Stream* stream = _streams[i];
+                    if (_avPacket.stream_index == stream->_idx) {
+                        int64_t timestamp = _avPacket.*stream->_timestampField;
+                        if ( timestamp != int64_t(AV_NOPTS_VALUE) ) {
+                            int frame = stream->ptsToFrame(timestamp);
+                            if ( (frame >= 0) && ( stream->_keyFrames.find(frame) == stream->_keyFrames.end() ) ) {
+                                stream->_keyFrames[frame] = timestamp;
+                            }
+                        }
+                    }
+                }
+            }
+            av_packet_unref(&_avPacket);
+        }
+    }
+
+    // The current position in the file is now unknown: the next decode() must seek.
+    for (unsigned int i = 0; i < _streams.size(); ++i) {
+        Stream* stream = _streams[i];
+        avcodec_flush_buffers(stream->_codecContext);
+        stream->_decodeNextFrameIn  = -1;
+        stream->_decodeNextFrameOut = -1;
+        stream->_accumDecodeLatency = 0;
+        stream->_indexed = true;
+#if TRACE_FILE_OPEN
+        std::cout << "      Stream " << stream->_idx << " indexed, " << stream->_keyFrames.size() << " key frames" << std::endl;
+#endif
+    }
+} // FFmpegFile::buildIndex
+
+static bool
+readIndexLine(std::FILE* file,
+              string* line)
+{
+    char buf[1024];
+
+    line->clear();
+    while ( std::fgets(buf, sizeof(buf), file) ) {
+        line->append(buf);
+        if ( !line->empty() && ( (*line)[line->size() - 1] == '\n' ) ) {
+            line->resize(line->size() - 1);
+
+            return true;
+        }
+    }
+
+    return !line->empty();
+}
+
+// Read the seek index from a sidecar file. The index is only valid if it was written for the same file, with the same
+// modification time and size. Returns true if all streams were indexed.
+bool
+FFmpegFile::readIndexFile(const string& indexFilename,
+                          long long mtime,
+                          long long size)
+{
+    ///Private should not lock
+
+    std::FILE* file = fopen_utf8(indexFilename.c_str(), "r");
+    if (!file) {
+        return false;
+    }
+    bool ok = true;
+    string line;
+    long long fileMtime = 0, fileSize = 0;
+    unsigned int nbStreams = 0;
+    if ( !readIndexLine(file, &line) || (line != kFFmpegIndexFileHeader) ||
+         !readIndexLine(file, &line) || (line != _filename) ||
+         (std::fscanf(file, "%lld %lld %u", &fileMtime, &fileSize, &nbStreams) != 3) ||
+         (fileMtime != mtime) || (fileSize != size) || ( nbStreams != _streams.size() ) ) {
+        ok = false;
+    }
+    for (unsigned int i = 0; ok && i < nbStreams; ++i) {
+        int idx = -1;
+        unsigned int nbKeyFrames = 0;
+        if ( (std::fscanf(file, "%d %u", &idx, &nbKeyFrames) != 2) || (_streams[i]->_idx != idx) ) {
+            ok = false;
+            break;
+        }
+        Stream* stream = _streams[i];
+        stream->_keyFrames.clear();
+        for (unsigned int k = 0; k < nbKeyFrames; ++k) {
+            int frame;
+            long long timestamp;
+            if (std::fscanf(file, "%d %lld", &frame, &timestamp) != 2) {
+                ok = false;
+                break;
+            }
+            stream->_keyFrames[frame] = timestamp;
+        }
+    }
+    std::fclose(file);
+
+    for (unsigned int i = 0; i < _streams.size(); ++i) {
+        if (ok) {
+            _streams[i]->_indexed = true;
+        } else {
+            _streams[i]->_keyFrames.clear();
+        }
+    }
+
+    return ok;
+} // FFmpegFile::readIndexFile
+
+// Save the seek index to a sidecar file. Failure to write the file (e.g. read-only storage) is not an error.
+void
+FFmpegFile::writeIndexFile(const string& indexFilename,
+                           long long mtime,
+                           long long size) const
+{
+    ///Private should not lock
+
+    std::FILE* file = fopen_utf8(indexFilename.c_str(), "w");
+    if (!file) {
+        return;
+    }
+    std::fprintf(file, "%s\n%s\n%lld %lld %u\n", kFFmpegIndexFileHeader, _filename.c_str(), mtime, size, (unsigned int)_streams.size());
+    for (unsigned int i = 0; i < _streams.size(); ++i) {
+        const Stream* stream = _streams[i];
+        std::fprintf(file, "%d %u\n", stream->_idx, (unsigned int)stream->_keyFrames.size());
+        for (std::map<int, int64_t>::const_iterator it = stream->_keyFrames.begin(); it != stream->_keyFrames.end(); ++it) {
+            std::fprintf(file, "%d %lld\n", it->first, (long long)it->second);
+        }
+    }
+    std::fclose(file);
+}
+
+void
+FFmpegFile::buildSeekIndex(bool useIndexFile)
+{
+    AutoMutex guard(_lock);
+
+    if ( _streams.empty() || _streams[0]->_indexed ) {
+        return;
+    }
+
+    // the sidecar file is keyed by the path, modification time and size of the video file
+    struct stat st;
+    bool hasStat = (stat(_filename.c_str(), &st) == 0);
+    long long mtime = hasStat ? (long long)st.st_mtime : 0;
+    long long size = hasStat ? (long long)st.st_size : 0;
+    string indexFilename = _filename + kFFmpegIndexFileExtension;
+
+    if ( useIndexFile && hasStat && readIndexFile(indexFilename, mtime, size) ) {
+        return;
+    }
+    buildIndex();
+    if (useIndexFile && hasStat) {
+        writeIndexFile(indexFilename, mtime, size);
+    }
+}
+
+// The number of frames that fit in the frame cache
+int
+FFmpegFile::getCacheMaxFrames()
+{
+    ///Private should not lock
+
+    if (_cacheMaxFrames < 0) {
+        // the cache holds decoded frames, in the pixel format of the codec
+        std::size_t frameSize = 0;
+        if ( !_streams.empty() ) {
+            int size = av_image_get_buffer_size(_streams[0]->_codecContext->pix_fmt, _streams[0]->_width, _streams[0]->_height, 1);
+            frameSize = (size > 0) ? (std::size_t)size : getBufferBytesCount();
+        }
+        _cacheMaxFrames = OFX_FFMPEG_CACHE_MAX_FRAMES;
+        if (frameSize > 0) {
+            _cacheMaxFrames = (int)std::min( (std::size_t)_cacheMaxFrames, OFX_FFMPEG_CACHE_MAX_BYTES / frameSize );
+        }
+    }
+
+    return _cacheMaxFrames;
+}
+
+// Find a frame in the cache, _cacheLock must be locked
+FFmpegFile::FrameCache::iterator
+FFmpegFile::findCachedFrame(int frame)
+{
+    FrameCache::iterator it = _cache.begin();
+
+    while ( it != _cache.end() && (*it)->frame != frame ) {
+        ++it;
+    }
+
+    return it;
+}
+
+// If the frame is in the cache, return a new reference to it, else return NULL
+AVFrame*
+FFmpegFile::getCachedFrame(int frame)
+{
+    CondAutoMutex guard(_cacheLock);
+    FrameCache::iterator it = findCachedFrame(frame);
+
+    if ( it == _cache.end() ) {
+        return NULL;
+    }
+    // move it to the front of the list
+    _cache.splice( _cache.begin(), _cache, it );
+
+    return av_frame_clone(_cache.front()->avFrame);
+}
+
+// Add a reference to a decoded frame to the cache, evicting the least recently used frame if the cache is full
+void
+FFmpegFile::cacheFrame(int frame,
+                       const AVFrame* avFrame)
+{
+    CondAutoMutex guard(_cacheLock);
+    int maxFrames = getCacheMaxFrames();
+
+    if (maxFrames <= 0) {
+        return;
+    }
+    if ( findCachedFrame(frame) != _cache.end() ) {
+        // already there (decoded concurrently by the read-ahead thread)
+        return;
+    }
+    CachedFrame* cached;
+    if ( (int)_cache.size() >= maxFrames ) {
+        // recycle the least recently used frame
+        cached = _cache.back();
+        _cache.pop_back();
+        av_frame_unref(cached->avFrame);
+    } else {
+        cached = new CachedFrame;
+        cached->avFrame = av_frame_alloc();
+    }
+    if ( !cached->avFrame || (av_frame_ref(cached->avFrame, avFrame) < 0) ) {
+        delete cached;
+
+        return;
+    }
+    cached->frame = frame;
+    _cache.push_front(cached);
+}
+
+void
+FFmpegFile::clearCache()
+{
+    CondAutoMutex guard(_cacheLock);
+
+    for (FrameCache::iterator it = _cache.begin(); it != _cache.end(); ++it) {
+        delete *it;
+    }
+    _cache.clear();
+}
+
+int
+FFmpegFile::getLastRequestedFrame() const
+{
+    CondAutoMutex guard(_cacheLock);
+
+    return _lastRequestedFrame;
+}
+
+// Detect sequential access, and update the range of frames to be decoded by the read-ahead thread
+void
+FFmpegFile::updateReadAhead(int frame,
+                            bool isPlayback)
+{
+    CondAutoMutex guard(_cacheLock);
+
+    if (frame == _lastRequestedFrame) {
+        // another tile of the same frame
+        return;
+    }
+    bool sequential = isPlayback || (frame == _lastRequestedFrame + 1);
+
+    _lastRequestedFrame = frame;
+#ifdef OFX_IO_MT_FFMPEG
+    if (!sequential) {
+        // stop reading ahead
+        _readAheadLast = _readAheadNext - 1;
+
+        return;
+    }
+    // read ahead the frames that fit in the cache, keeping the last requested one
+    int readAheadFrames = getCacheMaxFrames() - 2;
+    if (readAheadFrames <= 0) {
+        return;
+    }
+    if ( (_readAheadNext <= frame) || (_readAheadNext > frame + readAheadFrames) ) {
+        _readAheadNext = frame + 1;
+    }
+    _readAheadLast = frame + readAheadFrames;
+    if (!_readAheadThread) {
+        _readAheadQuit = false;
+        _readAheadThread = new tthread::thread(readAheadThreadFunction, this);
+    }
+    _readAheadCond.notify_all();
+#else
+    (void)sequential;
+#endif
+}
+
+#ifdef OFX_IO_MT_FFMPEG
+void
+FFmpegFile::readAheadThreadFunction(void* arg)
+{
+    static_cast<FFmpegFile*>(arg)->readAheadThreadLoop();
+}
+
+// Decode the frames from _readAheadNext to _readAheadLast into the cache, until the file is destroyed
+void
+FFmpegFile::readAheadThreadLoop()
+{
+    CondAutoMutex cacheGuard(_cacheLock);
+
+    for (;;) {
+        while (!_readAheadQuit && _readAheadLast < _readAheadNext) {
+            _readAheadCond.wait(_cacheLock);
+        }
+        if (_readAheadQuit) {
+            break;
+        }
+        int frame = _readAheadNext++;
+        if ( findCachedFrame(frame) != _cache.end() ) {
+            continue;
+        }
+        int maxRetries = _maxRetries;
+        _readAheadDecoding = frame;
+        cacheGuard.unlock();
+
+        // decodeFrame() puts the decoded frame in the cache
+        AVFrame* avFrame = NULL;
+        bool ok = false;
+        try {
+            AutoMutex guard(_lock);
+            ok = decodeFrame(NULL, frame, false, maxRetries, &avFrame);
+        } catch (const std::exception&) {
+            // probably past the last frame
+            ok = false;
+        }
+        av_frame_free(&avFrame);
+
+        cacheGuard.relock();
+        _readAheadDecoding = INT_MIN;
+        // wake up the render threads waiting for this frame in decode()
+        _readAheadCond.notify_all();
+        if ( !ok || ( findCachedFrame(frame) == _cache.end() ) ) {
+            // decoding failed, or the frame was clamped to the last frame of the file and not cached:
+            // stop reading ahead until the next request
+            _readAheadLast = _readAheadNext - 1;
+        }
+    }
+}
+#endif // OFX_IO_MT_FFMPEG
+
+// decode a single frame, or get it from the frame cache. Thread safe
+AVFrame*
+FFmpegFile::decode(const ImageEffect* plugin,
+                   int frame,
+                   bool loadNearest,
+                   int maxRetries,
+                   bool isPlayback)
+{
+    {
+        CondAutoMutex cacheGuard(_cacheLock);
+        _maxRetries = maxRetries;
+#ifdef OFX_IO_MT_FFMPEG
+        // the read-ahead thread is decoding this frame: wait for it rather than seeking back to decode it again
+        while (_readAheadDecoding == frame) {
+            _readAheadCond.wait(_cacheLock);
+        }
+#endif
+    }
+    AVFrame* avFrame = getCachedFrame(frame);
+    if (avFrame) {
+        updateReadAhead(frame, isPlayback);
+
+        return avFrame;
+    }
+
+    bool hasPicture;
+    {
+        // the decoder may be shared with other instances (see FFmpegFileManager), so always lock it
+        AutoMutex guard(_lock);
+        // the frame may have been decoded into the cache while waiting for the lock
+        avFrame = getCachedFrame(frame);
+        hasPicture = avFrame || decodeFrame(plugin, frame, loadNearest, maxRetries, &avFrame);
+    }
+    if (!hasPicture) {
+        av_frame_free(&avFrame);
+
+        return NULL;
+    }
+    updateReadAhead(frame, isPlayback);
+
+    return avFrame;
+}
+
 // decode a single frame into the buffer thread safe
 bool
 FFmpegFile::decode(const ImageEffect* plugin,
                    int frame,
                    bool loadNearest,
                    int maxRetries,
+                   bool isPlayback,
                    unsigned char* buffer)
+{
+    AVFrame* avFrame = decode(plugin, frame, loadNearest, maxRetries, isPlayback);
+
+    if (!avFrame) {
+        return false;
+    }
+    bool ok = convert(avFrame, buffer);
+    av_frame_free(&avFrame);
+
+    return ok;
+}
+
+int
+FFmpegFile::getRowAlignment(const AVFrame* avFrame) const
+{
+    if ( _streams.empty() ) {
+        return std::max(avFrame->height, 1);
+    }
+
+    // same as FFmpeg::SliceConverter::getRowAlignment()
+    return FFmpeg::pixelFormatsSliceAlignment( (AVPixelFormat)avFrame->format, _streams[0]->_outputPixelFormat, avFrame->height );
+}
+
+// convert a decoded frame to the output pixel format (see getBufferBytesCount()). Thread safe
+bool
+FFmpegFile::convert(const AVFrame* avFrame,
+                    unsigned char* buffer)
+{
+    if ( _streams.empty() ) {
+        return false;
+    }
+
+    return convert(avFrame, 0, _streams[0]->_height, buffer);
+}
+
+// convert the rows [y1, y2) of a decoded frame (from the top) to the output pixel format. Thread safe
+bool
+FFmpegFile::convert(const AVFrame* avFrame,
+                    int y1,
+                    int y2,
+                    unsigned char* buffer)
+{
+    if ( _streams.empty() ) {
+        return false;
+    }
+    Stream* stream = _streams[0];
+
+    assert(0 <= y1 && y1 < y2 && y2 <= stream->_height);
+    assert( (y1 % getRowAlignment(avFrame) == 0) && (y2 == stream->_height || y2 % getRowAlignment(avFrame) == 0) );
+
+    // the converter is thread safe: the rows are converted by bands in parallel, without holding _lock
+    stream->setupConverter( (AVPixelFormat)avFrame->format, stream->_codecContext->color_range );
+    uint8_t *data[4];
+    int linesize[4];
+    av_image_fill_arrays(data, linesize, buffer, stream->_outputPixelFormat, stream->_width, y2 - y1, 1);
+
+    return stream->_converter.convert(avFrame->data, avFrame->linesize, y1, y2, data, linesize);
+}
+
+// The YCbCr to RGB conversion used by setupConverter() for this stream
+void
+FFmpegFile::Stream::getColorMatrix(AVPixelFormat srcPixelFormat,
+                                   int srcColorRange,
+                                   double* kr,
+                                   double* kb,
+                                   bool* fullRange)
+{
+    bool rec709 = isRec709Format();
+    // Optional color space override
+    if (_colorMatrixTypeOverride > 0) {
+        rec709 = (_colorMatrixTypeOverride == 1);
+    }
+    if (rec709) {
+        *kr = 0.2126;
+        *kb = 0.0722;
+    } else {
+        *kr = 0.299;
+        *kb = 0.114;
+    }
+    switch (srcColorRange) {
+    case AVCOL_RANGE_MPEG:
+        *fullRange = false;
+        break;
+    case AVCOL_RANGE_JPEG:
+        *fullRange = true;
+        break;
+    case AVCOL_RANGE_UNSPECIFIED:
+    default:
+        // same as setupConverter(): the deprecated "J" formats are full range
+        *fullRange = (srcPixelFormat == AV_PIX_FMT_YUVJ420P ||
+                      srcPixelFormat == AV_PIX_FMT_YUVJ422P ||
+                      srcPixelFormat == AV_PIX_FMT_YUVJ444P ||
+                      srcPixelFormat == AV_PIX_FMT_YUVJ440P ||
+                      !isYUV() );
+        break;
+    }
+}
+
+bool
+FFmpegFile::getColorMatrix(const AVFrame* avFrame,
+                           double* kr,
+                           double* kb,
+                           bool* fullRange)
+{
+    if ( _streams.empty() || !_streams[0]->isYUV() ) {
+        return false;
+    }
+    Stream* stream = _streams[0];
+
+    // no need to lock: this only reads stream properties which do not change while decoding
+    stream->getColorMatrix( (AVPixelFormat)avFrame->format, stream->_codecContext->color_range, kr, kb, fullRange );
+
+    return true;
+}
+
+// decode a single frame, _lock must be locked. On success, *avFrame is a new reference to the decoded frame
+bool
+FFmpegFile::decodeFrame(const ImageEffect* plugin,
+                        int frame,
+                        bool loadNearest,
+                        int maxRetries,
+                        AVFrame** avFrame)
 {
     const unsigned int streamIdx = 0;
 
-#ifdef OFX_IO_MT_FFMPEG
-    AutoMutex guard(_lock);
-#endif
+    ///Private should not lock
 
     if ( streamIdx >= _streams.size() ) {
         return false;
@@ -1123,7 +1683,12 @@ FFmpegFile::decode(const ImageEffect* plugin,
     int lastSeekedFrame = -1; // 0-based index of the last frame to which we seeked when seek in progress / negative when no
     // seek in progress,
 
-    if (desiredFrame != stream->_decodeNextFrameOut) {
+    // If the stream is indexed and the desired frame is after the next one to be decoded, but no key frame lies between
+    // them, decoding forward from the current position is always faster than seeking back to the same key frame.
+    bool decodeForward = ( stream->_indexed && (stream->_decodeNextFrameOut >= 0) && (desiredFrame > stream->_decodeNextFrameOut) &&
+                           (stream->keyFrameBefore(desiredFrame) <= stream->_decodeNextFrameOut) );
+
+    if ( (desiredFrame != stream->_decodeNextFrameOut) && !decodeForward ) {
 #if TRACE_DECODE_PROCESS
         std::cout << "  Next frame expected out=" << stream->_decodeNextFrameOut << ", Seeking to desired frame" << std::endl;
 #endif
@@ -1152,7 +1717,6 @@ FFmpegFile::decode(const ImageEffect* plugin,
     do {
         bool decodeAttempted = false;
         int frameDecoded = 0;
-        int srcColourRange = stream->_codecContext->color_range;
 
         // If the next frame to decode is within range of frames (or negative implying invalid; we've just seeked), read
         // a new frame from the source file and feed it to the decoder if it's for the video stream.
@@ -1243,9 +1807,12 @@ FFmpegFile::decode(const ImageEffect* plugin,
                         }
 #endif
 
-                        // Wind back 1 frame from last seeked frame. If that takes us to before frame 0, we're never going to be
-                        // able to synchronise using the current timestamp source...
-                        if (--lastSeekedFrame < 0) {
+                        // Wind back 1 frame from last seeked frame, or from the key frame before it if the stream is indexed.
+                        // If that takes us to before frame 0, we're never going to be able to synchronise using the current
+                        // timestamp source...
+                        int keyFrame = stream->keyFrameBefore(lastSeekedFrame);
+                        lastSeekedFrame = ( (keyFrame >= 0) ? keyFrame : lastSeekedFrame ) - 1;
+                        if (lastSeekedFrame < 0) {
 #if TRACE_DECODE_PROCESS
                             std::cout << ", can't seek before start";
 #endif
@@ -1427,42 +1994,12 @@ FFmpegFile::decode(const ImageEffect* plugin,
                 std::cout << ", is desired frame" << std::endl;
 #endif
 
-                SwsContext* context = NULL;
-                {
-                    context = stream->getConvertCtx(stream->_codecContext->pix_fmt, stream->_width, stream->_height,
-                                                    srcColourRange,
-                                                    stream->_outputPixelFormat, stream->_width, stream->_height);
-                }
+                // get a new reference to the decoded picture: the decoder reuses stream->_avFrame
+                *avFrame = av_frame_clone(stream->_avFrame);
+                if (!*avFrame) {
+                    setError("Out of memory", "FFmpeg Reader failed to decode the frame: ");
 
-                // Scale if any of the decoding path has provided a convert
-                // context. Otherwise, no scaling/conversion is required after
-                // decoding the frame.
-                if (context) {
-                    uint8_t *data[4];
-                    int linesize[4];
-#if 0
-                    {
-                        AVPicture output;
-                        avpicture_fill(&output, buffer, stream->_outputPixelFormat, stream->_width, stream->_height);
-                        data[0] = output.data[0];
-                        data[1] = output.data[1];
-                        data[2] = output.data[2];
-                        data[3] = output.data[3];
-                        linesize[0] = output.linesize[0];
-                        linesize[1] = output.linesize[1];
-                        linesize[2] = output.linesize[2];
-                        linesize[3] = output.linesize[3];
-                    }
-#else
-                    av_image_fill_arrays(data, linesize, buffer, stream->_outputPixelFormat, stream->_width, stream->_height, 1);
-#endif
-                    sws_scale(context,
-                              stream->_avFrame->data,
-                              stream->_avFrame->linesize,
-                              0,
-                              stream->_height,
-                              data,
-                              linesize);
+                    return false;
                 }
 
                 hasPicture = true;
@@ -1552,7 +2089,7 @@ FFmpegFile::decode(const ImageEffect* plugin,
             } // if (decodeAttempted)
         } // if (stream->_decodeNextFrameIn < stream->_frames)
         av_packet_unref(&_avPacket);
-        if ( plugin->abort() ) {
+        if ( plugin && plugin->abort() ) {
             return false;
         }
     } while (!hasPicture);
@@ -1569,10 +2106,13 @@ FFmpegFile::decode(const ImageEffect* plugin,
             av_packet_unref(&_avPacket);
         }
         stream->_decodeNextFrameOut = -1;
+    } else if (desiredFrame == frame - 1) {
+        // only cache frames that were not clamped to the frame range
+        cacheFrame(frame, *avFrame);
     }
 
     return hasPicture;
-} // FFmpegFile::decode
+} // FFmpegFile::decodeFrame
 
 bool
 FFmpegFile::getFPS(double & fps,
@@ -1629,18 +2169,20 @@ FFmpegFile::getBufferBytesCount() const
 }
 
 FFmpegFileManager::FFmpegFileManager()
-    : _files()
+    : _pool()
+    , _files()
     , _lock(0)
+    , _maxOpenFiles(OFX_FFMPEG_POOL_MAX_FILES)
+    , _maxDecodingThreads(0)
 {
 }
 
 FFmpegFileManager::~FFmpegFileManager()
 {
-    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
-        for (std::list<FFmpegFile*>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-            delete *it2;
-        }
+    for (FilePool::iterator it = _pool.begin(); it != _pool.end(); ++it) {
+        delete it->file;
     }
+    _pool.clear();
     _files.clear();
     delete _lock;
 }
@@ -1649,6 +2191,224 @@ void
 FFmpegFileManager::init()
 {
     _lock = new FFmpegFile::Mutex;
+
+    // the budget may be overridden from the environment
+    const char* maxOpenFiles = std::getenv("OFX_FFMPEG_MAX_OPEN_FILES");
+    const char* maxDecodingThreads = std::getenv("OFX_FFMPEG_MAX_DECODING_THREADS");
+    setBudget( maxOpenFiles ? std::atoi(maxOpenFiles) : 0,
+               maxDecodingThreads ? std::atoi(maxDecodingThreads) : 0 );
+}
+
+void
+FFmpegFileManager::setBudget(int maxOpenFiles,
+                             int maxDecodingThreads)
+{
+    if (maxOpenFiles <= 0) {
+        maxOpenFiles = OFX_FFMPEG_POOL_MAX_FILES;
+    }
+    if (maxDecodingThreads <= 0) {
+        // allow some oversubscription, since decoders are rarely all busy at the same time
+        maxDecodingThreads = 2 * std::min( (int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS );
+    }
+    if (_lock) {
+        FFmpegFile::AutoMutex guard(*_lock);
+        _maxOpenFiles = maxOpenFiles;
+        _maxDecodingThreads = maxDecodingThreads;
+        evictUnused(0, 0);
+    } else {
+        _maxOpenFiles = maxOpenFiles;
+        _maxDecodingThreads = maxDecodingThreads;
+    }
+}
+
+FFmpegFileManager::FilePool::iterator
+FFmpegFileManager::findInPool(FFmpegFile* file) const
+{
+    ///Private should not lock
+
+    for (FilePool::iterator it = _pool.begin(); it != _pool.end(); ++it) {
+        if (it->file == file) {
+            return it;
+        }
+    }
+
+    return _pool.end();
+}
+
+int
+FFmpegFileManager::getDecodingThreads() const
+{
+    ///Private should not lock
+
+    int threads = 0;
+    for (FilePool::const_iterator it = _pool.begin(); it != _pool.end(); ++it) {
+        threads += it->file->getThreadCount();
+    }
+
+    return threads;
+}
+
+void
+FFmpegFileManager::evictUnused(int newFiles,
+                               int newThreads) const
+{
+    ///Private should not lock
+
+    int files = (int)_pool.size();
+    int threads = getDecodingThreads();
+    FilePool::iterator it = _pool.end();
+    while ( ( (files + newFiles > _maxOpenFiles) || (threads + newThreads > _maxDecodingThreads) ) && it != _pool.begin() ) {
+        --it;
+        if (it->users == 0) {
+            --files;
+            threads -= it->file->getThreadCount();
+            delete it->file;
+            it = _pool.erase(it);
+        }
+    }
+}
+
+// distance between the frame read by a file and frame, or 0 if either is unknown
+static int
+frameDistance(FFmpegFile* file,
+              int frame)
+{
+    int lastFrame = file->getLastRequestedFrame();
+
+    if ( (frame < 0) || (lastFrame == INT_MIN) ) {
+        return 0;
+    }
+
+    return std::abs(lastFrame - frame);
+}
+
+FFmpegFile*
+FFmpegFileManager::acquireSeparate(const string &filename,
+                                   int frame) const
+{
+    ///Private should not lock
+
+    // prefer an unused decoder, positioned as close as possible to frame
+    FilePool::iterator best = _pool.end();
+    int bestDistance = 0;
+    for (FilePool::iterator it = _pool.begin(); it != _pool.end(); ++it) {
+        if ( (it->users == 0) && (it->file->getFilename() == filename) && !it->file->isInvalid() ) {
+            int distance = frameDistance(it->file, frame);
+            if ( (best == _pool.end()) || (distance < bestDistance) ) {
+                best = it;
+                bestDistance = distance;
+            }
+        }
+    }
+    if ( best != _pool.end() ) {
+        ++best->users;
+        _pool.splice(_pool.begin(), _pool, best);
+
+        return _pool.front().file;
+    }
+
+    // open a new decoder, if the budget allows it
+    evictUnused(1, 1);
+    int threads = _maxDecodingThreads - getDecodingThreads();
+    if ( ( (int)_pool.size() >= _maxOpenFiles ) || (threads <= 0) ) {
+        return NULL;
+    }
+    PooledFile pooled;
+    pooled.file = new FFmpegFile( filename, std::min( threads, std::min( (int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS ) ) );
+    pooled.users = 1;
+    _pool.push_front(pooled);
+
+    return pooled.file;
+}
+
+FFmpegFileManager::FilePool::iterator
+FFmpegFileManager::findNearby(const string &filename,
+                              int frame,
+                              FFmpegFile* exclude) const
+{
+    ///Private should not lock
+
+    // the decoder reading the closest to frame, or the least used one
+    FilePool::iterator best = _pool.end();
+    for (FilePool::iterator it = _pool.begin(); it != _pool.end(); ++it) {
+        if ( (it->file != exclude) && (it->file->getFilename() == filename) && !it->file->isInvalid() &&
+             (frameDistance(it->file, frame) <= OFX_FFMPEG_POOL_SHARE_DISTANCE) ) {
+            if ( ( best == _pool.end() ) ||
+                 ( frameDistance(it->file, frame) < frameDistance(best->file, frame) ) ||
+                 ( ( frameDistance(it->file, frame) == frameDistance(best->file, frame) ) && (it->users < best->users) ) ) {
+                best = it;
+            }
+        }
+    }
+
+    return best;
+}
+
+FFmpegFile*
+FFmpegFileManager::acquire(const string &filename,
+                           int frame) const
+{
+    ///Private should not lock
+
+    // share a decoder of this file which reads frames close to frame, if any
+    FilePool::iterator nearby = findNearby(filename, frame, NULL);
+
+    if ( nearby != _pool.end() ) {
+        ++nearby->users;
+        _pool.splice(_pool.begin(), _pool, nearby);
+
+        return _pool.front().file;
+    }
+
+    FFmpegFile* file = acquireSeparate(filename, frame);
+    if (file) {
+        return file;
+    }
+
+    // the budget is exhausted: share the decoder which is the closest to frame, or the least used one
+    FilePool::iterator best = _pool.end();
+    for (FilePool::iterator it = _pool.begin(); it != _pool.end(); ++it) {
+        if ( (it->file->getFilename() == filename) && !it->file->isInvalid() ) {
+            if ( ( best == _pool.end() ) ||
+                 ( frameDistance(it->file, frame) < frameDistance(best->file, frame) ) ||
+                 ( ( frameDistance(it->file, frame) == frameDistance(best->file, frame) ) && (it->users < best->users) ) ) {
+                best = it;
+            }
+        }
+    }
+    if ( best != _pool.end() ) {
+        ++best->users;
+        _pool.splice(_pool.begin(), _pool, best);
+
+        return _pool.front().file;
+    }
+
+    // this file is not opened yet: open it anyway, with a single decoding thread
+    PooledFile pooled;
+    pooled.file = new FFmpegFile(filename, 1);
+    pooled.users = 1;
+    _pool.push_front(pooled);
+
+    return pooled.file;
+}
+
+void
+FFmpegFileManager::release(FFmpegFile* file) const
+{
+    ///Private should not lock
+
+    FilePool::iterator found = findInPool(file);
+
+    assert( found != _pool.end() );
+    if ( found == _pool.end() ) {
+        return;
+    }
+    --found->users;
+    assert(found->users >= 0);
+    if ( (found->users == 0) && found->file->isInvalid() ) {
+        delete found->file;
+        _pool.erase(found);
+    }
 }
 
 void
@@ -1659,10 +2419,12 @@ FFmpegFileManager::clear(void const * plugin)
     FilesMap::iterator found = _files.find(plugin);
     if ( found != _files.end() ) {
         for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            delete *it;
+            release(*it);
         }
         _files.erase(found);
     }
+    // unused files stay opened for later use, within the budget
+    evictUnused(0, 0);
 }
 
 FFmpegFile*
@@ -1679,7 +2441,7 @@ FFmpegFileManager::get(void const * plugin,
         for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
             if ( (*it)->getFilename() == filename ) {
                 if ( (*it)->isInvalid() ) {
-                    delete *it;
+                    release(*it);
                     found->second.erase(it);
                     break;
                 } else {
@@ -1694,7 +2456,8 @@ FFmpegFileManager::get(void const * plugin,
 
 FFmpegFile*
 FFmpegFileManager::getOrCreate(void const * plugin,
-                               const string &filename) const
+                               const string &filename,
+                               int frame) const
 {
     if (filename.empty() || !plugin) {
         return 0;
@@ -1702,28 +2465,60 @@ FFmpegFileManager::getOrCreate(void const * plugin,
     assert(_lock);
     FFmpegFile::AutoMutex guard(*_lock);
     FilesMap::iterator found = _files.find(plugin);
-    if ( found != _files.end() ) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            if ( (*it)->getFilename() == filename ) {
-                if ( (*it)->isInvalid() ) {
-                    delete *it;
-                    found->second.erase(it);
-                    break;
-                } else {
-                    return *it;
-                }
+    if ( found == _files.end() ) {
+        found = _files.insert( make_pair( plugin, std::list<FFmpegFile*>() ) ).first;
+    }
+
+    // among the files used by this instance, find the one closest to frame
+    std::list<FFmpegFile*>& fileList = found->second;
+    std::list<FFmpegFile*>::iterator best = fileList.end();
+    int decoders = 0; // the number of decoders of this file used by this instance
+    for (std::list<FFmpegFile*>::iterator it = fileList.begin(); it != fileList.end();) {
+        if ( (*it)->getFilename() != filename ) {
+            ++it;
+        } else if ( (*it)->isInvalid() ) {
+            release(*it);
+            it = fileList.erase(it);
+        } else {
+            ++decoders;
+            if ( ( best == fileList.end() ) || ( frameDistance(*it, frame) < frameDistance(*best, frame) ) ) {
+                best = it;
             }
+            ++it;
         }
     }
+    if ( best != fileList.end() ) {
+        FilePool::iterator pooled = findInPool(*best);
+        assert( pooled != _pool.end() );
+        if ( (pooled->users > 1) && (frameDistance(*best, frame) > OFX_FFMPEG_POOL_SHARE_DISTANCE) &&
+             (decoders < OFX_FFMPEG_POOL_MAX_FILES_PER_INSTANCE) ) {
+            // shared with other instances that read elsewhere in the file: use a decoder that reads near
+            // frame, or try to get a separate one. The shared one is kept, since it may still be in use by
+            // another render thread of this instance. The number of decoders kept by an instance is bounded,
+            // since they are only released when the instance is destroyed or its file changes.
+            FFmpegFile* file = NULL;
+            FilePool::iterator nearby = findNearby(filename, frame, *best);
+            // (*best is the closest among the decoders of this instance, so nearby is not one of them)
+            if ( nearby != _pool.end() ) {
+                ++nearby->users;
+                _pool.splice(_pool.begin(), _pool, nearby);
+                file = nearby->file;
+            } else {
+                file = acquireSeparate(filename, frame);
+            }
+            if (file) {
+                fileList.push_back(file);
 
-    FFmpegFile* file = new FFmpegFile(filename);
-    if ( found == _files.end() ) {
-        std::list<FFmpegFile*> fileList;
-        fileList.push_back(file);
-        _files.insert( make_pair(plugin, fileList) );
-    } else {
-        found->second.push_back(file);
+                return file;
+            }
+        }
+        _pool.splice(_pool.begin(), _pool, pooled);
+
+        return *best;
     }
 
+    FFmpegFile* file = acquire(filename, frame);
+    fileList.push_back(file);
+
     return file;
 }
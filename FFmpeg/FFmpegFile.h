@@ -52,11 +52,13 @@ extern "C" {
 #include "FFmpegCompat.h"
 
 #include "ofxsMultiThread.h"
+#include "SliceConverter.h"
 #ifndef OFX_USE_MULTITHREAD_MUTEX
 // some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
 // prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
 #include "fast_mutex.h"
 #endif
+#include "tinythread.h" // for the read-ahead thread and its condition variable
 
 #define CHECKMSG(x, msg) \
     { \
@@ -89,6 +91,16 @@ extern "C" {
 
 #define OFX_FFMPEG_MAX_THREADS 32 // defined in libavcodec/mpegvideo.h and libavcodec/h264.h
 
+#define OFX_FFMPEG_CACHE_MAX_FRAMES 8 // maximum number of decoded frames kept in the frame cache of each file
+#define OFX_FFMPEG_CACHE_MAX_BYTES (512 * 1024 * 1024) // maximum memory used by the frame cache of each file
+
+#define OFX_FFMPEG_POOL_MAX_FILES 32 // default maximum number of opened files, for all plug-in instances
+#define OFX_FFMPEG_POOL_SHARE_DISTANCE OFX_FFMPEG_CACHE_MAX_FRAMES // instances reading frames farther apart than this get separate decoders
+#define OFX_FFMPEG_POOL_MAX_FILES_PER_INSTANCE 4 // maximum number of decoders of the same file used by a plug-in instance
+
+#define kFFmpegIndexFileExtension ".ofxindex" // extension of the sidecar seek index file
+#define kFFmpegIndexFileHeader "openfx-io FFmpeg seek index 1" // first line of the sidecar seek index file
+
 ////////////////////////////////////////////////////////////////////////////////
 // Chunksize static names.
 ////////////////////////////////////////////////////////////////////////////////
@@ -109,6 +121,9 @@ public:
     typedef tthread::fast_mutex Mutex;
     typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
 #endif
+    // tthread::condition_variable can only wait on a tthread::mutex
+    typedef tthread::mutex CondMutex;
+    typedef OFX::MultiThread::AutoMutexT<tthread::mutex> CondAutoMutex;
 
 private:
     struct Stream
@@ -118,8 +133,7 @@ private:
         AVCodecContext* _codecContext; // video codec context
         AVCodec* _videoCodec;
         AVFrame* _avFrame;             // decoding frame
-        SwsContext* _convertCtx;
-        bool _resetConvertCtx;
+        FFmpeg::SliceConverter _converter; // conversion to the output pixel format
         int _fpsNum;
         int _fpsDen;
         int64_t _startPTS;     // PTS of the first frame in the stream
@@ -147,6 +161,9 @@ private:
         int _accumDecodeLatency; // The number of frames that have been input without any frame being output so far in this stream
         // since the last seek. This is part of a guard mechanism to detect when decode appears to have
         // stalled and ensure that FFmpegFile::decode() does not loop indefinitely.
+        bool _indexed; // True if the seek index below was built for this stream.
+        std::map<int, int64_t> _keyFrames; // Seek index: maps the 0-based index of each key frame in the stream to the
+        // timestamp to pass to av_seek_frame() to land on that key frame. Empty if the stream is not indexed.
 
         Stream()
             : _idx(0)
@@ -154,8 +171,7 @@ private:
             , _codecContext(NULL)
             , _videoCodec(NULL)
             , _avFrame(NULL)
-            , _convertCtx(NULL)
-            , _resetConvertCtx(true)
+            , _converter()
             , _fpsNum(1)
             , _fpsDen(1)
             , _startPTS(0)
@@ -174,6 +190,8 @@ private:
             , _decodeNextFrameIn(-1)
             , _decodeNextFrameOut(-1)
             , _accumDecodeLatency(0)
+            , _indexed(false)
+            , _keyFrames()
         {
             // The purpose of this is to avoid an RGB->RGB conversion.
             // This saves memory and improves performance. For example
@@ -198,10 +216,6 @@ private:
                 avcodec_flush_buffers(_codecContext);
                 avcodec_free_context(&_codecContext);
             }
-
-            if (_convertCtx) {
-                sws_freeContext(_convertCtx);
-            }
         }
 
         static void destroy(Stream* s)
@@ -231,6 +245,20 @@ private:
             return static_cast<int>(denominator ? (numerator / denominator) : numerator);
         }
 
+        // Return the 0-based index of the last key frame at or before |frame| according to the seek index,
+        // or -1 if the stream is not indexed or if there is no such key frame.
+        int keyFrameBefore(int frame) const
+        {
+            std::map<int, int64_t>::const_iterator it = _keyFrames.upper_bound(frame);
+
+            if ( it == _keyFrames.begin() ) {
+                return -1;
+            }
+            --it;
+
+            return it->first;
+        }
+
         bool isRec709Format()
         {
             // First check for codecs which require special handling:
@@ -255,9 +283,13 @@ private:
 
         static double GetStreamAspectRatio(Stream* stream);
 
-        // Generate the conversion context used by SoftWareScaler if not already set.
-        // |reset| forces recalculation of cached context.
-        SwsContext* getConvertCtx(AVPixelFormat srcPixelFormat, int srcWidth, int srcHeight, int srcColorRange, AVPixelFormat dstPixelFormat, int dstWidth, int dstHeight);
+        // Set up the conversion of decoded frames to the output pixel format. The converter only
+        // recreates its contexts if the conversion changed (e.g. when the color matrix override is modified). Thread safe
+        void setupConverter(AVPixelFormat srcPixelFormat, int srcColorRange);
+
+        // Get the YCbCr to RGB conversion used by setupConverter(): the luma coefficients of red and blue,
+        // and whether the source uses the full range of values.
+        void getColorMatrix(AVPixelFormat srcPixelFormat, int srcColorRange, double* kr, double* kb, bool* fullRange);
 
         // Return the number of input frames needed by this stream's codec before it can produce output. We expect to have to
         // wait this many frames to receive output; any more and a decode stall is detected.
@@ -272,6 +304,7 @@ private:
     };
 
     std::string _filename;
+    int _threadCount;       // number of decoding threads used by the video codec
 
     // AV structure
     AVFormatContext* _context;
@@ -285,12 +318,49 @@ private:
     bool _invalidState;     // true if the reader is in an invalid state
     AVPacket _avPacket;
 
-#ifdef OFX_IO_MT_FFMPEG
-    // internal lock for multithread access
+    // internal lock for multithread access. It always exists, since the file may be shared by
+    // several instances (see FFmpegFileManager), even if each instance renders in one thread.
     mutable Mutex _lock;
+#ifdef OFX_IO_MT_FFMPEG
     mutable Mutex _invalidStateLock;
 #endif
 
+    // Cache of the most recently decoded frames (stream 0), in the pixel format of the codec.
+    // The most recently used frame is at the front of the list.
+    struct CachedFrame
+    {
+        int frame;             // 1-based frame number, as passed to decode()
+        AVFrame* avFrame;      // a reference to the decoded frame
+
+        CachedFrame()
+            : frame(-1)
+            , avFrame(NULL)
+        {
+        }
+
+        ~CachedFrame()
+        {
+            av_frame_free(&avFrame);
+        }
+    };
+
+    typedef std::list<CachedFrame*> FrameCache;
+    mutable CondMutex _cacheLock; // protects all the members below
+    FrameCache _cache;
+    int _cacheMaxFrames;       // maximum number of frames in _cache
+    int _lastRequestedFrame;   // the last frame passed to decode(), used to detect sequential access
+    int _maxRetries;           // the last maxRetries passed to decode(), used by the read-ahead thread
+#ifdef OFX_IO_MT_FFMPEG
+    // Read-ahead: once sequential access is detected, a background thread decodes the
+    // frames after the last requested frame into the cache.
+    tthread::thread* _readAheadThread;
+    tthread::condition_variable _readAheadCond; // signalled when the read-ahead range changes, when a frame was read ahead, or to quit
+    int _readAheadNext;        // next frame to read ahead
+    int _readAheadLast;        // last frame to read ahead (no read-ahead if _readAheadLast < _readAheadNext)
+    int _readAheadDecoding;    // the frame being decoded by the read-ahead thread, INT_MIN if none
+    bool _readAheadQuit;
+#endif
+
     // set reader error
     void setError(const char* msg, const char* prefix = 0);
 
@@ -312,12 +382,32 @@ private:
 
     bool seekFrame(int frame, Stream* stream);
 
+    // decode a single frame (stream 0). _lock must be locked. On success, *avFrame is a new reference to the decoded frame
+    bool decodeFrame(const OFX::ImageEffect* plugin, int frame, bool loadNearest, int maxRetries, AVFrame** avFrame);
+
+    // frame cache
+    int getCacheMaxFrames();
+    FrameCache::iterator findCachedFrame(int frame);
+    AVFrame* getCachedFrame(int frame);
+    void cacheFrame(int frame, const AVFrame* avFrame);
+    void updateReadAhead(int frame, bool isPlayback);
+    void clearCache();
+#ifdef OFX_IO_MT_FFMPEG
+    static void readAheadThreadFunction(void* arg);
+    void readAheadThreadLoop();
+#endif
+
+    // seek index
+    void buildIndex();
+    bool readIndexFile(const std::string& indexFilename, long long mtime, long long size);
+    void writeIndexFile(const std::string& indexFilename, long long mtime, long long size) const;
+
 public:
 
     //FFmpegFile();
 
-    // constructor
-    FFmpegFile(const std::string& filename);
+    // constructor. If |threadCount| is 0, as many decoding threads as there are CPUs are used
+    FFmpegFile(const std::string& filename, int threadCount = 0);
 
     // destructor
     ~FFmpegFile();
@@ -339,7 +429,7 @@ public:
         return _streams.size();
     }
 
-    void setColorMatrixTypeOverride(int colorMatrixType) const
+    void setColorMatrixTypeOverride(int colorMatrixType)
     {
         if ( _streams.empty() ) {
             return;
@@ -347,8 +437,13 @@ public:
 
         // mov64Reader::decode always uses stream 0
         Stream* stream = _streams[0];
-        stream->_colorMatrixTypeOverride = colorMatrixType;
-        stream->_resetConvertCtx = true;
+        // the read-ahead thread or another instance may be decoding a frame into the cache
+        AutoMutex guard(_lock);
+        if (stream->_colorMatrixTypeOverride != colorMatrixType) {
+            stream->_colorMatrixTypeOverride = colorMatrixType;
+            // cached frames were converted with the previous color matrix
+            clearCache();
+        }
     }
 
     void setDoNotAttachPrefix(bool doNotAttachPrefix) const
@@ -459,8 +554,33 @@ public:
         return _streams[0]->_bitDepth > 8 ? sizeof(unsigned short) : sizeof(unsigned char);
     }
 
-    // decode a single frame into the buffer (stream 0). Thread safe
-    bool decode(const OFX::ImageEffect* plugin, int frame, bool loadNearest, int maxRetries, unsigned char* buffer);
+    // Build the seek index of all streams, by reading all the packets without decoding them, so that decode()
+    // can seek directly to the key frame before any frame. If |useIndexFile| is true, the index is read from
+    // (or saved to) a sidecar file next to the video file. Does nothing if the index was already built. Thread safe
+    void buildSeekIndex(bool useIndexFile);
+
+    // decode a single frame (stream 0), or get it from the frame cache. If |isPlayback| is true,
+    // or if frames are requested in sequential order, the following frames are decoded ahead of time.
+    // Returns a new reference to the decoded frame, to be freed with av_frame_free(), or NULL on failure. Thread safe
+    AVFrame* decode(const OFX::ImageEffect* plugin, int frame, bool loadNearest, int maxRetries, bool isPlayback);
+
+    // decode a single frame into the buffer (stream 0), converted to the output pixel format. Thread safe
+    bool decode(const OFX::ImageEffect* plugin, int frame, bool loadNearest, int maxRetries, bool isPlayback, unsigned char* buffer);
+
+    // convert a frame returned by decode() to the output pixel format (see getBufferBytesCount()). Thread safe
+    bool convert(const AVFrame* avFrame, unsigned char* buffer);
+
+    // convert the rows [y1, y2) of a frame returned by decode() (rows are numbered from the top) to the output
+    // pixel format. y1 and y2 must be multiples of getRowAlignment(), or 0 and the frame height. Thread safe
+    bool convert(const AVFrame* avFrame, int y1, int y2, unsigned char* buffer);
+
+    // the row alignment required for converting only part of a frame returned by decode(),
+    // depending on its chroma subsampling. Returns the frame height if the frame cannot be converted by parts
+    int getRowAlignment(const AVFrame* avFrame) const;
+
+    // get the YCbCr to RGB conversion used by convert() for a frame returned by decode().
+    // Returns false if the stream is not YCbCr. Thread safe
+    bool getColorMatrix(const AVFrame* avFrame, double* kr, double* kb, bool* fullRange);
 
     // get stream information
     bool getFPS(double& fps,
@@ -477,6 +597,15 @@ public:
 
     std::size_t getBufferBytesCount() const;
 
+    // the number of decoding threads, as passed to the constructor
+    int getThreadCount() const
+    {
+        return _threadCount;
+    }
+
+    // the last frame passed to decode(), or INT_MIN if decode() was never called. Thread safe
+    int getLastRequestedFrame() const;
+
     static bool isImageFile(const std::string& filename);
 
     //! Check whether a named container format is Whitelisted
@@ -489,12 +618,36 @@ public:
 };
 
 
+/**
+ * @brief A pool of opened files, shared by all the plug-in instances.
+ *
+ * Files are keyed on their path and reference-counted: instances reading the same
+ * file share the same decoder, unless they read frames that are far apart, in which
+ * case an instance gets its own decoder context from the pool (if the budget allows it,
+ * and at most OFX_FFMPEG_POOL_MAX_FILES_PER_INSTANCE decoders of the same file per instance).
+ * The number of opened files and decoding threads is bounded: files that are not used by
+ * any instance stay opened for later use, and the least recently used ones are closed
+ * when the budget is exceeded.
+ **/
 class FFmpegFileManager
 {
-    ///For each plug-in instance, a list of opened files
+    ///An opened file and the number of plug-in instances using it
+    struct PooledFile
+    {
+        FFmpegFile* file;
+        int users;
+    };
+
+    ///All opened files, the most recently used first
+    typedef std::list<PooledFile> FilePool;
+    mutable FilePool _pool;
+
+    ///For each plug-in instance, a list of used files
     typedef std::map<void const *, std::list<FFmpegFile*> > FilesMap;
     mutable FilesMap _files;
     mutable FFmpegFile::Mutex* _lock;
+    int _maxOpenFiles;       // maximum number of opened files
+    int _maxDecodingThreads; // maximum number of decoding threads, for all opened files
 
 public:
 
@@ -504,10 +657,39 @@ public:
 
     void init();
 
+    // set the budget of opened files and decoding threads (0 means the default value)
+    void setBudget(int maxOpenFiles, int maxDecodingThreads);
+
+    // release the files used by this plug-in instance
     void clear(void const * plugin);
 
     FFmpegFile* get(void const * plugin, const std::string &filename) const;
-    FFmpegFile* getOrCreate(void const * plugin, const std::string &filename) const;
+
+    // Get a file used by this plug-in instance. If |frame| is not -1, and the file is shared with
+    // other instances which read frames far from |frame|, a separate decoder may be returned.
+    FFmpegFile* getOrCreate(void const * plugin, const std::string &filename, int frame = -1) const;
+
+private:
+
+    FilePool::iterator findInPool(FFmpegFile* file) const;
+
+    // get an unused or a new decoder for filename, or NULL if the budget does not allow it
+    FFmpegFile* acquireSeparate(const std::string &filename, int frame) const;
+
+    // find a valid decoder for filename (other than |exclude|) reading frames close to |frame|
+    FilePool::iterator findNearby(const std::string &filename, int frame, FFmpegFile* exclude) const;
+
+    // get a decoder for filename: a decoder reading frames close to |frame| is shared, else a separate
+    // decoder is used if the budget allows it, else the closest decoder is shared
+    FFmpegFile* acquire(const std::string &filename, int frame) const;
+
+    void release(FFmpegFile* file) const;
+
+    // close the least recently used files that are not used, to make room for |newFiles| files
+    // and |newThreads| decoding threads
+    void evictUnused(int newFiles, int newThreads) const;
+
+    int getDecodingThreads() const;
 };
 
 
@@ -18,6 +18,9 @@
 
 #include "PixelFormat.h"
 
+#include <cstddef> // ptrdiff_t
+#include <algorithm>
+
 extern "C" {
 #include <libavutil/pixdesc.h>
 }
@@ -42,6 +45,135 @@ pixelFormatAlpha(AVPixelFormat pix_fmt)
     return desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA);
 }
 
+bool
+pixelFormatIsPlanarYUV(AVPixelFormat pix_fmt)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+
+    if ( !desc || !pixelFormatIsYUV(pix_fmt) ||
+         !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+         (desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL) ) ||
+         (desc->nb_components != 3 && desc->nb_components != 4) ) {
+        return false;
+    }
+    int bitDepth = pixelFormatBitDepth(pix_fmt);
+    if ( (bitDepth <= 0) || (bitDepth > 16) ) {
+        return false;
+    }
+    for (int i = 0; i < desc->nb_components; ++i) {
+        // one component per plane, stored in the least significant bits of each sample
+        if ( (desc->comp[i].plane != i) || (desc->comp[i].shift != 0) ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int
+pixelFormatSliceAlignment(AVPixelFormat pix_fmt)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+
+    if ( !desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL) ) ) {
+        return 0;
+    }
+
+    // the ordered dither matrices used by swscale are 8 rows high, and indexed by the row of the slice.
+    // This is also a multiple of the vertical chroma subsampling (at most 4 rows)
+    return 8;
+}
+
+// the vertical chroma subsampling, in rows (see sliceRows())
+static int
+chromaRows(AVPixelFormat pix_fmt)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+
+    if ( !desc || !pixelFormatIsYUV(pix_fmt) ) {
+        return 1;
+    }
+
+    return 1 << desc->log2_chroma_h;
+}
+
+int
+pixelFormatsSliceAlignment(AVPixelFormat srcPixelFormat,
+                           AVPixelFormat dstPixelFormat,
+                           int height)
+{
+    int srcAlignment = pixelFormatSliceAlignment(srcPixelFormat);
+    int dstAlignment = pixelFormatSliceAlignment(dstPixelFormat);
+    int chroma = std::max( chromaRows(srcPixelFormat), chromaRows(dstPixelFormat) );
+
+    // with an odd number of chroma rows, the chroma of the whole image is not scaled by exactly
+    // the subsampling factor, so a band would not be converted as in the whole image
+    if ( (srcAlignment <= 0) || (dstAlignment <= 0) || (height % chroma != 0) ) {
+        return std::max(height, 1);
+    }
+
+    // alignments are powers of two
+    return std::max(srcAlignment, dstAlignment);
+}
+
+int
+pixelFormatsSliceOverlap(AVPixelFormat srcPixelFormat,
+                         AVPixelFormat dstPixelFormat)
+{
+    int chroma = std::max( chromaRows(srcPixelFormat), chromaRows(dstPixelFormat) );
+
+    // swscale filters the chroma of vertically subsampled formats across rows (both when upsampling
+    // and when downsampling), and the bicubic filter reaches at most 2 chroma rows away when upsampling,
+    // and 2 subsampled rows away when downsampling. 8 chroma rows are enough, and a multiple of the
+    // dither matrix height
+    return (chroma > 1) ? 8 * chroma : 0;
+}
+
+template<typename PIX>
+static void
+sliceRows(AVPixelFormat pix_fmt,
+          PIX* const data[4],
+          const int linesize[4],
+          int y,
+          PIX* rows[4])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+
+    for (int p = 0; p < 4; ++p) {
+        rows[p] = data[p];
+    }
+    if (!desc || y == 0) {
+        return;
+    }
+    bool isYUV = pixelFormatIsYUV(pix_fmt);
+    // only offset the planes holding components (not the palette)
+    for (int c = 0; c < desc->nb_components; ++c) {
+        int plane = desc->comp[c].plane;
+        int shift = ( isYUV && (c == 1 || c == 2) ) ? desc->log2_chroma_h : 0;
+        rows[plane] = data[plane] + (std::ptrdiff_t)linesize[plane] * (y >> shift);
+    }
+}
+
+void
+pixelFormatSliceRows(AVPixelFormat pix_fmt,
+                     const unsigned char* const data[4],
+                     const int linesize[4],
+                     int y,
+                     const unsigned char* rows[4])
+{
+    sliceRows(pix_fmt, data, linesize, y, rows);
+}
+
+void
+pixelFormatSliceRows(AVPixelFormat pix_fmt,
+                     unsigned char* const data[4],
+                     const int linesize[4],
+                     int y,
+                     unsigned char* rows[4])
+{
+    sliceRows(pix_fmt, data, linesize, y, rows);
+}
+
 int
 pixelFormatBPP(const AVPixelFormat pixelFormat)
 {
@@ -49,6 +49,27 @@ int pixelFormatBPP(AVPixelFormat pixelFormat);
 PixelCodingEnum pixelFormatCoding(AVPixelFormat pixelFormat);
 bool pixelFormatAlpha(AVPixelFormat pixelFormat);
 
+// true if the pixel format is little-endian planar YUV, with one plane per component (including the
+// optional alpha plane) and at most 16 bits per component, so that it can be converted without swscale
+bool pixelFormatIsPlanarYUV(AVPixelFormat pixelFormat);
+
+// the row alignment needed to convert an image by horizontal slices (the height of the dither matrix), or 0
+// if images in this pixel format cannot be converted by slices (palette, bitstream or hardware formats)
+int pixelFormatSliceAlignment(AVPixelFormat pixelFormat);
+
+// the row alignment for converting images of |height| rows between two pixel formats by horizontal slices
+// without scaling, or |height| if they cannot be converted by slices that give the same result as the whole image
+int pixelFormatsSliceAlignment(AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat, int height);
+
+// the number of rows, within the image, that must be converted above and below each slice and then dropped,
+// so that the chroma of vertically subsampled formats (e.g. YUV 4:2:0) is filtered as in the whole image.
+// This is a multiple of pixelFormatSliceAlignment()
+int pixelFormatsSliceOverlap(AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat);
+
+// get the pointers to row |y| of each plane of an image. |y| must be a multiple of pixelFormatSliceAlignment()
+void pixelFormatSliceRows(AVPixelFormat pixelFormat, const unsigned char* const data[4], const int linesize[4], int y, const unsigned char* rows[4]);
+void pixelFormatSliceRows(AVPixelFormat pixelFormat, unsigned char* const data[4], const int linesize[4], int y, unsigned char* rows[4]);
+
 int pixelFormatBPPFromSpec(PixelCodingEnum coding, int bitdepth, bool alpha);
 
 }
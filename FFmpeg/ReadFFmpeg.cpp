@@ -43,7 +43,14 @@
 #include "GenericOCIO.h"
 #include "GenericReader.h"
 #include "FFmpegFile.h"
+#include "PixelFormat.h"
 #include "ofxsCopier.h"
+#include "ofxsPixelProcessor.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define OFX_FFMPEG_USE_SSE
+#endif
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -70,11 +77,244 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamMaxRetriesHint "Some video files are sometimes tricky to read and needs several retries before successfully decoding a frame. This" \
     " parameter controls how many times we should attempt to decode the same frame before failing. "
 
+#define kParamSeekIndex "seekIndex"
+#define kParamSeekIndexLabel "Build Seek Index"
+#define kParamSeekIndexHint "Before decoding the first frame, read the whole file once (without decoding it) to build an index of all key frames, so that any frame can be reached by seeking directly to the key frame before it. " \
+    "This makes random access (scrubbing) much faster on long-GOP files, such as H.264 or HEVC, at the cost of reading the file once."
+
+#define kParamSeekIndexFile "seekIndexFile"
+#define kParamSeekIndexFileLabel "Save Seek Index"
+#define kParamSeekIndexFileHint "Save the seek index to a file next to the video file (with the \"" kFFmpegIndexFileExtension "\" extension), and read it back the next time the same video file is opened, if it was not modified."
+
 #define kSupportsRGBA true
 #define kSupportsRGB true
 #define kSupportsXY false
 #define kSupportsAlpha false
-#define kSupportsTiles false
+#define kSupportsTiles true
+
+/**
+ * @brief Converts a planar YCbCr frame (as given by pixelFormatIsPlanarYUV()) directly to the float RGB(A) output,
+ * without going through swscale and an intermediate packed buffer. Only the render window is converted.
+ * Chroma is upsampled by replication, as done by the unscaled swscale converters.
+ **/
+template<typename SRCPIX, int nDstComp>
+class YUVToRGBProcessor
+    : public PixelProcessor
+{
+    const AVFrame* _avFrame;
+    int _log2ChromaW;
+    int _log2ChromaH;
+    bool _hasAlpha;
+    float _yOffset;   // black level
+    float _yScale;    // 1 / (white - black)
+    float _cOffset;   // zero chroma level
+    float _cScale;    // 1 / chroma excursion
+    float _aScale;    // 1 / max alpha
+    float _crToR;
+    float _cbToG;
+    float _crToG;
+    float _cbToB;
+
+public:
+    // ctor
+    YUVToRGBProcessor(ImageEffect &instance)
+        : PixelProcessor(instance)
+        , _avFrame(NULL)
+        , _log2ChromaW(0)
+        , _log2ChromaH(0)
+        , _hasAlpha(false)
+        , _yOffset(0.f)
+        , _yScale(1.f)
+        , _cOffset(0.f)
+        , _cScale(1.f)
+        , _aScale(1.f)
+        , _crToR(0.f)
+        , _cbToG(0.f)
+        , _crToG(0.f)
+        , _cbToB(0.f)
+    {
+    }
+
+    void setValues(const AVFrame* avFrame,
+                   double kr,
+                   double kb,
+                   bool fullRange)
+    {
+        AVPixelFormat pixelFormat = (AVPixelFormat)avFrame->format;
+        int bitDepth = FFmpeg::pixelFormatBitDepth(pixelFormat);
+
+        _avFrame = avFrame;
+        av_pix_fmt_get_chroma_sub_sample(pixelFormat, &_log2ChromaW, &_log2ChromaH);
+        _hasAlpha = FFmpeg::pixelFormatAlpha(pixelFormat);
+
+        double maxValue = (1 << bitDepth) - 1;
+        if (fullRange) {
+            _yOffset = 0.f;
+            _yScale = (float)(1. / maxValue);
+            _cOffset = (float)(1 << (bitDepth - 1));
+            _cScale = (float)(1. / maxValue);
+        } else {
+            // 16..235 for luma, 16..240 for chroma, scaled to the bit depth
+            double scale = (double)(1 << bitDepth) / 256.;
+            _yOffset = (float)(16. * scale);
+            _yScale = (float)( 1. / (219. * scale) );
+            _cOffset = (float)(128. * scale);
+            _cScale = (float)( 1. / (224. * scale) );
+        }
+        _aScale = (float)(1. / maxValue);
+
+        double kg = 1. - kr - kb;
+        _crToR = (float)( 2. * (1. - kr) );
+        _cbToG = (float)( -2. * kb * (1. - kb) / kg );
+        _crToG = (float)( -2. * kr * (1. - kr) / kg );
+        _cbToB = (float)( 2. * (1. - kb) );
+    }
+
+    // and do some processing
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(nDstComp == 1 || nDstComp == 3 || nDstComp == 4);
+        const int width = _avFrame->width;
+        const int height = _avFrame->height;
+        // pixel (x, y) of the output is at column x and row (height - 1 - y) of the video
+        const int x1 = std::max(procWindow.x1, 0);
+        const int x2 = std::min(procWindow.x2, width);
+
+        if (x2 <= x1) {
+            return;
+        }
+        const int n = x2 - x1;
+        // one row of normalized Y, Cb, Cr and A values, padded for the SIMD loop
+        std::vector<float> rowBuffer( 4 * (n + 4) );
+        float* yRow = &rowBuffer[0];
+        float* cbRow = yRow + (n + 4);
+        float* crRow = cbRow + (n + 4);
+        float* aRow = crRow + (n + 4);
+
+        for (int dsty = procWindow.y1; dsty < procWindow.y2; ++dsty) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            // the video is top-down
+            int srcy = height - 1 - dsty;
+            float* dst_pixels = (float*)( (char*)_dstPixelData + (size_t)_dstRowBytes * (dsty - _dstBounds.y1) ) + (x1 - _dstBounds.x1) * nDstComp;
+            if ( (srcy < 0) || (srcy >= height) ) {
+                std::fill(dst_pixels, dst_pixels + n * nDstComp, 0.f);
+                continue;
+            }
+            const SRCPIX* srcY = (const SRCPIX*)( _avFrame->data[0] + (size_t)_avFrame->linesize[0] * srcy );
+            const SRCPIX* srcCb = (const SRCPIX*)( _avFrame->data[1] + (size_t)_avFrame->linesize[1] * (srcy >> _log2ChromaH) );
+            const SRCPIX* srcCr = (const SRCPIX*)( _avFrame->data[2] + (size_t)_avFrame->linesize[2] * (srcy >> _log2ChromaH) );
+            const SRCPIX* srcA = _hasAlpha ? (const SRCPIX*)( _avFrame->data[3] + (size_t)_avFrame->linesize[3] * srcy ) : NULL;
+            const int srcx1 = x1;
+
+            // unpack and normalize the samples
+            for (int i = 0; i < n; ++i) {
+                int x = srcx1 + i;
+                yRow[i] = (srcY[x] - _yOffset) * _yScale;
+                cbRow[i] = (srcCb[x >> _log2ChromaW] - _cOffset) * _cScale;
+                crRow[i] = (srcCr[x >> _log2ChromaW] - _cOffset) * _cScale;
+            }
+            if (srcA) {
+                for (int i = 0; i < n; ++i) {
+                    aRow[i] = srcA[srcx1 + i] * _aScale;
+                }
+            } else {
+                std::fill(aRow, aRow + n, (nDstComp == 1) ? 0.f : 1.f);
+            }
+
+            if (nDstComp == 1) {
+                std::copy(aRow, aRow + n, dst_pixels);
+                continue;
+            }
+
+            int i = 0;
+#ifdef OFX_FFMPEG_USE_SSE
+            if (nDstComp == 4) {
+                // 4 pixels at a time: compute R, G, B in separate registers, then transpose to RGBA
+                const __m128 zero = _mm_setzero_ps();
+                const __m128 one = _mm_set1_ps(1.f);
+                const __m128 crToR = _mm_set1_ps(_crToR);
+                const __m128 cbToG = _mm_set1_ps(_cbToG);
+                const __m128 crToG = _mm_set1_ps(_crToG);
+                const __m128 cbToB = _mm_set1_ps(_cbToB);
+                for (; i + 4 <= n; i += 4) {
+                    __m128 y = _mm_loadu_ps(yRow + i);
+                    __m128 cb = _mm_loadu_ps(cbRow + i);
+                    __m128 cr = _mm_loadu_ps(crRow + i);
+                    __m128 r = _mm_add_ps( y, _mm_mul_ps(crToR, cr) );
+                    __m128 g = _mm_add_ps( y, _mm_add_ps( _mm_mul_ps(cbToG, cb), _mm_mul_ps(crToG, cr) ) );
+                    __m128 b = _mm_add_ps( y, _mm_mul_ps(cbToB, cb) );
+                    __m128 a = _mm_loadu_ps(aRow + i);
+                    r = _mm_min_ps( _mm_max_ps(r, zero), one );
+                    g = _mm_min_ps( _mm_max_ps(g, zero), one );
+                    b = _mm_min_ps( _mm_max_ps(b, zero), one );
+                    _MM_TRANSPOSE4_PS(r, g, b, a);
+                    _mm_storeu_ps(dst_pixels + 4 * i, r);
+                    _mm_storeu_ps(dst_pixels + 4 * i + 4, g);
+                    _mm_storeu_ps(dst_pixels + 4 * i + 8, b);
+                    _mm_storeu_ps(dst_pixels + 4 * i + 12, a);
+                }
+            }
+#endif
+            for (; i < n; ++i) {
+                float y = yRow[i];
+                float* dst = dst_pixels + i * nDstComp;
+                dst[0] = std::min( std::max(y + _crToR * crRow[i], 0.f), 1.f );
+                dst[1] = std::min( std::max(y + _cbToG * cbRow[i] + _crToG * crRow[i], 0.f), 1.f );
+                dst[2] = std::min( std::max(y + _cbToB * cbRow[i], 0.f), 1.f );
+                if (nDstComp == 4) {
+                    dst[3] = aRow[i];
+                }
+            }
+        }
+    } // multiThreadProcessImages
+};
+
+template<typename SRCPIX>
+void
+convertYUVForDstNComps(ImageEffect* effect,
+                       const AVFrame* avFrame,
+                       double kr,
+                       double kb,
+                       bool fullRange,
+                       const OfxRectI& renderWindow,
+                       float *dstPixelData,
+                       const OfxRectI& dstBounds,
+                       PixelComponentEnum dstPixelComponents,
+                       int dstRowBytes)
+{
+    switch (dstPixelComponents) {
+    case ePixelComponentAlpha: {
+        YUVToRGBProcessor<SRCPIX, 1> p(*effect);
+        p.setValues(avFrame, kr, kb, fullRange);
+        p.setDstImg(dstPixelData, dstBounds, dstPixelComponents, 1, eBitDepthFloat, dstRowBytes);
+        p.setRenderWindow(renderWindow);
+        p.process();
+        break;
+    }
+    case ePixelComponentRGB: {
+        YUVToRGBProcessor<SRCPIX, 3> p(*effect);
+        p.setValues(avFrame, kr, kb, fullRange);
+        p.setDstImg(dstPixelData, dstBounds, dstPixelComponents, 3, eBitDepthFloat, dstRowBytes);
+        p.setRenderWindow(renderWindow);
+        p.process();
+        break;
+    }
+    case ePixelComponentRGBA: {
+        YUVToRGBProcessor<SRCPIX, 4> p(*effect);
+        p.setValues(avFrame, kr, kb, fullRange);
+        p.setDstImg(dstPixelData, dstBounds, dstPixelComponents, 4, eBitDepthFloat, dstRowBytes);
+        p.setRenderWindow(renderWindow);
+        p.process();
+        break;
+    }
+    default:
+        assert(false);
+        break;
+    }
+}
 
 
 class ReadFFmpegPlugin
@@ -82,6 +322,8 @@ class ReadFFmpegPlugin
 {
     FFmpegFileManager& _manager;
     IntParam *_maxRetries;
+    BooleanParam *_seekIndex;
+    BooleanParam *_seekIndexFile;
 
 public:
 
@@ -138,9 +380,13 @@ ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
     , _manager(manager)
     , _maxRetries(0)
+    , _seekIndex(0)
+    , _seekIndexFile(0)
 {
     _maxRetries = fetchIntParam(kParamMaxRetries);
-    assert(_maxRetries);
+    _seekIndex = fetchBooleanParam(kParamSeekIndex);
+    _seekIndexFile = fetchBooleanParam(kParamSeekIndexFile);
+    assert(_maxRetries && _seekIndex && _seekIndexFile);
     int originalFrameRangeMin, originalFrameRangeMax;
     _originalFrameRange->getValue(originalFrameRangeMin, originalFrameRangeMax);
     if (originalFrameRangeMin == 0) {
@@ -154,6 +400,8 @@ ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
 
 ReadFFmpegPlugin::~ReadFFmpegPlugin()
 {
+    // release the files used by this instance, they may be reused by other instances
+    _manager.clear(this);
 }
 
 /**
@@ -275,7 +523,7 @@ void
 ReadFFmpegPlugin::decode(const string& filename,
                          OfxTime time,
                          int /*view*/,
-                         bool /*isPlayback*/,
+                         bool isPlayback,
                          const OfxRectI& renderWindow,
                          float *pixelData,
                          const OfxRectI& imgBounds,
@@ -283,7 +531,7 @@ ReadFFmpegPlugin::decode(const string& filename,
                          int pixelComponentCount,
                          int rowBytes)
 {
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFile* file = _manager.getOrCreate(this, filename, (int)time);
 
     if ( file && file->isInvalid() ) {
         setPersistentMessage( Message::eMessageError, "", file->getError() );
@@ -314,14 +562,11 @@ ReadFFmpegPlugin::decode(const string& filename,
     double ap;
     file->getInfo(width, height, ap, frames);
 
-    // wrong assert:
-    // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#kOfxImageEffectPropSupportsTiles
-    //  "If a clip or plugin does not support tiled images, then the host should supply full RoD images to the effect whenever it fetches one."
-    //  The renderWindow itself may or may not be the full image...
-    //assert(kSupportsTiles || (renderWindow.x1 == 0 && renderWindow.x2 == width && renderWindow.y1 == 0 && renderWindow.y2 == height));
-
-    if ( ( (imgBounds.x2 - imgBounds.x1) < width ) ||
-         ( (imgBounds.y2 - imgBounds.y1) < height ) ) {
+    // Tiles are supported: the image may only cover part of the frame, but it must contain the render window.
+    // Only the render window is converted, and the decoded frame is kept in the frame cache, so that
+    // rendering the other tiles of the same frame does not decode it again.
+    if ( (renderWindow.x1 < imgBounds.x1) || (renderWindow.x2 > imgBounds.x2) ||
+         (renderWindow.y1 < imgBounds.y1) || (renderWindow.y2 > imgBounds.y2) ) {
         setPersistentMessage(Message::eMessageError, "", "The host provided an image of wrong size, can't decode.");
         throwSuiteStatusException(kOfxStatFailed);
 
@@ -331,28 +576,14 @@ ReadFFmpegPlugin::decode(const string& filename,
     int maxRetries;
     _maxRetries->getValue(maxRetries);
 
-    // not in FFmpeg Reader: initialize the output buffer
-    // TODO: use avpicture_get_size? see WriteFFmpeg
-    unsigned int numComponents = file->getNumberOfComponents();
-    assert(numComponents == 3 || numComponents == 4);
-
-    std::size_t sizeOfData = file->getSizeOfData();
-    assert( sizeOfData == sizeof(unsigned char) || sizeOfData == sizeof(unsigned short) );
-
-    int srcRowBytes = width * numComponents * sizeOfData;
-    std::size_t bufferSize =  height * srcRowBytes;
-
-    RamBuffer bufferRaii(bufferSize);
-    unsigned char* buffer = bufferRaii.getData();
-    if (!buffer) {
-        throwSuiteStatusException(kOfxStatErrMemory);
-
-        return;
+    if ( _seekIndex->getValue() ) {
+        file->buildSeekIndex( _seekIndexFile->getValue() );
     }
-    // this is the first stream (in fact the only one we consider for now), allocate the output buffer according to the bitdepth
 
+    AVFrame* avFrame = NULL;
     try {
-        if ( !file->decode(this, (int)time, loadNearestFrame(), maxRetries, buffer) ) {
+        avFrame = file->decode(this, (int)time, loadNearestFrame(), maxRetries, isPlayback);
+        if (!avFrame) {
             if ( abort() ) {
                 // decode() probably existed because plugin was aborted
                 return;
@@ -375,8 +606,68 @@ ReadFFmpegPlugin::decode(const string& filename,
         return;
     }
 
+    // planar YCbCr is converted directly to the float output, without an intermediate buffer
+    double kr, kb;
+    bool fullRange;
+    if ( FFmpeg::pixelFormatIsPlanarYUV( (AVPixelFormat)avFrame->format ) && file->getColorMatrix(avFrame, &kr, &kb, &fullRange) ) {
+        if (FFmpeg::pixelFormatBitDepth( (AVPixelFormat)avFrame->format ) <= 8) {
+            convertYUVForDstNComps<unsigned char>(this, avFrame, kr, kb, fullRange, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+        } else {
+            convertYUVForDstNComps<unsigned short>(this, avFrame, kr, kb, fullRange, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+        }
+        av_frame_free(&avFrame);
+
+        return;
+    }
+
+    // not in FFmpeg Reader: initialize the output buffer
+    // TODO: use avpicture_get_size? see WriteFFmpeg
+    unsigned int numComponents = file->getNumberOfComponents();
+    assert(numComponents == 3 || numComponents == 4);
+
+    std::size_t sizeOfData = file->getSizeOfData();
+    assert( sizeOfData == sizeof(unsigned char) || sizeOfData == sizeof(unsigned short) );
+
+    // convert only the rows of the video covering the render window (numbered from the top)
+    int rowAlignment = file->getRowAlignment(avFrame);
+    int y1 = std::max(height - renderWindow.y2, 0);
+    int y2 = std::min(height - renderWindow.y1, height);
+    if (y2 <= y1) {
+        av_frame_free(&avFrame);
+        fillWithBlack(renderWindow, pixelData, imgBounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
 
-    convertDepthAndComponents(buffer, renderWindow, imgBounds, numComponents == 3 ? ePixelComponentRGB : ePixelComponentRGBA, sizeOfData == sizeof(unsigned char) ? eBitDepthUByte : eBitDepthUShort, srcRowBytes, pixelData, imgBounds, pixelComponents, rowBytes);
+        return;
+    }
+    y1 = (y1 / rowAlignment) * rowAlignment;
+    y2 = std::min( ( (y2 + rowAlignment - 1) / rowAlignment ) * rowAlignment, height );
+
+    int srcRowBytes = width * numComponents * sizeOfData;
+    std::size_t bufferSize =  (y2 - y1) * srcRowBytes;
+
+    RamBuffer bufferRaii(bufferSize);
+    unsigned char* buffer = bufferRaii.getData();
+    bool converted = buffer && file->convert(avFrame, y1, y2, buffer);
+    av_frame_free(&avFrame);
+    if (!buffer) {
+        throwSuiteStatusException(kOfxStatErrMemory);
+
+        return;
+    }
+    if (!converted) {
+        setPersistentMessage( Message::eMessageError, "", file->getError() );
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    // convertDepthAndComponents() reads the output row y from the buffer row (imgBounds.y2 - 1 - y - srcBounds.y1),
+    // which must be the video row (height - 1 - y) - y1
+    OfxRectI srcBounds;
+    srcBounds.x1 = 0;
+    srcBounds.x2 = width;
+    srcBounds.y1 = imgBounds.y2 - height + y1;
+    srcBounds.y2 = srcBounds.y1 + (y2 - y1);
+    convertDepthAndComponents(buffer, renderWindow, srcBounds, numComponents == 3 ? ePixelComponentRGB : ePixelComponentRGBA, sizeOfData == sizeof(unsigned char) ? eBitDepthUByte : eBitDepthUShort, srcRowBytes, pixelData, imgBounds, pixelComponents, rowBytes);
 } // ReadFFmpegPlugin::decode
 
 bool
@@ -967,6 +1258,22 @@ ReadFFmpegPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         param->setDefault(10);
         param->setRange(0, 100);
         param->setDisplayRange(0, 20);
+        page->addChild(*param);
+    }
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamSeekIndex);
+        param->setLabel(kParamSeekIndexLabel);
+        param->setHint(kParamSeekIndexHint);
+        param->setAnimates(false);
+        param->setDefault(false);
+        page->addChild(*param);
+    }
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamSeekIndexFile);
+        param->setLabel(kParamSeekIndexFileLabel);
+        param->setHint(kParamSeekIndexFileHint);
+        param->setAnimates(false);
+        param->setDefault(false);
         param->setLayoutHint(eLayoutHintDivider);
         page->addChild(*param);
     }
@@ -0,0 +1,405 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Slice-threaded swscale conversion, shared by ReadFFmpeg and WriteFFmpeg.
+ */
+
+#if (defined(_STDINT_H) || defined(_STDINT_H_) || defined(_MSC_STDINT_H_ ) ) && !defined(UINT64_C)
+#warning "__STDC_CONSTANT_MACROS has to be defined before including <stdint.h>, this file will probably not compile."
+#endif
+#ifndef __STDC_CONSTANT_MACROS
+#define __STDC_CONSTANT_MACROS // ...or stdint.h wont' define UINT64_C, needed by libavutil
+#endif
+
+#include "SliceConverter.h"
+
+#include <algorithm>
+#include <vector>
+#include <cassert>
+
+extern "C" {
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+}
+
+#include "ofxsMacros.h"
+#include "PixelFormat.h"
+
+#define OFX_FFMPEG_SLICE_MIN_ROWS 32 // minimum number of rows in a band
+#define OFX_FFMPEG_SLICE_MAX_CONTEXTS 64 // maximum number of unused conversion contexts kept in the pool
+
+namespace OFX {
+namespace FFmpeg {
+
+/**
+ * @brief Converts the bands of an image in parallel, using the host multi-thread suite.
+ **/
+class SliceProcessor
+    : public OFX::MultiThread::Processor
+{
+    SliceConverter& _converter;
+    AVPixelFormat _srcPixelFormat;
+    const unsigned char* const* _srcData;
+    const int* _srcLinesize;
+    int _srcHeight;
+    AVPixelFormat _dstPixelFormat;
+    int _dstWidth;
+    unsigned char* const* _dstData;
+    const int* _dstLinesize;
+    int _y1;
+    int _y2;
+    int _bandRows;
+    int _overlapRows;
+    int _nBands;
+    std::vector<char> _bandOk;
+
+public:
+    SliceProcessor(SliceConverter& converter,
+                   AVPixelFormat srcPixelFormat,
+                   const unsigned char* const srcData[4],
+                   const int srcLinesize[4],
+                   int srcHeight,
+                   int y1,
+                   int y2,
+                   AVPixelFormat dstPixelFormat,
+                   int dstWidth,
+                   unsigned char* const dstData[4],
+                   const int dstLinesize[4],
+                   int bandRows,
+                   int overlapRows)
+        : _converter(converter)
+        , _srcPixelFormat(srcPixelFormat)
+        , _srcData(srcData)
+        , _srcLinesize(srcLinesize)
+        , _srcHeight(srcHeight)
+        , _dstPixelFormat(dstPixelFormat)
+        , _dstWidth(dstWidth)
+        , _dstData(dstData)
+        , _dstLinesize(dstLinesize)
+        , _y1(y1)
+        , _y2(y2)
+        , _bandRows(bandRows)
+        , _overlapRows(overlapRows)
+        , _nBands( (y2 - y1 + bandRows - 1) / bandRows )
+        , _bandOk(_nBands, 0)
+    {
+    }
+
+    int getNBands() const
+    {
+        return _nBands;
+    }
+
+    bool isOk() const
+    {
+        return std::find(_bandOk.begin(), _bandOk.end(), 0) == _bandOk.end();
+    }
+
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        for (int band = (int)threadIndex; band < _nBands; band += (int)threadMax) {
+            int y1 = _y1 + band * _bandRows;
+            int y2 = std::min(y1 + _bandRows, _y2);
+            _bandOk[band] = convertBand(y1, y2);
+        }
+    }
+
+private:
+    // Convert the rows [y1, y2) of the source image, with _overlapRows rows of context above and below
+    // (within the image) which are converted into a temporary image and dropped
+    bool convertBand(int y1,
+                     int y2)
+    {
+        int c1 = std::max(y1 - _overlapRows, 0);
+        int c2 = std::min(y2 + _overlapRows, _srcHeight);
+        const unsigned char* srcRows[4];
+        unsigned char* dstRows[4];
+
+        pixelFormatSliceRows(_srcPixelFormat, _srcData, _srcLinesize, c1, srcRows);
+        pixelFormatSliceRows(_dstPixelFormat, _dstData, _dstLinesize, y1 - _y1, dstRows);
+        if ( (c1 == y1) && (c2 == y2) ) {
+            return _converter.convertSlice(srcRows, _srcLinesize, y1, y2, dstRows, _dstLinesize);
+        }
+
+        uint8_t* tmpData[4];
+        int tmpLinesize[4];
+        if (av_image_alloc(tmpData, tmpLinesize, _dstWidth, c2 - c1, _dstPixelFormat, 16) < 0) {
+            return false;
+        }
+        bool ok = _converter.convertSlice(srcRows, _srcLinesize, c1, c2, tmpData, tmpLinesize);
+        if (ok) {
+            // copy the rows of the band
+            const unsigned char* tmpRows[4];
+            pixelFormatSliceRows(_dstPixelFormat, tmpData, tmpLinesize, y1 - c1, tmpRows);
+            uint8_t* dstPlanes[4];
+            int dstLinesize[4];
+            for (int p = 0; p < 4; ++p) {
+                dstPlanes[p] = dstRows[p];
+                dstLinesize[p] = _dstLinesize[p];
+            }
+            av_image_copy(dstPlanes, dstLinesize, tmpRows, tmpLinesize, _dstPixelFormat, _dstWidth, y2 - y1);
+        }
+        av_freep(&tmpData[0]);
+
+        return ok;
+    }
+};
+
+SliceConverter::SliceConverter()
+    : _lock()
+    , _srcWidth(0)
+    , _srcHeight(0)
+    , _srcPixelFormat(AV_PIX_FMT_NONE)
+    , _dstWidth(0)
+    , _dstHeight(0)
+    , _dstPixelFormat(AV_PIX_FMT_NONE)
+    , _invTable(NULL)
+    , _srcRange(0)
+    , _table(NULL)
+    , _dstRange(0)
+    , _rowAlignment(1)
+    , _overlapRows(0)
+    , _generation(0)
+    , _contexts()
+    , _contextCount(0)
+{
+}
+
+SliceConverter::~SliceConverter()
+{
+    clearContexts();
+}
+
+void
+SliceConverter::clearContexts()
+{
+    ///Private should not lock
+
+    for (ContextPool::iterator it = _contexts.begin(); it != _contexts.end(); ++it) {
+        for (std::size_t i = 0; i < it->second.size(); ++i) {
+            sws_freeContext(it->second[i]);
+        }
+    }
+    _contexts.clear();
+    _contextCount = 0;
+}
+
+void
+SliceConverter::setConversion(int srcWidth,
+                              int srcHeight,
+                              AVPixelFormat srcPixelFormat,
+                              int dstWidth,
+                              int dstHeight,
+                              AVPixelFormat dstPixelFormat,
+                              const int* invTable,
+                              int srcRange,
+                              const int* table,
+                              int dstRange)
+{
+    AutoMutex guard(_lock);
+
+    if ( (_srcWidth == srcWidth) && (_srcHeight == srcHeight) && (_srcPixelFormat == srcPixelFormat) &&
+         ( _dstWidth == dstWidth) && ( _dstHeight == dstHeight) && ( _dstPixelFormat == dstPixelFormat) &&
+         ( _invTable == invTable) && ( _srcRange == srcRange) && ( _table == table) && ( _dstRange == dstRange) ) {
+        return;
+    }
+    _srcWidth = srcWidth;
+    _srcHeight = srcHeight;
+    _srcPixelFormat = srcPixelFormat;
+    _dstWidth = dstWidth;
+    _dstHeight = dstHeight;
+    _dstPixelFormat = dstPixelFormat;
+    _invTable = invTable;
+    _srcRange = srcRange;
+    _table = table;
+    _dstRange = dstRange;
+    ++_generation;
+    clearContexts();
+
+    // images can only be split if the conversion does not scale, and if both pixel formats allow it
+    if ( (srcWidth != dstWidth) || (srcHeight != dstHeight) ) {
+        _rowAlignment = std::max(srcHeight, 1);
+        _overlapRows = 0;
+    } else {
+        _rowAlignment = pixelFormatsSliceAlignment(srcPixelFormat, dstPixelFormat, srcHeight);
+        _overlapRows = pixelFormatsSliceOverlap(srcPixelFormat, dstPixelFormat);
+    }
+}
+
+int
+SliceConverter::getRowAlignment() const
+{
+    AutoMutex guard(_lock);
+
+    return _rowAlignment;
+}
+
+SwsContext*
+SliceConverter::acquireContext(int height,
+                               int* generation)
+{
+    int srcWidth, dstWidth, dstHeight, srcRange, dstRange;
+    AVPixelFormat srcPixelFormat, dstPixelFormat;
+    const int* invTable;
+    const int* table;
+    {
+        AutoMutex guard(_lock);
+        *generation = _generation;
+        ContextPool::iterator found = _contexts.find(height);
+        if ( ( found != _contexts.end() ) && !found->second.empty() ) {
+            SwsContext* context = found->second.back();
+            found->second.pop_back();
+            --_contextCount;
+
+            return context;
+        }
+        srcWidth = _srcWidth;
+        srcPixelFormat = _srcPixelFormat;
+        dstWidth = _dstWidth;
+        // only the whole image may be scaled vertically
+        dstHeight = (height == _srcHeight) ? _dstHeight : height;
+        dstPixelFormat = _dstPixelFormat;
+        invTable = _invTable;
+        srcRange = _srcRange;
+        table = _table;
+        dstRange = _dstRange;
+    }
+
+    // creating a context takes time: do it without holding the lock
+    SwsContext* context = sws_getContext(srcWidth, height, srcPixelFormat, // src format
+                                         dstWidth, dstHeight, dstPixelFormat, // dest format
+                                         SWS_BICUBIC, NULL, NULL, NULL);
+    if (context && invTable) {
+        int result = sws_setColorspaceDetails(context,
+                                              invTable, // inv_table
+                                              srcRange, // srcRange -flag indicating the white-black range of the input (1=jpeg / 0=mpeg) 0 = 16..235, 1 = 0..255
+                                              table, // table
+                                              dstRange, // dstRange - 0 = 16..235, 1 = 0..255
+                                              0, // brightness fixed point, with 0 meaning no change,
+                                              1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
+                                              1 << 16); // saturation fixed point, with 1<<16 meaning no change);
+        assert(result != -1);
+        (void)result;
+    }
+
+    return context;
+}
+
+void
+SliceConverter::releaseContext(int height,
+                               int generation,
+                               SwsContext* context)
+{
+    {
+        AutoMutex guard(_lock);
+        if ( (generation == _generation) && (_contextCount < OFX_FFMPEG_SLICE_MAX_CONTEXTS) ) {
+            _contexts[height].push_back(context);
+            ++_contextCount;
+
+            return;
+        }
+    }
+    // the conversion changed, or the pool is full
+    sws_freeContext(context);
+}
+
+bool
+SliceConverter::convertSlice(const unsigned char* const srcData[4],
+                             const int srcLinesize[4],
+                             int y1,
+                             int y2,
+                             unsigned char* const dstData[4],
+                             const int dstLinesize[4])
+{
+    int generation;
+    SwsContext* context = acquireContext(y2 - y1, &generation);
+
+    if (!context) {
+        return false;
+    }
+    sws_scale(context,
+              srcData,
+              srcLinesize,
+              0,
+              y2 - y1,
+              dstData,
+              dstLinesize);
+    releaseContext(y2 - y1, generation, context);
+
+    return true;
+}
+
+bool
+SliceConverter::convert(const unsigned char* const srcData[4],
+                        const int srcLinesize[4],
+                        unsigned char* const dstData[4],
+                        const int dstLinesize[4])
+{
+    int height;
+    {
+        AutoMutex guard(_lock);
+        height = _srcHeight;
+    }
+
+    return convert(srcData, srcLinesize, 0, height, dstData, dstLinesize);
+}
+
+bool
+SliceConverter::convert(const unsigned char* const srcData[4],
+                        const int srcLinesize[4],
+                        int y1,
+                        int y2,
+                        unsigned char* const dstData[4],
+                        const int dstLinesize[4])
+{
+    int rowAlignment, overlapRows, srcHeight, dstWidth;
+    AVPixelFormat srcPixelFormat, dstPixelFormat;
+    {
+        AutoMutex guard(_lock);
+        rowAlignment = _rowAlignment;
+        overlapRows = _overlapRows;
+        srcHeight = _srcHeight;
+        dstWidth = _dstWidth;
+        srcPixelFormat = _srcPixelFormat;
+        dstPixelFormat = _dstPixelFormat;
+        assert(0 <= y1 && y1 < y2 && y2 <= _srcHeight);
+        assert( (y1 % rowAlignment == 0) && (y2 == _srcHeight || y2 % rowAlignment == 0) );
+    }
+
+    // split in bands of at least OFX_FFMPEG_SLICE_MIN_ROWS rows, one band per CPU
+    int rows = y2 - y1;
+    int nBands = std::min( (int)OFX::MultiThread::getNumCPUs(), rows / std::max(rowAlignment, OFX_FFMPEG_SLICE_MIN_ROWS) );
+    int bandRows = (nBands <= 1) ? rows : (rows + nBands - 1) / nBands;
+    bandRows = ( (bandRows + rowAlignment - 1) / rowAlignment ) * rowAlignment;
+
+    // a single band still needs the overlapping rows if only part of the image is converted
+    SliceProcessor processor(*this, srcPixelFormat, srcData, srcLinesize, srcHeight, y1, y2,
+                             dstPixelFormat, dstWidth, dstData, dstLinesize, bandRows, overlapRows);
+    if (processor.getNBands() <= 1) {
+        processor.multiThreadFunction(0, 1);
+    } else {
+        processor.multiThread( processor.getNBands() );
+    }
+
+    return processor.isOk();
+}
+} // namespace FFmpeg
+} // namespace OFX
@@ -0,0 +1,127 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Slice-threaded swscale conversion, shared by ReadFFmpeg and WriteFFmpeg.
+ */
+
+#ifndef SliceConverter_h
+#define SliceConverter_h
+
+#include <map>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+#include "ofxsMultiThread.h"
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+struct SwsContext;
+
+namespace OFX {
+namespace FFmpeg {
+
+/**
+ * @brief Converts images with swscale, splitting them into horizontal bands which are converted in
+ * parallel using the host multi-thread suite, each band with its own SwsContext.
+ *
+ * Images are only split if the conversion does not scale, and if both pixel formats can be
+ * converted by slices (see pixelFormatsSliceAlignment()). Otherwise the whole image is converted
+ * by a single context. For vertically subsampled formats (e.g. YUV 4:2:0), each band is converted
+ * with a few rows of context above and below, which are dropped, so that the chroma is filtered as
+ * in the whole image. Conversion contexts are kept in a pool, so that convert() can be called
+ * concurrently from several render threads.
+ **/
+class SliceConverter
+{
+public:
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+    typedef OFX::MultiThread::Mutex Mutex;
+    typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+    typedef tthread::fast_mutex Mutex;
+    typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+    SliceConverter();
+
+    ~SliceConverter();
+
+    // Set up the conversion. If |invTable| is not NULL, |invTable|, |srcRange|, |table| and |dstRange| are passed
+    // to sws_setColorspaceDetails(). Conversion contexts are only recreated if the conversion changed. Thread safe
+    void setConversion(int srcWidth, int srcHeight, AVPixelFormat srcPixelFormat,
+                       int dstWidth, int dstHeight, AVPixelFormat dstPixelFormat,
+                       const int* invTable, int srcRange, const int* table, int dstRange);
+
+    // Convert the whole image. Returns false if the conversion could not be set up. Thread safe
+    bool convert(const unsigned char* const srcData[4], const int srcLinesize[4],
+                 unsigned char* const dstData[4], const int dstLinesize[4]);
+
+    // Convert the rows [y1, y2) of the source image (numbered from the top) to the first y2 - y1 rows
+    // of the destination image. y1 and y2 must be multiples of getRowAlignment(), or 0 and the image height.
+    // Only possible if the conversion does not scale. Returns false if the conversion could not be set up. Thread safe
+    bool convert(const unsigned char* const srcData[4], const int srcLinesize[4], int y1, int y2,
+                 unsigned char* const dstData[4], const int dstLinesize[4]);
+
+    // The row alignment for converting only part of the image, or the image height if this is not possible. Thread safe
+    int getRowAlignment() const;
+
+private:
+    friend class SliceProcessor;
+
+    // Convert one band, with its own context
+    bool convertSlice(const unsigned char* const srcData[4], const int srcLinesize[4], int y1, int y2,
+                      unsigned char* const dstData[4], const int dstLinesize[4]);
+
+    // get a conversion context for |height| rows, from the pool or newly created
+    SwsContext* acquireContext(int height, int* generation);
+
+    // give a context back to the pool
+    void releaseContext(int height, int generation, SwsContext* context);
+
+    ///Private should not lock
+    void clearContexts();
+
+    mutable Mutex _lock;
+    int _srcWidth;
+    int _srcHeight;
+    AVPixelFormat _srcPixelFormat;
+    int _dstWidth;
+    int _dstHeight;
+    AVPixelFormat _dstPixelFormat;
+    const int* _invTable;
+    int _srcRange;
+    const int* _table;
+    int _dstRange;
+    int _rowAlignment;     // see getRowAlignment()
+    int _overlapRows;      // rows converted above and below each band and dropped, see pixelFormatsSliceOverlap()
+    int _generation;       // incremented each time the conversion changes, contexts from an older generation are freed
+    typedef std::map<int, std::vector<SwsContext*> > ContextPool;
+    ContextPool _contexts; // unused contexts, by number of rows
+    int _contextCount;     // number of contexts in _contexts
+};
+} // namespace FFmpeg
+} // namespace OFX
+
+#endif // SliceConverter_h
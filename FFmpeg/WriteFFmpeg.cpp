@@ -42,6 +42,7 @@
 #include <sstream>
 #include <algorithm>
 #include <string>
+#include <map>
 #include <cctype> // ::tolower
 #ifdef DEBUG
 #include <cstdio>
@@ -85,6 +86,7 @@ extern "C" {
 #include "GenericWriter.h"
 #include "FFmpegFile.h"
 #include "PixelFormat.h"
+#include "SliceConverter.h"
 
 #define OFX_FFMPEG_PRINT_CODECS 0 // print list of supported/ignored codecs and formats
 #define OFX_FFMPEG_TIMECODE 0     // timecode support
@@ -93,12 +95,14 @@ extern "C" {
 #define OFX_FFMPEG_PRORES 1       // experimental apple prores support
 #define OFX_FFMPEG_PRORES4444 1   // experimental apple prores 4444 support
 #define OFX_FFMPEG_DNXHD 1        // experimental DNxHD support (disactivated, because of unsolved color shifting issues)
+#define OFX_FFMPEG_MAX_PENDING_BYTES (1024 * 1024 * 1024) // maximum memory used by the pool of frames waiting to be encoded
 
 #if OFX_FFMPEG_PRINT_CODECS
 #include <iostream>
 #endif
 
 #include "ofxsMultiThread.h"
+#include "tinythread.h" // for tthread::condition_variable
 #ifdef OFX_USE_MULTITHREAD_MUTEX
 namespace {
 typedef OFX::MultiThread::Mutex Mutex;
@@ -113,6 +117,11 @@ typedef tthread::fast_mutex Mutex;
 typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
 }
 #endif
+// tthread::condition_variable can only wait on a tthread::mutex
+namespace {
+typedef tthread::mutex CondMutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::mutex> CondAutoMutex;
+}
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -1269,8 +1278,21 @@ private:
     AVStream* addStream(AVFormatContext* avFormatContext, enum AVCodecID avCodecId, AVCodec** pavCodec);
     int openCodec(AVFormatContext* avFormatContext, AVCodec* avCodec, AVStream* avStream);
     int writeAudio(AVFormatContext* avFormatContext, AVStream* avStream, bool flush);
-    int writeVideo(AVFormatContext* avFormatContext, AVStream* avStream, bool flush, double time, const float *pixelData = NULL, const OfxRectI* bounds = NULL, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
-    int writeToFile(AVFormatContext* avFormatContext, bool finalise, double time, const float *pixelData = NULL, const OfxRectI* bounds = NULL, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
+    int fillPicture(AVCodecContext* avCodecContext, const float *pixelData, const OfxRectI& bounds, int pixelDataNComps, int rowBytes, MyAVPicture* avPicture, AVPixelFormat* outPixelFormat);
+    int convertFrame(AVCodecContext* avCodecContext, const float *pixelData, const OfxRectI& bounds, int pixelDataNComps, int rowBytes, MyAVFrame* avFrame);
+    int writeVideo(AVFormatContext* avFormatContext, AVStream* avStream, bool flush, double time, AVFrame* avFrame = NULL);
+    int writeToFile(AVFormatContext* avFormatContext, bool finalise, double time, AVFrame* avFrame = NULL);
+    void reportEncodeError(const string& message);
+
+    // frame pool and encoder thread
+    void startEncoderThread();
+    void stopEncoderThread();
+    static void encoderThreadFunction(void* arg);
+    void encoderThreadLoop();
+    MyAVFrame* acquireFrame(int time);
+    void releaseFrame(MyAVFrame* avFrame);
+    int firstMissingFrame() const;
+    void clearPendingFrames();
 
     int colourSpaceConvert(MyAVPicture* avPicture, AVFrame* avFrame, AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat, AVCodecContext* avCodecContext);
 
@@ -1291,16 +1313,32 @@ private:
     OfxRectI _rodPixel;
     float _pixelAspectRatio;
     bool _isOpen; // Flag for the configuration state of the FFmpeg components.
-    WriterError _error;
     AVFormatContext*  _formatContext;
     AVStream* _streamVideo;
     AVStream* _streamAudio;
     AVStream* _streamTimecode;
-    Mutex _nextFrameToEncodeMutex;
-    int _nextFrameToEncode; //< the frame index we need to encode next, INT_MIN means uninitialized
+    typedef std::map<int, MyAVFrame*> PendingFramesMap;
+
+    // The render threads convert the images to the codec pixel format into
+    // frames taken from a pool, and queue them in _pendingFrames. The encoder
+    // thread encodes and writes the queued frames in sequential order, and
+    // gives them back to the pool.
+    CondMutex _nextFrameToEncodeMutex; //< protects all the members below, up to _frameStep
+    tthread::condition_variable _nextFrameToEncodeCond; //< signalled when frames were queued or encoded, or when encoding was aborted
+    int _nextFrameToEncode; //< the frame index the encoder thread needs to encode next, INT_MIN means uninitialized or aborted
+    PendingFramesMap _pendingFrames; //< converted frames waiting to be encoded
+    vector<MyAVFrame*> _freeFrames; //< frames from the pool that are not in use
+    int _framePoolSize; //< the maximum number of frames in the pool
+    int _framesAllocated; //< the number of frames currently allocated
+    tthread::thread* _encoderThread;
+    bool _encoderThreadQuit; //< tell the encoder thread to exit once all pending frames are encoded
+    int _encoderError; //< the error returned by writeToFile in the encoder thread, if any
+    string _encoderErrorMessage; //< the error message set by the encoder thread, if any
+    WriterError _error; //< set to SUCCESS by the encoder thread once a frame was written
     int _firstFrameToEncode;
     int _lastFrameToEncode;
     int _frameStep;
+    FFmpeg::SliceConverter _converter; //< converts the images to the codec pixel format, thread safe
     ChoiceParam* _format;
     DoubleParam* _fps;
     ChoiceParam* _prefPixelCoding;
@@ -1567,16 +1605,26 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     , _filename()
     , _pixelAspectRatio(1.)
     , _isOpen(false)
-    , _error(IGNORE_FINISH)
     , _formatContext(0)
     , _streamVideo(0)
     , _streamAudio(0)
     , _streamTimecode(0)
     , _nextFrameToEncodeMutex()
+    , _nextFrameToEncodeCond()
     , _nextFrameToEncode(INT_MIN)
+    , _pendingFrames()
+    , _freeFrames()
+    , _framePoolSize(0)
+    , _framesAllocated(0)
+    , _encoderThread(NULL)
+    , _encoderThreadQuit(false)
+    , _encoderError(0)
+    , _encoderErrorMessage()
+    , _error(IGNORE_FINISH)
     , _firstFrameToEncode(1)
     , _lastFrameToEncode(1)
     , _frameStep(1)
+    , _converter()
     , _format(0)
     , _fps(0)
     , _prefPixelCoding(NULL)
@@ -1647,6 +1695,13 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
 
 WriteFFmpegPlugin::~WriteFFmpegPlugin()
 {
+    {
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        _nextFrameToEncode = INT_MIN;
+        _nextFrameToEncodeCond.notify_all();
+    }
+    stopEncoderThread();
+    clearPendingFrames();
     delete [] _scratchBuffer;
     _scratchBufferSize = 0;
 }
@@ -3405,37 +3460,27 @@ WriteFFmpegPlugin::colourSpaceConvert(MyAVPicture* avPicture,
         dstRange = !(encodeVideoRange);
     }
 
-    SwsContext* convertCtx = sws_getCachedContext(NULL,
-                                                  width, height, srcPixelFormat, // from
-                                                  avCodecContext->width, avCodecContext->height, dstPixelFormat,// to
-                                                  SWS_BICUBIC, NULL, NULL, NULL);
-    if (!convertCtx) {
-        return -1;
-    }
-    // Set up the sws (SoftWareScaler) to convert colourspaces correctly, in the sws_scale function below
+    // Set up the sws (SoftWareScaler) to convert colourspaces correctly
     //const int colorspace = (width < 1000) ? SWS_CS_ITU601 : SWS_CS_ITU709;
     // it's the output size that counts (e.g. for DNxHD), and we prefer using height
     const int colorspace = isRec709Format(avCodecContext->height) ? SWS_CS_ITU709 : SWS_CS_ITU601;
-
     // Only apply colorspace conversions for YUV.
-    if ( FFmpeg::pixelFormatIsYUV(dstPixelFormat) ) {
-        ret = sws_setColorspaceDetails(convertCtx,
-                                       sws_getCoefficients(SWS_CS_DEFAULT), // inv_table
-                                       1, // srcRange - 0 = 16..235, 1 = 0..255
-                                       sws_getCoefficients(colorspace), // table
-                                       dstRange, // dstRange - 0 = 16..235, 1 = 0..255
-                                       0, // brightness fixed point, with 0 meaning no change,
-                                       1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
-                                       1 << 16); // saturation fixed point, with 1<<16 meaning no change);
-    }
-
-    sws_scale(convertCtx,
-              avPicture->data, // src
-              avPicture->linesize, // src rowbytes
-              0,
-              height,
-              avFrame->data, // dst
-              avFrame->linesize); // dst rowbytes
+    bool isYUV = FFmpeg::pixelFormatIsYUV(dstPixelFormat);
+
+    // The conversion contexts are only recreated if the conversion changed, and the image
+    // is converted by bands in parallel if it is not scaled.
+    _converter.setConversion(width, height, srcPixelFormat, // from
+                             avCodecContext->width, avCodecContext->height, dstPixelFormat, // to
+                             isYUV ? sws_getCoefficients(SWS_CS_DEFAULT) : NULL, // inv_table
+                             1, // srcRange - 0 = 16..235, 1 = 0..255
+                             sws_getCoefficients(colorspace), // table
+                             dstRange); // dstRange - 0 = 16..235, 1 = 0..255
+    if ( !_converter.convert(avPicture->data, // src
+                             avPicture->linesize, // src rowbytes
+                             avFrame->data, // dst
+                             avFrame->linesize) ) { // dst rowbytes
+        return -1;
+    }
 
     return ret;
 }
@@ -3457,9 +3502,141 @@ WriteFFmpegPlugin::numberOfDestChannels() const
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// writeVideo
+// fillPicture
+//
+// * Convert Nuke float RGB values to 8-bit or 16-bit packed RGB(A), flipping
+//   the image vertically.
+//
+// This is called from the render threads, before the frame is queued for
+// encoding, so that the host image can be released as soon as possible.
+//
+// @param avPicture The picture to allocate and fill.
+// @param outPixelFormat The pixel format of the filled picture.
+//
+// @return 0 if successful,
+//         <0 otherwise.
+//
+int
+WriteFFmpegPlugin::fillPicture(AVCodecContext* avCodecContext,
+                               const float *pixelData,
+                               const OfxRectI& bounds,
+                               int pixelDataNComps,
+                               int rowBytes,
+                               MyAVPicture* avPicture,
+                               AVPixelFormat* outPixelFormat)
+{
+    assert(avCodecContext && pixelData && avPicture && outPixelFormat);
+    assert(bounds.x1 == _rodPixel.x1 && bounds.x2 == _rodPixel.x2 &&
+           bounds.y1 == _rodPixel.y1 && bounds.y2 == _rodPixel.y2);
+    int width = _rodPixel.x2 - _rodPixel.x1;
+    int height = _rodPixel.y2 - _rodPixel.y1;
+    const bool hasAlpha = alphaEnabled();
+    AVPixelFormat pixelFormatNuke;
+    if (hasAlpha) {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
+    } else {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48LE : AV_PIX_FMT_RGB24;
+    }
+    *outPixelFormat = pixelFormatNuke;
+
+    int ret = avPicture->alloc(width, height, pixelFormatNuke);
+    if (ret) {
+        return ret;
+    }
+    // Convert floating point values to unsigned values.
+    assert(rowBytes);
+    const int numDestChannels = hasAlpha ? 4 : 3;
+
+    for (int y = 0; y < height; ++y) {
+        int srcY = height - 1 - y;
+        const float* src_pixels = (float*)( (char*)pixelData + srcY * rowBytes );
+
+        if (avCodecContext->bits_per_raw_sample > 8) {
+            assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48LE);
+
+            // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
+            unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(avPicture->data[0]) + y * (avPicture->linesize[0] / 2);
+
+            for (int x = 0; x < width; ++x) {
+                int srcCol = x * pixelDataNComps;
+                int dstCol = x * numDestChannels;
+                dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
+                dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
+                dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
+                if (hasAlpha) {
+                    dst_pixels[dstCol + 3] = floatToInt<65536>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
+                }
+            }
+        } else {
+            assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
+
+            unsigned char* dst_pixels = avPicture->data[0] + y * avPicture->linesize[0];
+
+            for (int x = 0; x < width; ++x) {
+                int srcCol = x * pixelDataNComps;
+                int dstCol = x * numDestChannels;
+                dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
+                dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
+                dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
+                if (hasAlpha) {
+                    dst_pixels[dstCol + 3] = floatToInt<256>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
+                }
+            }
+        }
+    }
+
+    return 0;
+} // WriteFFmpegPlugin::fillPicture
+
+////////////////////////////////////////////////////////////////////////////////
+// convertFrame
 //
 // * Convert Nuke float RGB values to the ffmpeg pixel format of the encoder.
+//
+// This is called from the render threads, so that the conversion of several
+// frames is done in parallel, while the encoder thread encodes the previous
+// frames.
+//
+// @param avFrame A frame from the pool, allocated with the codec dimensions
+//                and pixel format.
+//
+// @return 0 if successful,
+//         <0 otherwise.
+//
+int
+WriteFFmpegPlugin::convertFrame(AVCodecContext* avCodecContext,
+                                const float *pixelData,
+                                const OfxRectI& bounds,
+                                int pixelDataNComps,
+                                int rowBytes,
+                                MyAVFrame* avFrame)
+{
+    assert(avCodecContext && avFrame);
+    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
+    MyAVPicture avPicture;
+    AVPixelFormat pixelFormatNuke;
+    int ret = fillPicture(avCodecContext, pixelData, bounds, pixelDataNComps, rowBytes, &avPicture, &pixelFormatNuke);
+    if (ret) {
+        return ret;
+    }
+    // Then convert from either 16-bit or 8-bit RGB to the input pixel format
+    // required by the encoder.
+    ret = colourSpaceConvert(&avPicture, *avFrame, pixelFormatNuke, avCodecContext->pix_fmt, avCodecContext);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // see ffmpeg.c:1199 from ffmpeg 3.2.2
+    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
+    (*avFrame)->quality = avCodecContext->global_quality;
+    (*avFrame)->pict_type = AV_PICTURE_TYPE_NONE;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// writeVideo
+//
 // * Encode.
 // * Write to file.
 //
@@ -3468,23 +3645,19 @@ WriteFFmpegPlugin::numberOfDestChannels() const
 // @param flush A boolean value to flag that any remaining frames in the interal
 //              queue of the encoder should be written to the file. No new
 //              frames will be queued for encoding.
+// @param avFrame The frame to encode, as converted by convertFrame().
 //
 // @return 0 if successful,
-//         <0 otherwise for any failure to convert the pixel format, encode the
-//         video or write to the file.
+//         <0 otherwise for any failure to encode the video or write to the
+//         file.
 //
 int
 WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                               AVStream* avStream,
                               bool flush,
                               double time,
-                              const float *pixelData,
-                              const OfxRectI* bounds,
-                              int pixelDataNComps,
-                              int dstNComps,
-                              int rowBytes)
+                              AVFrame* avFrame)
 {
-    assert(dstNComps == 3 || dstNComps == 4 || dstNComps == 0);
     // FIXME enum needed for error codes.
     if (!_isOpen) {
         return -5; //writer is not open!
@@ -3493,110 +3666,17 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
         return -6;
     }
     assert(avFormatContext);
-    if ( !avFormatContext || ( !flush && (!pixelData || !bounds) ) ) {
+    if ( !avFormatContext || ( !flush && !avFrame ) ) {
         return -7;
     }
     int ret = 0;
-    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
-    // Create a buffer to hold either  16-bit or 8-bit RGB.
     AVCodecContext* avCodecContext = avStream->codec;
     assert(avCodecContext);
     if (!avCodecContext) {
         return -8;
     }
-    // Create another buffer to convert from either 16-bit or 8-bit RGB
-    // to the input pixel format required by the encoder.
-    AVPixelFormat pixelFormatCodec = avCodecContext->pix_fmt;
-    int width = _rodPixel.x2 - _rodPixel.x1;
-    int height = _rodPixel.y2 - _rodPixel.y1;
-    MyAVPicture avPicture;
-    AVFrame* avFrame = NULL;
-
-    if (!flush) {
-        assert(pixelData && bounds);
-        assert(bounds->x1 == _rodPixel.x1 && bounds->x2 == _rodPixel.x2 &&
-               bounds->y1 == _rodPixel.y1 && bounds->y2 == _rodPixel.y2);
-
-        const bool hasAlpha = alphaEnabled();
-        AVPixelFormat pixelFormatNuke;
-        if (hasAlpha) {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
-        } else {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48LE : AV_PIX_FMT_RGB24;
-        }
-
-        ret = avPicture.alloc(width, height, pixelFormatNuke);
-        if (!ret) {
-            // Convert floating point values to unsigned values.
-            assert(rowBytes);
-            const int numDestChannels = hasAlpha ? 4 : 3;
-
-            for (int y = 0; y < height; ++y) {
-                int srcY = height - 1 - y;
-                const float* src_pixels = (float*)( (char*)pixelData + srcY * rowBytes );
-
-                if (avCodecContext->bits_per_raw_sample > 8) {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48LE);
-
-                    // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
-                    unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(avPicture.data[0]) + y * (avPicture.linesize[0] / 2);
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<65536>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
-                        }
-                    }
-                } else {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
-
-                    unsigned char* dst_pixels = avPicture.data[0] + y * avPicture.linesize[0];
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<256>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
-                        }
-                    }
-                }
-            }
-
-            avFrame = av_frame_alloc(); // Create an AVFrame structure and initialise to zero.
-            assert(avFrame);
-            if (!avFrame) {
-                ret = -1;
-            } else {
-                // For any codec an
-                // intermediate buffer is allocated for the
-                // colour space conversion.
-                int bufferSize = av_image_alloc(avFrame->data, avFrame->linesize, avCodecContext->width, avCodecContext->height, pixelFormatCodec, 1);
-                if (bufferSize > 0) {
-                    // Set the frame fields for a video buffer as some
-                    // encoders rely on them, e.g. Lossless JPEG.
-                    avFrame->width = avCodecContext->width;
-                    avFrame->height = avCodecContext->height;
-                    avFrame->format = pixelFormatCodec;
-
-                    colourSpaceConvert(&avPicture, avFrame, pixelFormatNuke, pixelFormatCodec, avCodecContext);
-
-                    // see ffmpeg.c:1199 from ffmpeg 3.2.2
-                    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
-                    avFrame->quality = avCodecContext->global_quality;
-                    avFrame->pict_type = AV_PICTURE_TYPE_NONE;
-                } else {
-                    // av_image_alloc failed.
-                    ret = -1;
-                }
-            }
-        }
+    if (flush) {
+        avFrame = NULL;
     }
 
     if (!ret) {
@@ -3655,7 +3735,7 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                 // Report the error.
                 char szError[1024] = { 0 };
                 av_strerror( encodeResult, szError, sizeof(szError) );
-                setPersistentMessage(Message::eMessageError, "", string("Cannot encode frame: ") + szError);
+                reportEncodeError(string("Cannot encode frame: ") + szError);
                 error = true;
             } else {
                 if (flush && !got_packet) {
@@ -3680,7 +3760,7 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                         // Report the error.
                         char szError[1024] = { 0 };
                         av_strerror( writeResult, szError, sizeof(szError) );
-                        setPersistentMessage(Message::eMessageError, "", string("Cannot write frame: ") + szError);
+                        reportEncodeError(string("Cannot write frame: ") + szError);
                         error = true;
                     }
                 }
@@ -3692,20 +3772,22 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
         }
     }
 
-    // If the source frame buffer address is not the
-    // same as the output buffer address, assume that
-    // an intermediate buffer was allocated above and
-    // must now be released.
-    if (avFrame) {
-        if (avFrame->data[0] != avPicture.data[0]) {
-            av_freep(avFrame->data);
-        }
-        av_frame_free(&avFrame);
-    }
-
     return ret;
 } // WriteFFmpegPlugin::writeVideo
 
+// Report an error from writeVideo. The encoder thread cannot use the OFX
+// suites, so the message is kept and reported by the next render action.
+void
+WriteFFmpegPlugin::reportEncodeError(const string& message)
+{
+    if ( _encoderThread && ( tthread::this_thread::get_id() == _encoderThread->get_id() ) ) {
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        _encoderErrorMessage = message;
+    } else {
+        setPersistentMessage(Message::eMessageError, "", message);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // writeToFile
 // Write video and if specifed audio to the movie. Interleave the audio and
@@ -3724,11 +3806,7 @@ int
 WriteFFmpegPlugin::writeToFile(AVFormatContext* avFormatContext,
                                bool finalise,
                                double time,
-                               const float *pixelData,
-                               const OfxRectI* bounds,
-                               int pixelDataNComps,
-                               int dstNComps,
-                               int rowBytes)
+                               AVFrame* avFrame)
 {
 #if OFX_FFMPEG_AUDIO
     // Write interleaved audio and video if an audio file has
@@ -3761,11 +3839,11 @@ WriteFFmpegPlugin::writeToFile(AVFormatContext* avFormatContext,
         return -6;
     }
     assert(avFormatContext);
-    if ( !avFormatContext || ( !finalise && (!pixelData || !bounds) ) ) {
+    if ( !avFormatContext || ( !finalise && !avFrame ) ) {
         return -7;
     }
 
-    return writeVideo(avFormatContext, _streamVideo, finalise, time, pixelData, bounds, pixelDataNComps, dstNComps, rowBytes);
+    return writeVideo(avFormatContext, _streamVideo, finalise, time, avFrame);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -4123,29 +4201,18 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
     }
     // Flag that we didn't encode any frame yet
     {
-        AutoMutex lock(_nextFrameToEncodeMutex);
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
         _nextFrameToEncode = (int)args.frameRange.min;
         _firstFrameToEncode = (int)args.frameRange.min;
         _lastFrameToEncode = (int)args.frameRange.max;
         _frameStep = (int)args.frameStep;
+        _error = CLEANUP;
     }
 
     _isOpen = true;
-    _error = CLEANUP;
-} // WriteFFmpegPlugin::beginEncode
 
-inline void
-sleep(const unsigned int milliseconds)
-{
-#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
-    Sleep(milliseconds);
-#else
-    struct timespec tv;
-    tv.tv_sec = milliseconds / 1000;
-    tv.tv_nsec = (milliseconds % 1000) * 1000000;
-    nanosleep(&tv, 0);
-#endif
-}
+    startEncoderThread();
+} // WriteFFmpegPlugin::beginEncode
 
 #define checkAvError() if (error < 0) { \
         char errorBuf[1024]; \
@@ -4203,56 +4270,265 @@ WriteFFmpegPlugin::encode(const string& filename,
         return;
     }
 
-    ///Check that we're really encoding in sequential order
+    // Get a frame from the pool. This blocks if all the frames are waiting to
+    // be encoded, so that the render threads do not get too far ahead of the
+    // encoder thread.
+    MyAVFrame* avFrame = acquireFrame( (int)time );
+    if (!avFrame) {
+        // Another thread aborted, or the encoder thread failed
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        if ( !_encoderErrorMessage.empty() ) {
+            setPersistentMessage(Message::eMessageError, "", _encoderErrorMessage);
+        } else if ( abort() ) {
+            setPersistentMessage(Message::eMessageError, "", "Render aborted");
+        }
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    // Convert the image to the codec pixel format outside of the lock, so
+    // that several render threads can do it in parallel.
+    if ( convertFrame(_streamVideo->codec, pixelData, bounds, pixelDataNComps, rowBytes, avFrame) ) {
+        releaseFrame(avFrame);
+        setPersistentMessage(Message::eMessageError, "", "Cannot convert frame");
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    ///Queue the frame, it will be encoded by the encoder thread in sequential order
     {
-        AutoMutex lock(_nextFrameToEncodeMutex);
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
 
-        while (_nextFrameToEncode != time && _nextFrameToEncode != INT_MIN) {
+        if ( _nextFrameToEncode == INT_MIN || abort() ) {
+            // Another thread aborted, or this render was aborted
             lock.unlock();
-            sleep(1);
+            releaseFrame(avFrame);
             lock.relock();
-        }
-
-        if (_nextFrameToEncode == INT_MIN) {
-            // Another thread aborted
-            if ( abort() ) {
+            _nextFrameToEncode = INT_MIN;
+            _nextFrameToEncodeCond.notify_all();
+            if ( !_encoderErrorMessage.empty() ) {
+                setPersistentMessage(Message::eMessageError, "", _encoderErrorMessage);
+            } else if ( abort() ) {
                 setPersistentMessage(Message::eMessageError, "", "Render aborted");
             }
             throwSuiteStatusException(kOfxStatFailed);
 
             return;
         }
-        try {
-            _error = IGNORE_FINISH;
+        if ( (time < _nextFrameToEncode) || ( _pendingFrames.find( (int)time ) != _pendingFrames.end() ) ) {
+            // this frame was already encoded
+            lock.unlock();
+            releaseFrame(avFrame);
 
+            return;
+        }
+        _pendingFrames[(int)time] = avFrame;
+        _nextFrameToEncodeCond.notify_all();
+    } // CondAutoMutex lock(_nextFrameToEncodeMutex);
+} // WriteFFmpegPlugin::encode
 
-            if (_isOpen) {
-                _error = CLEANUP;
+////////////////////////////////////////////////////////////////////////////////
+// startEncoderThread
+// Allocate the frame pool and start the encoder thread. The pool holds enough
+// frames to keep every CPU busy converting, within the memory budget given by
+// OFX_FFMPEG_MAX_PENDING_BYTES.
+//
+void
+WriteFFmpegPlugin::startEncoderThread()
+{
+    assert(!_encoderThread && _streamVideo);
+    AVCodecContext* avCodecContext = _streamVideo->codec;
+    std::size_t frameSize = (std::size_t)avCodecContext->width * avCodecContext->height * std::max(FFmpeg::pixelFormatBPP(avCodecContext->pix_fmt), 8) / 8;
+    int poolSize = (int)MultiThread::getNumCPUs() + 1;
+    if (frameSize > 0) {
+        poolSize = (int)std::min( (std::size_t)poolSize, OFX_FFMPEG_MAX_PENDING_BYTES / frameSize );
+    }
+    {
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        _framePoolSize = std::max(poolSize, 2);
+        _encoderThreadQuit = false;
+        _encoderError = 0;
+        _encoderErrorMessage.clear();
+        _freeFrames.reserve(_framePoolSize);
+        while ( (int)_freeFrames.size() < _framePoolSize ) {
+            MyAVFrame* avFrame = new MyAVFrame;
+            if ( avFrame->alloc(avCodecContext->width, avCodecContext->height, avCodecContext->pix_fmt, 1) ) {
+                // out of memory: the pool will be smaller
+                delete avFrame;
+                break;
+            }
+            _freeFrames.push_back(avFrame);
+            ++_framesAllocated;
+        }
+    }
+    _encoderThread = new tthread::thread(encoderThreadFunction, this);
+}
 
-                if (!_streamVideo) {
-                    throwSuiteStatusException(kOfxStatErrBadHandle);
+// Wait until the encoder thread has encoded all the pending frames, and stop it.
+void
+WriteFFmpegPlugin::stopEncoderThread()
+{
+    if (!_encoderThread) {
+        return;
+    }
+    {
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        _encoderThreadQuit = true;
+        _nextFrameToEncodeCond.notify_all();
+    }
+    if ( _encoderThread->joinable() ) {
+        _encoderThread->join();
+    }
+    delete _encoderThread;
+    _encoderThread = NULL;
+}
 
-                    return;
-                }
-                assert(_formatContext);
-                if ( !writeToFile(_formatContext, false, time, pixelData, &bounds, pixelDataNComps, dstNComps, rowBytes) ) {
-                    _error = SUCCESS;
-                    _nextFrameToEncode = (int)time + _frameStep;
-                    if ( abort() ) {
-                        _nextFrameToEncode = INT_MIN;
-                    }
-                } else {
-                    throwSuiteStatusException(kOfxStatFailed);
+void
+WriteFFmpegPlugin::encoderThreadFunction(void* arg)
+{
+    static_cast<WriteFFmpegPlugin*>(arg)->encoderThreadLoop();
+}
 
-                    return;
-                }
+////////////////////////////////////////////////////////////////////////////////
+// encoderThreadLoop
+// Encode and write the pending frames in sequential order, until
+// stopEncoderThread() is called or encoding is aborted.
+//
+void
+WriteFFmpegPlugin::encoderThreadLoop()
+{
+    CondAutoMutex lock(_nextFrameToEncodeMutex);
+
+    for (;;) {
+        PendingFramesMap::iterator it = _pendingFrames.end();
+        while ( _nextFrameToEncode != INT_MIN &&
+                ( it = _pendingFrames.find(_nextFrameToEncode) ) == _pendingFrames.end() &&
+                !_encoderThreadQuit ) {
+            _nextFrameToEncodeCond.wait(_nextFrameToEncodeMutex);
+        }
+        if ( _nextFrameToEncode == INT_MIN || it == _pendingFrames.end() ) {
+            // aborted, or asked to quit and the next frame will never come
+            break;
+        }
+        MyAVFrame* avFrame = it->second;
+        const int time = it->first;
+        _pendingFrames.erase(it);
+        _nextFrameToEncode = time + _frameStep;
+
+        lock.unlock();
+        assert(_formatContext && _streamVideo);
+        int ret = writeToFile(_formatContext, false, time, *avFrame);
+        releaseFrame(avFrame);
+        lock.relock();
+
+        if (!ret) {
+            _error = SUCCESS;
+        } else {
+            _encoderError = ret;
+            if ( _encoderErrorMessage.empty() ) {
+                _encoderErrorMessage = "Cannot write frame";
             }
-        } catch (const std::exception& e) {
             _nextFrameToEncode = INT_MIN;
-            throw e;
         }
-    } // MultiThread::AutoMutex lock(_nextFrameToEncodeMutex);
-} // WriteFFmpegPlugin::encode
+        _nextFrameToEncodeCond.notify_all();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// acquireFrame
+// Get a frame from the pool. If the pool is empty, wait until the encoder
+// thread gives a frame back, unless this is the first frame that is missing
+// for the encoder thread to proceed: that one always gets a frame, or the
+// queue could never be drained.
+//
+// @return a frame, or NULL if encoding was aborted.
+//
+MyAVFrame*
+WriteFFmpegPlugin::acquireFrame(int time)
+{
+    {
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+
+        for (;;) {
+            if (_nextFrameToEncode == INT_MIN) {
+                return NULL;
+            }
+            if ( !_freeFrames.empty() ) {
+                MyAVFrame* avFrame = _freeFrames.back();
+                _freeFrames.pop_back();
+
+                return avFrame;
+            }
+            if ( (_framesAllocated < _framePoolSize) || (time == firstMissingFrame()) ) {
+                ++_framesAllocated;
+                break;
+            }
+            _nextFrameToEncodeCond.wait(_nextFrameToEncodeMutex);
+        }
+    }
+    // allocate a new frame outside of the lock
+    AVCodecContext* avCodecContext = _streamVideo->codec;
+    MyAVFrame* avFrame = new MyAVFrame;
+    if ( avFrame->alloc(avCodecContext->width, avCodecContext->height, avCodecContext->pix_fmt, 1) ) {
+        delete avFrame;
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        --_framesAllocated;
+
+        return NULL;
+    }
+
+    return avFrame;
+}
+
+// Give a frame back to the pool.
+void
+WriteFFmpegPlugin::releaseFrame(MyAVFrame* avFrame)
+{
+    CondAutoMutex lock(_nextFrameToEncodeMutex);
+
+    if (_framesAllocated > _framePoolSize) {
+        // this frame was allocated beyond the pool size
+        delete avFrame;
+        --_framesAllocated;
+    } else {
+        _freeFrames.push_back(avFrame);
+    }
+    _nextFrameToEncodeCond.notify_all();
+}
+
+// The first frame that is neither encoded nor queued. _nextFrameToEncodeMutex must be locked.
+int
+WriteFFmpegPlugin::firstMissingFrame() const
+{
+    int time = _nextFrameToEncode;
+
+    while ( _pendingFrames.find(time) != _pendingFrames.end() ) {
+        time += _frameStep;
+    }
+
+    return time;
+}
+
+// Release all the frames that were not encoded yet, and the frame pool.
+void
+WriteFFmpegPlugin::clearPendingFrames()
+{
+    CondAutoMutex lock(_nextFrameToEncodeMutex);
+
+    for (PendingFramesMap::iterator it = _pendingFrames.begin(); it != _pendingFrames.end(); ++it) {
+        delete it->second;
+    }
+    _pendingFrames.clear();
+    for (vector<MyAVFrame*>::iterator it = _freeFrames.begin(); it != _freeFrames.end(); ++it) {
+        delete *it;
+    }
+    _freeFrames.clear();
+    _framesAllocated = 0;
+    _framePoolSize = 0;
+    _nextFrameToEncodeCond.notify_all();
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // finish
@@ -4273,7 +4549,19 @@ WriteFFmpegPlugin::endEncode(const EndSequenceRenderArguments & /*args*/)
     }
 
 
-    if (_error == IGNORE_FINISH) {
+    // Encode the remaining frames, and stop the encoder thread before
+    // flushing the encoder from this thread.
+    stopEncoderThread();
+    WriterError error;
+    {
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        if (_encoderError) {
+            setPersistentMessage(Message::eMessageError, "", _encoderErrorMessage);
+        }
+        error = _error;
+    }
+
+    if (error == IGNORE_FINISH) {
         freeFormat();
 
         return;
@@ -4867,6 +5155,13 @@ WriteFFmpegPlugin::changedClip(const InstanceChangedArgs &args,
 void
 WriteFFmpegPlugin::freeFormat()
 {
+    {
+        // make sure the encoder thread exits without encoding pending frames
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
+        _nextFrameToEncode = INT_MIN;
+        _nextFrameToEncodeCond.notify_all();
+    }
+    stopEncoderThread();
     if (_streamVideo) {
         avcodec_close(_streamVideo->codec);
         _streamVideo = NULL;
@@ -4882,12 +5177,14 @@ WriteFFmpegPlugin::freeFormat()
         avformat_free_context(_formatContext);
         _formatContext = NULL;
     }
+    clearPendingFrames();
     {
-        AutoMutex lock(_nextFrameToEncodeMutex);
+        CondAutoMutex lock(_nextFrameToEncodeMutex);
         _nextFrameToEncode = INT_MIN;
         _firstFrameToEncode = 1;
         _lastFrameToEncode = 1;
         _frameStep = 1;
+        _nextFrameToEncodeCond.notify_all();
     }
     _scratchBufferSize = 0;
     delete [] _scratchBuffer;
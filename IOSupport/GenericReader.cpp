@@ -1776,6 +1776,10 @@ GenericReaderPlugin::render(const RenderArguments &args)
             } else {
                 decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, it->rawComps, it->rowBytes);
             }
+        } else if ( !mustPremult && isOCIOIdentity && kSupportsRenderScale && (downscaleLevels > 0) && !_isMultiPlanar &&
+                    decodeScaled(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, (unsigned int)downscaleLevels, it->pixelData, firstBounds, it->comps, it->numChans, it->rowBytes) ) {
+            // no colorspace conversion, no premultiplication, the reader decoded the file at the render scale
+            DBG( std::printf("decodeScaled (to dst)\n") );
         } else {
             int pixelBytes;
             if (it->comps == ePixelComponentCustom) {
@@ -1785,11 +1789,33 @@ GenericReaderPlugin::render(const RenderArguments &args)
             }
             assert(pixelBytes > 0);
 
+            std::auto_ptr<ImageMemory> mem;
+            float *tmpPixelData = NULL;
+            int tmpRowBytes = 0;
+            int planeDownscaleLevels = downscaleLevels; // the number of mipmap levels from tmpPixelData to the renderWindow
+
+            if ( kSupportsRenderScale && (downscaleLevels > 0) && !_isMultiPlanar ) {
+                // let the reader decode directly at the render scale, if it can
+                tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
+                size_t memSize = (size_t)(args.renderWindow.y2 - args.renderWindow.y1) * (size_t)tmpRowBytes;
+                mem.reset( new ImageMemory(memSize, this) );
+                tmpPixelData = (float*)mem->lock();
+
+                DBG( std::printf("decodeScaled (to tmp)\n") );
+                if ( decodeScaled(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, (unsigned int)downscaleLevels, tmpPixelData, args.renderWindow, it->comps, it->numChans, tmpRowBytes) ) {
+                    renderWindowFullRes = renderWindowNotRounded = args.renderWindow;
+                    planeDownscaleLevels = 0;
+                } else {
+                    mem.reset();
+                    tmpPixelData = NULL;
+                }
+            }
+
             /*
                If tile_width and tile_height is set, round the renderWindow to the enclosing tile size to make sure the plug-in has a buffer
                large enough to decode tiles. This is needed for OpenImageIO. Note that
              */
-            if ( (tile_width > 0) && (tile_height > 0) ) {
+            if ( !tmpPixelData && (tile_width > 0) && (tile_height > 0) ) {
                 double frameHeight = frameBounds.y2 - frameBounds.y1;
                 if ( isTileOrientationTopDown() ) {
                     //invert Y before rounding
@@ -1819,18 +1845,20 @@ GenericReaderPlugin::render(const RenderArguments &args)
                 }
             }
 
-            int tmpRowBytes = (renderWindowFullRes.x2 - renderWindowFullRes.x1) * pixelBytes;
-            size_t memSize = (size_t)(renderWindowFullRes.y2 - renderWindowFullRes.y1) * (size_t)tmpRowBytes;
-            ImageMemory mem(memSize, this);
-            float *tmpPixelData = (float*)mem.lock();
+            if (!tmpPixelData) {
+                tmpRowBytes = (renderWindowFullRes.x2 - renderWindowFullRes.x1) * pixelBytes;
+                size_t memSize = (size_t)(renderWindowFullRes.y2 - renderWindowFullRes.y1) * (size_t)tmpRowBytes;
+                mem.reset( new ImageMemory(memSize, this) );
+                tmpPixelData = (float*)mem->lock();
 
-            // read file
-            DBG( std::printf("decode (to tmp)\n") );
+                // read file
+                DBG( std::printf("decode (to tmp)\n") );
 
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, tmpRowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, it->rawComps, tmpRowBytes);
+                if (!_isMultiPlanar) {
+                    decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, tmpRowBytes);
+                } else {
+                    decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, it->rawComps, tmpRowBytes);
+                }
             }
 
             if ( abort() ) {
@@ -1857,12 +1885,12 @@ GenericReaderPlugin::render(const RenderArguments &args)
 #endif
             }
 
-            if ( kSupportsRenderScale && (downscaleLevels > 0) ) {
+            if ( kSupportsRenderScale && (planeDownscaleLevels > 0) ) {
                 if (!mustPremult) {
                     // we can write directly to dstPixelData
                     /// adjust the scale to match the given output image
                     DBG( std::printf("scale (no premult, tmp to dst)\n") );
-                    scalePixelData(args.renderWindow, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData, remappedComponents,
+                    scalePixelData(args.renderWindow, renderWindowNotRounded, (unsigned int)planeDownscaleLevels, tmpPixelData, remappedComponents,
                                    it->numChans, firstDepth, renderWindowFullRes, tmpRowBytes, it->pixelData,
                                    remappedComponents, it->numChans, firstDepth, firstBounds, it->rowBytes);
                 } else {
@@ -1874,7 +1902,7 @@ GenericReaderPlugin::render(const RenderArguments &args)
 
                     /// adjust the scale to match the given output image
                     DBG( std::printf("scale (tmp to scaled)\n") );
-                    scalePixelData(args.renderWindow, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData,
+                    scalePixelData(args.renderWindow, renderWindowNotRounded, (unsigned int)planeDownscaleLevels, tmpPixelData,
                                    remappedComponents, it->numChans, firstDepth,
                                    renderWindowFullRes, tmpRowBytes, scaledPixelData,
                                    remappedComponents, it->numChans, firstDepth,
@@ -1902,7 +1930,7 @@ GenericReaderPlugin::render(const RenderArguments &args)
                     copyPixelData(args.renderWindow, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
                 }
             }
-            mem.unlock();
+            mem->unlock();
         }
     } // for (std::list<PlaneToRender>::iterator it = planes.begin(); it!=planes.end(); ++it) {
 }
@@ -2584,9 +2612,9 @@ public:
 
             int srcY = _dstBounds.y2 - dsty - 1;
             float* dst_pixels = (float*)( (char*)_dstPixelData + (size_t)_dstBufferRowBytes * (dsty - _dstBounds.y1) )
-                                + (_dstBounds.x1 * nDstComp);
+                                - (_dstBounds.x1 * nDstComp);
             const SRCPIX* src_pixels = (const SRCPIX*)( (const char*)_srcPixelData + (size_t)_srcBufferRowBytes * (srcY - _srcBufferBounds.y1) )
-                                       + (_srcBufferBounds.x1 * nSrcComp);
+                                       - (_srcBufferBounds.x1 * nSrcComp);
 
 
             assert(dst_pixels && src_pixels);
@@ -252,6 +252,18 @@ private:
     virtual void decodePlane(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
                              OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
 
+    /**
+     * @brief Override this function if the reader can decode the image directly at a lower resolution
+     * (e.g. by skipping rows and columns, or by reading only some passes of an interlaced image).
+     * renderWindow and bounds are at mipmap level downscaleLevels of the file, i.e. the full resolution
+     * image scaled by 1/2^downscaleLevels.
+     * Return false if the image cannot be decoded at that scale: the pixel data must then be left untouched,
+     * and the image is decoded at full resolution and downscaled.
+     * This is only called for non multi-planar readers.
+     **/
+    virtual bool decodeScaled(const std::string& /*filename*/, OfxTime /*time*/, int /*view*/, bool /*isPlayback*/, const OfxRectI& /*renderWindow*/, unsigned int /*downscaleLevels*/,
+                              float* /*pixelData*/, const OfxRectI& /*bounds*/, OFX::PixelComponentEnum /*pixelComponents*/, int /*pixelComponentCount*/, int /*rowBytes*/) { return false; }
+
 
     /**
      * @brief Override to indicate the time domain. Return false if you know that the
@@ -22,12 +22,42 @@
  */
 
 #include <cstdio> // fopen, fread...
+#include <cstring>
 #include <algorithm>
+#include <list>
+#include <map>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h> // _wstat64
+#else
+#include <sys/types.h>
+#include <sys/stat.h> // stat, fstat
+#include <sys/mman.h> // mmap
+#include <fcntl.h> // open
+#include <unistd.h> // close
+#endif
 
 #include "GenericReader.h"
 #include "GenericOCIO.h"
 #include "ofxsFileOpen.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -54,7 +84,387 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsRGB true
 #define kSupportsXY false
 #define kSupportsAlpha true
-#define kSupportsTiles false
+#define kSupportsTiles true
+
+#define kPFMHeaderCacheMaxEntries 1024 // maximum number of file headers kept by each reader
+
+/**
+   \return \c false for "Little Endian", \c true for "Big Endian".
+ **/
+static inline bool
+endianness()
+{
+    const int x = 1;
+
+    return ( (unsigned char *)&x )[0] ? false : true;
+}
+
+// The PFM header of a file
+struct PFMHeader
+{
+    int width;
+    int height;
+    int nComps; // 3 for 'PF' files, 1 for 'Pf' files
+    double scale; // its sign gives the endianness of the samples
+    bool scaleFound;
+    long long dataOffset; // position of the first sample in the file
+};
+
+#ifdef _WIN32
+static inline std::wstring
+utf8ToWide(const string& s)
+{
+    int len = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
+    if (len <= 0) {
+        return std::wstring();
+    }
+    vector<wchar_t> buf(len);
+    MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, &buf[0], len);
+
+    return std::wstring(&buf[0]);
+}
+
+#endif
+
+// Get the modification time and size of a file, used to detect files that were modified
+static bool
+getFileStamp(const string& filename,
+             long long* mtime,
+             long long* size)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_wstat64(utf8ToWide(filename).c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    *mtime = (long long)st.st_mtime;
+    *size = (long long)st.st_size;
+
+    return true;
+}
+
+// Read the header of a PFM file. Returns false and sets the error if it is not a valid PFM file.
+static bool
+readPFMHeader(const string& filename,
+              PFMHeader* header,
+              string* error)
+{
+    std::FILE *const nfile = fopen_utf8(filename.c_str(), "rb");
+
+    if (!nfile) {
+        *error = string("Cannot open file \"") + filename + "\".";
+
+        return false;
+    }
+
+    char pfm_type, item[1024] = { 0 };
+    int W = 0;
+    int H = 0;
+    int err = 0;
+    double scale = 0.0;
+    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    if ( (std::sscanf(item, " P%c", &pfm_type) != 1) || ( (pfm_type != 'F') && (pfm_type != 'f') ) ) {
+        std::fclose(nfile);
+        *error = string("PFM header not found in file \"") + filename + "\".";
+
+        return false;
+    }
+    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    if (std::sscanf(item, " %d %d", &W, &H) != 2) {
+        std::fclose(nfile);
+        *error = string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
+
+        return false;
+    }
+    if ( (W <= 0) || (H <= 0) || (0xffff < W) || (0xffff < H) ) {
+        std::fclose(nfile);
+        *error = string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".";
+
+        return false;
+    }
+    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    header->scaleFound = (std::sscanf(item, "%lf", &scale) == 1);
+
+    {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    header->dataOffset = (long long)std::ftell(nfile);
+    std::fclose(nfile);
+
+    header->width = W;
+    header->height = H;
+    header->nComps = (pfm_type == 'F') ? 3 : 1;
+    header->scale = scale;
+
+    return true;
+} // readPFMHeader
+
+// A read-only memory mapping of a byte range of a file, unmapped at destruction.
+// Only the pages holding the range are mapped, so that a window of a huge file can be read
+// without mapping (or reading) the whole file.
+class MappedFile
+{
+    const unsigned char* _view; // start of the mapping, aligned on the mapping granularity
+    std::size_t _viewSize;
+    const unsigned char* _data; // first byte of the requested range
+#ifdef _WIN32
+    HANDLE _file;
+    HANDLE _mapping;
+#endif
+
+public:
+    // map length bytes starting at offset. data() is NULL if the file is shorter than offset+length.
+    MappedFile(const string& filename,
+               long long offset,
+               std::size_t length,
+               bool willRead)
+        : _view(NULL)
+        , _viewSize(0)
+        , _data(NULL)
+#ifdef _WIN32
+        , _file(INVALID_HANDLE_VALUE)
+        , _mapping(NULL)
+#endif
+    {
+        if ( (offset < 0) || (length == 0) ) {
+            return;
+        }
+#ifdef _WIN32
+        _file = CreateFileW(utf8ToWide(filename).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, willRead ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (_file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER size;
+        if ( !GetFileSizeEx(_file, &size) || ( size.QuadPart < offset + (long long)length ) ) {
+            return;
+        }
+        _mapping = CreateFileMappingW(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!_mapping) {
+            return;
+        }
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        long long viewOffset = offset - offset % (long long)si.dwAllocationGranularity;
+        _viewSize = (std::size_t)(offset - viewOffset) + length;
+        _view = (const unsigned char*)MapViewOfFile(_mapping, FILE_MAP_READ, (DWORD)(viewOffset >> 32), (DWORD)(viewOffset & 0xffffffff), _viewSize);
+        if (_view) {
+            _data = _view + (offset - viewOffset);
+        }
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if ( (fstat(fd, &st) == 0) && ( (long long)st.st_size >= offset + (long long)length ) ) {
+            long long pageSize = (long long)sysconf(_SC_PAGESIZE);
+            long long viewOffset = offset - offset % pageSize;
+            std::size_t viewSize = (std::size_t)(offset - viewOffset) + length;
+            void* view = mmap(NULL, viewSize, PROT_READ, MAP_PRIVATE, fd, (off_t)viewOffset);
+            if (view != MAP_FAILED) {
+                _view = (const unsigned char*)view;
+                _viewSize = viewSize;
+                _data = _view + (offset - viewOffset);
+                // if most of the range is needed, start reading it ahead; else only fault in the pages that are touched
+                madvise(view, viewSize, willRead ? MADV_WILLNEED : MADV_RANDOM);
+            }
+        }
+        // the mapping stays valid after the file is closed
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (_view) {
+            UnmapViewOfFile(_view);
+        }
+        if (_mapping) {
+            CloseHandle(_mapping);
+        }
+        if (_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(_file);
+        }
+#else
+        if (_view) {
+            munmap( (void*)_view, _viewSize );
+        }
+#endif
+    }
+
+    const unsigned char* data() const { return _data; }
+};
+
+// Reads one sample from the mapped file: samples may not be aligned, and may need to be byte-swapped
+template <bool swap>
+static inline float
+loadSample(const unsigned char* src)
+{
+    unsigned int val;
+
+    std::memcpy(&val, src, sizeof(val));
+    if (swap) {
+        val = (val >> 24) | ( (val >> 8) & 0xff00 ) | ( (val << 8) & 0xff0000 ) | (val << 24);
+    }
+    float f;
+    std::memcpy(&f, &val, sizeof(f));
+
+    return f;
+}
+
+template <int srcC, int dstC, bool swap>
+static void
+copyLine(const unsigned char* srcPix,
+         int width,
+         float *dstPix)
+{
+    for (int x = 0; x < width; ++x) {
+        if (srcC == 1) {
+            // alpha/grayscale image
+            float v = loadSample<swap>(srcPix);
+            for (int c = 0; c < std::min(dstC, 3); ++c) {
+                dstPix[c] = v;
+            }
+        } else {
+            // color image (if dstC == 1, only the red channel is extracted)
+            for (int c = 0; c < std::min(dstC, 3); ++c) {
+                dstPix[c] = loadSample<swap>(srcPix + c * sizeof(float));
+            }
+        }
+        if (dstC == 4) {
+            // Alpha is 0 on RGBA images to allow adding alpha using a Roto node.
+            // Alpha is set to 0 and premult is set to Opaque.
+            // That way, the Roto node can be conveniently used to draw a mask. This shouldn't
+            // disturb anything else in the process, since Opaque premult means that alpha should
+            // be considered as being 1 everywhere, whatever the actual alpha value is.
+            // see GenericWriterPlugin::render, if (userPremult == eImageOpaque...
+            dstPix[3] = 0.f; // alpha
+        }
+
+        srcPix += srcC * sizeof(float);
+        dstPix += dstC;
+    }
+}
+
+/**
+ * @brief Converts the rows of a mapped PFM file straight to the destination image, in parallel.
+ *
+ * PFM rows are stored from bottom to top, like OFX images, so row y of the file is line y of the image.
+ * samples points to the first sample of the render window (x1,y1) in the mapped file.
+ **/
+template <int srcC, int dstC, bool swap>
+class PFMLineConverter
+    : public MultiThread::Processor
+{
+    const unsigned char* _samples; // the sample at (renderWindow.x1, renderWindow.y1)
+    std::size_t _fileRowBytes;
+    OfxRectI _renderWindow;
+    float* _pixelData;
+    OfxRectI _bounds;
+    int _rowBytes;
+
+public:
+    PFMLineConverter(const unsigned char* samples,
+                     std::size_t fileRowBytes,
+                     const OfxRectI& renderWindow,
+                     float* pixelData,
+                     const OfxRectI& bounds,
+                     int rowBytes)
+        : _samples(samples)
+        , _fileRowBytes(fileRowBytes)
+        , _renderWindow(renderWindow)
+        , _pixelData(pixelData)
+        , _bounds(bounds)
+        , _rowBytes(rowBytes)
+    {
+    }
+
+    void process()
+    {
+        int height = _renderWindow.y2 - _renderWindow.y1;
+
+        multiThread( std::min( MultiThread::getNumCPUs(), (unsigned int)std::max(height, 1) ) );
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        int height = _renderWindow.y2 - _renderWindow.y1;
+        int y1 = _renderWindow.y1 + (int)( (long long)height * threadIndex / threadMax );
+        int y2 = _renderWindow.y1 + (int)( (long long)height * (threadIndex + 1) / threadMax );
+
+        for (int y = y1; y < y2; ++y) {
+            float* dstPix = (float*)( (char*)_pixelData + (std::size_t)(y - _bounds.y1) * _rowBytes ) + (_renderWindow.x1 - _bounds.x1) * dstC;
+            copyLine<srcC, dstC, swap>(_samples + (std::size_t)(y - _renderWindow.y1) * _fileRowBytes, _renderWindow.x2 - _renderWindow.x1, dstPix);
+        }
+    }
+};
+
+template <int srcC, int dstC>
+static void
+convertLines(bool swap,
+             const unsigned char* samples,
+             std::size_t fileRowBytes,
+             const OfxRectI& renderWindow,
+             float* pixelData,
+             const OfxRectI& bounds,
+             int rowBytes)
+{
+    if (swap) {
+        PFMLineConverter<srcC, dstC, true> p(samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+        p.process();
+    } else {
+        PFMLineConverter<srcC, dstC, false> p(samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+        p.process();
+    }
+}
+
+template <int srcC>
+static void
+convertLinesForSrcComps(int dstC,
+                        bool swap,
+                        const unsigned char* samples,
+                        std::size_t fileRowBytes,
+                        const OfxRectI& renderWindow,
+                        float* pixelData,
+                        const OfxRectI& bounds,
+                        int rowBytes)
+{
+    switch (dstC) {
+    case 1:
+        convertLines<srcC, 1>(swap, samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+        break;
+    case 2:
+        convertLines<srcC, 2>(swap, samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+        break;
+    case 3:
+        convertLines<srcC, 3>(swap, samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+        break;
+    case 4:
+        convertLines<srcC, 4>(swap, samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+        break;
+    default:
+        break;
+    }
+}
 
 class ReadPFMPlugin
     : public GenericReaderPlugin
@@ -92,56 +502,35 @@ private:
      * When reading an image sequence, this is called only for the first image when the user actually selects the new sequence.
      **/
     virtual bool guessParamsFromFilename(const string& filename, string *colorspace, PreMultiplicationEnum *filePremult, PixelComponentEnum *components, int *componentCount) OVERRIDE FINAL;
-};
 
+    virtual void clearAnyCache() OVERRIDE FINAL;
 
-/**
-   \return \c false for "Little Endian", \c true for "Big Endian".
- **/
-static inline bool
-endianness()
-{
-    const int x = 1;
-
-    return ( (unsigned char *)&x )[0] ? false : true;
-}
+    // get the header of a file, from the cache if the file was not modified since it was read.
+    // Returns false and sets the error if the file is not a valid PFM file
+    bool getHeader(const string& filename, PFMHeader* header, string* error);
 
-//! Invert endianness of a memory buffer.
-template<typename T>
-static void
-invert_endianness(T *const buffer,
-                  const unsigned int size)
-{
-    if (size) {
-        switch ( sizeof(T) ) {
-        case 1:
-            break;
-        case 2:
-            for (unsigned short *ptr = (unsigned short *)buffer + size; ptr > (unsigned short *)buffer; ) {
-                const unsigned short val = *(--ptr);
-                *ptr = (unsigned short)( (val >> 8) | ( (val << 8) ) );
-            }
-            break;
-        case 4:
-            for (unsigned int *ptr = (unsigned int *)buffer + size; ptr > (unsigned int *)buffer; ) {
-                const unsigned int val = *(--ptr);
-                *ptr = (val >> 24) | ( (val >> 8) & 0xff00 ) | ( (val << 8) & 0xff0000 ) | (val << 24);
-            }
-            break;
-        default:
-            for (T *ptr = buffer + size; ptr > buffer; ) {
-                unsigned char *pb = (unsigned char *)(--ptr), *pe = pb + sizeof(T);
-                for (int i = 0; i < (int)sizeof(T) / 2; ++i) {
-                    std::swap( *(pb++), *(--pe) );
-                }
-            }
-        }
-    }
-}
+    struct HeaderEntry
+    {
+        string filename;
+        long long mtime;
+        long long size;
+        PFMHeader header;
+    };
+
+    typedef std::list<HeaderEntry> HeadersList;
+    typedef std::map<string, HeadersList::iterator> HeadersMap;
+
+    HeadersList _headers; // cached headers, most recently used first
+    HeadersMap _headersIndex; // maps file names to _headers entries
+    Mutex _headersLock;
+};
 
 ReadPFMPlugin::ReadPFMPlugin(OfxImageEffectHandle handle,
                              const vector<string>& extensions)
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
+    , _headers()
+    , _headersIndex()
+    , _headersLock()
 {
 }
 
@@ -149,44 +538,65 @@ ReadPFMPlugin::~ReadPFMPlugin()
 {
 }
 
-template <class PIX, int srcC, int dstC>
-static void
-copyLine(PIX *image,
-         int x1,
-         int x2,
-         int C,
-         PIX *dstPix)
+bool
+ReadPFMPlugin::getHeader(const string& filename,
+                         PFMHeader* header,
+                         string* error)
 {
-    assert(srcC == C);
+    long long mtime = 0;
+    long long size = 0;
 
-    const PIX *srcPix = image + x1 * C;
-    dstPix += x1 * dstC;
-
-    for (int x = x1; x < x2; ++x) {
-        if (srcC == 1) {
-            // alpha/grayscale image
-            for (int c = 0; c < std::min(dstC, 3); ++c) {
-                dstPix[c] = srcPix[0];
-            }
-        } else {
-            // color image (if dstC == 1, only the red channel is extracted)
-            for (int c = 0; c < std::min(dstC, 3); ++c) {
-                dstPix[c] = srcPix[c];
-            }
+    getFileStamp(filename, &mtime, &size);
+    {
+        AutoMutex g(_headersLock);
+        HeadersMap::iterator found = _headersIndex.find(filename);
+        if ( ( found != _headersIndex.end() ) && (found->second->mtime == mtime) && (found->second->size == size) ) {
+            // move it to the front of the list
+            _headers.splice(_headers.begin(), _headers, found->second);
+            *header = found->second->header;
+
+            return true;
         }
-        if (dstC == 4) {
-            // Alpha is 0 on RGBA images to allow adding alpha using a Roto node.
-            // Alpha is set to 0 and premult is set to Opaque.
-            // That way, the Roto node can be conveniently used to draw a mask. This shouldn't
-            // disturb anything else in the process, since Opaque premult means that alpha should
-            // be considered as being 1 everywhere, whatever the actual alpha value is.
-            // see GenericWriterPlugin::render, if (userPremult == eImageOpaque...
-            dstPix[3] = 0.f; // alpha
+    }
+
+    // not in the cache: parse the header, without holding the lock
+    string err;
+    if ( !readPFMHeader(filename, header, &err) ) {
+        if (error) {
+            *error = err;
         }
 
-        srcPix += srcC;
-        dstPix += dstC;
+        return false;
+    }
+
+    AutoMutex g(_headersLock);
+    HeadersMap::iterator found = _headersIndex.find(filename);
+    if ( found != _headersIndex.end() ) {
+        _headers.erase(found->second);
+        _headersIndex.erase(found);
     }
+    HeaderEntry h;
+    h.filename = filename;
+    h.mtime = mtime;
+    h.size = size;
+    h.header = *header;
+    _headers.push_front(h);
+    _headersIndex[filename] = _headers.begin();
+    while (_headersIndex.size() > (std::size_t)kPFMHeaderCacheMaxEntries) {
+        _headersIndex.erase(_headers.back().filename);
+        _headers.pop_back();
+    }
+
+    return true;
+} // ReadPFMPlugin::getHeader
+
+void
+ReadPFMPlugin::clearAnyCache()
+{
+    AutoMutex g(_headersLock);
+
+    _headers.clear();
+    _headersIndex.clear();
 }
 
 void
@@ -209,126 +619,54 @@ ReadPFMPlugin::decode(const string& filename,
     }
 
     // read PFM header
-    std::FILE *const nfile = fopen_utf8(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int C = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("PFM header not found in file \"") + filename + "\".");
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " %d %d", &W, &H) != 2) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".");
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-    if ( (W <= 0) || (H <= 0) || (0xffff < W) || (0xffff < H) ) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".");
+    PFMHeader header;
+    string error;
+    if ( !getHeader(filename, &header, &error) ) {
+        setPersistentMessage(Message::eMessageError, "", error);
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
 
     clearPersistentMessage();
-    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, "%lf", &scale) != 1) {
+    if (!header.scaleFound) {
         setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
     }
 
-    {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-
-    const bool is_inverted = (scale > 0) != endianness();
-    if (pfm_type == 'F') {
-        C = 3;
-    } else {
-        C = 1;
-    }
-
-    std::size_t numpixels = W * C;
-    vector<float> image(numpixels);
+    const int W = header.width;
+    const int H = header.height;
+    const int C = header.nComps;
+    const bool is_inverted = (header.scale > 0) != endianness();
 
     assert(0 <= renderWindow.x1 && renderWindow.x2 <= W &&
            0 <= renderWindow.y1 && renderWindow.y2 <= H);
-    const int x1 = renderWindow.x1;
-    const int x2 = renderWindow.x2;
 
-    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        std::size_t numread = std::fread(&image.front(), 4, numpixels, nfile);
-        if (numread < numpixels) {
-            std::fclose(nfile);
-            setPersistentMessage(Message::eMessageError, "", "could not read all the image samples needed");
-            throwSuiteStatusException(kOfxStatFailed);
+    if ( (renderWindow.x1 >= renderWindow.x2) || (renderWindow.y1 >= renderWindow.y2) ) {
+        return;
+    }
 
-            return;
-        }
+    // Only the byte range from the first sample of the render window to its last sample is mapped,
+    // and the samples are converted straight from the mapping, without any intermediate copy.
+    const std::size_t pixelBytes = (std::size_t)C * sizeof(float);
+    const std::size_t fileRowBytes = (std::size_t)W * pixelBytes;
+    const long long firstByte = header.dataOffset + (long long)renderWindow.y1 * fileRowBytes + (long long)renderWindow.x1 * pixelBytes;
+    const long long lastByte = header.dataOffset + (long long)(renderWindow.y2 - 1) * fileRowBytes + (long long)renderWindow.x2 * pixelBytes;
+    // ask for read-ahead unless only a narrow column of the rows is needed
+    const bool willRead = (renderWindow.x2 - renderWindow.x1) * 2 >= W;
+    MappedFile file(filename, firstByte, (std::size_t)(lastByte - firstByte), willRead);
+    if ( !file.data() ) {
+        setPersistentMessage(Message::eMessageError, "", "could not read all the image samples needed");
+        throwSuiteStatusException(kOfxStatFailed);
 
-        if (is_inverted) {
-            invert_endianness(&image.front(), numpixels);
-        }
+        return;
+    }
 
-        // now copy to the dstImg
-        float* dstPix = (float*)( (char*)pixelData + (y - bounds.y1) * rowBytes );
-        if (C == 1) {
-            switch (pixelComponentCount) {
-            case 1:
-                copyLine<float, 1, 1>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 2:
-                copyLine<float, 1, 2>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 3:
-                copyLine<float, 1, 3>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 4:
-                copyLine<float, 1, 4>(&image.front(), x1, x2, C, dstPix);
-                break;
-            default:
-                break;
-            }
-        } else if (C == 3) {
-            switch (pixelComponentCount) {
-            case 1:
-                copyLine<float, 3, 1>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 2:
-                copyLine<float, 3, 2>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 3:
-                copyLine<float, 3, 3>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 4:
-                copyLine<float, 3, 4>(&image.front(), x1, x2, C, dstPix);
-                break;
-            default:
-                break;
-            }
-        }
+    const unsigned char* samples = file.data();
+    if (C == 1) {
+        convertLinesForSrcComps<1>(pixelComponentCount, is_inverted, samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
+    } else if (C == 3) {
+        convertLinesForSrcComps<3>(pixelComponentCount, is_inverted, samples, fileRowBytes, renderWindow, pixelData, bounds, rowBytes);
     }
-    std::fclose(nfile);
 } // ReadPFMPlugin::decode
 
 bool
@@ -343,53 +681,19 @@ ReadPFMPlugin::getFrameBounds(const string& filename,
 {
     assert(bounds && par);
     // read PFM header
-    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        if (error) {
-            *error = string("PFM header not found in file \"") + filename + "\".";
-        }
-
-        return false;
-    }
-    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if ( ( err = std::sscanf(item, " %d %d", &W, &H) ) < 2 ) {
-        std::fclose(nfile);
-        if (error) {
-            *error =  string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
-        }
-
+    PFMHeader header;
+    if ( !getHeader(filename, &header, error) ) {
         return false;
     }
-    if (err == 2) {
-        clearPersistentMessage();
-        while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-            int c = std::fgetc(nfile);
-            (void)c;
-        }
-        if (std::sscanf(item, "%lf", &scale) != 1) {
-            setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
-        }
+    clearPersistentMessage();
+    if (!header.scaleFound) {
+        setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
     }
-    std::fclose(nfile);
 
     bounds->x1 = 0;
-    bounds->x2 = W;
+    bounds->x2 = header.width;
     bounds->y1 = 0;
-    bounds->y2 = H;
+    bounds->y2 = header.height;
     *format = *bounds;
     *par = 1.;
     *tile_width = *tile_height = 0;
@@ -434,33 +738,20 @@ ReadPFMPlugin::guessParamsFromFilename(const string& /*newFile*/,
     if ( (st != kOfxStatOK) || filename.empty() ) {
         return false;
     }
-    stringstream ss;
-
     // read PFM header
-    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type = 0;
-    char item[1024] = { 0 };
-    int err = 0;
-    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-
+    PFMHeader header;
+    if ( !getHeader(filename, &header, NULL) ) {
         //setPersistentMessage(Message::eMessageWarning, "", string("PFM header not found in file \"") + filename + "\".");
         return false;
     }
-    std::fclose(nfile);
 
     // set the components of _outputClip
     *components = ePixelComponentNone;
     *componentCount = 0;
-    if (pfm_type == 'F') {
+    if (header.nComps == 3) {
         *components = ePixelComponentRGB;
         *componentCount = 3;
-    } else if (pfm_type == 'f') {
+    } else if (header.nComps == 1) {
         *components = ePixelComponentAlpha;
         *componentCount = 1;
     } else {
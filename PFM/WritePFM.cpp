@@ -22,6 +22,7 @@
  */
 
 #include <cstdio> // fopen, fwrite, fprintf...
+#include <cstring> // memcpy
 #include <vector>
 #include <algorithm>
 
@@ -30,6 +31,7 @@
 #include "GenericWriter.h"
 #include "ofxsMacros.h"
 #include "ofxsFileOpen.h"
+#include "ofxsMultiThread.h"
 
 using namespace OFX;
 using namespace IO;
@@ -55,6 +57,20 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsXY false
 #define kSupportsAlpha true
 
+#define kParamByteOrder "byteOrder"
+#define kParamByteOrderLabel "Byte Order"
+#define kParamByteOrderHint "Byte order of the samples in the file. The sign of the scale field written in the header tells readers which one is used."
+#define kParamByteOrderOptionNative "Native", "Byte order of this computer (little-endian on x86 and ARM). The samples are written as they are, without any conversion."
+#define kParamByteOrderOptionLittleEndian "Little-Endian", "Little-endian samples, with a negative scale. This is the most common variant, and it requires no conversion on x86 and ARM."
+#define kParamByteOrderOptionBigEndian "Big-Endian", "Big-endian samples, with a positive scale."
+
+enum ByteOrderEnum
+{
+    eByteOrderNative = 0,
+    eByteOrderLittleEndian,
+    eByteOrderBigEndian,
+};
+
 /**
    \return \c false for "Little Endian", \c true for "Big Endian".
  **/
@@ -91,24 +107,28 @@ private:
     virtual PreMultiplicationEnum getExpectedInputPremultiplication() const OVERRIDE FINAL { return eImageUnPreMultiplied; }
 
     virtual void onOutputFileChanged(const string& newFile, bool setColorSpace) OVERRIDE FINAL;
+
+    ChoiceParam* _byteOrder;
 };
 
 WritePFMPlugin::WritePFMPlugin(OfxImageEffectHandle handle,
                                const vector<string>& extensions)
     : GenericWriterPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha)
+    , _byteOrder(0)
 {
+    _byteOrder = fetchChoiceParam(kParamByteOrder);
+    assert(_byteOrder);
 }
 
 WritePFMPlugin::~WritePFMPlugin()
 {
 }
 
-template <class PIX, int srcC, int dstC>
+template <class PIX, int srcC, int dstC, bool swap>
 static void
 copyLine(const PIX* pixelData,
          int rowbytes,
          int W,
-         int /*H*/,
          int dstNCompsStartIndex,
          int C,
          int y,
@@ -131,15 +151,96 @@ copyLine(const PIX* pixelData,
                 dstPix[c] = srcPix[dstNCompsStartIndex + c];
             }
         }
+        if (swap) {
+            for (int c = 0; c < dstC; ++c) {
+                unsigned int val;
+                std::memcpy(&val, &dstPix[c], sizeof(val));
+                val = (val >> 24) | ( (val >> 8) & 0xff00 ) | ( (val << 8) & 0xff0000 ) | (val << 24);
+                std::memcpy(&dstPix[c], &val, sizeof(val));
+            }
+        }
 
         srcPix += C;
         dstPix += dstC;
     }
 }
 
+/**
+ * @brief Converts the rows of the image to the samples of the PFM file, in parallel.
+ *
+ * PFM rows are stored from bottom to top, like OFX images, so row y of the image is row y of the file.
+ **/
+template <int srcC, int dstC, bool swap>
+class PFMRowConverter
+    : public MultiThread::Processor
+{
+    const float* _pixelData;
+    int _rowBytes;
+    int _width;
+    int _height;
+    int _dstNCompsStartIndex;
+    int _pixelDataNComps;
+    float* _image;
+
+public:
+    PFMRowConverter(const float* pixelData,
+                    int rowBytes,
+                    int width,
+                    int height,
+                    int dstNCompsStartIndex,
+                    int pixelDataNComps,
+                    float* image)
+        : _pixelData(pixelData)
+        , _rowBytes(rowBytes)
+        , _width(width)
+        , _height(height)
+        , _dstNCompsStartIndex(dstNCompsStartIndex)
+        , _pixelDataNComps(pixelDataNComps)
+        , _image(image)
+    {
+    }
+
+    void process()
+    {
+        multiThread( std::min( MultiThread::getNumCPUs(), (unsigned int)std::max(_height, 1) ) );
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        int y1 = (int)( (long long)_height * threadIndex / threadMax );
+        int y2 = (int)( (long long)_height * (threadIndex + 1) / threadMax );
+
+        for (int y = y1; y < y2; ++y) {
+            copyLine<float, srcC, dstC, swap>( _pixelData, _rowBytes, _width, _dstNCompsStartIndex, _pixelDataNComps, y, _image + (std::size_t)y * _width * dstC );
+        }
+    }
+};
+
+template <int srcC, int dstC>
+static void
+convertRows(bool swap,
+            const float* pixelData,
+            int rowBytes,
+            int width,
+            int height,
+            int dstNCompsStartIndex,
+            int pixelDataNComps,
+            float* image)
+{
+    if (swap) {
+        PFMRowConverter<srcC, dstC, true> p(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, image);
+        p.process();
+    } else {
+        PFMRowConverter<srcC, dstC, false> p(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, image);
+        p.process();
+    }
+}
+
 void
 WritePFMPlugin::encode(const string& filename,
-                       const OfxTime /*time*/,
+                       const OfxTime time,
                        const string& /*viewName*/,
                        const float *pixelData,
                        const OfxRectI& bounds,
@@ -156,6 +257,36 @@ WritePFMPlugin::encode(const string& filename,
         return;
     }
 
+    int width = (bounds.x2 - bounds.x1);
+    int height = (bounds.y2 - bounds.y1);
+    const int depth = (dstNComps == 1 ? 1 : 3);
+    ByteOrderEnum byteOrder = (ByteOrderEnum)_byteOrder->getValueAtTime(time);
+    const bool bigEndian = (byteOrder == eByteOrderNative) ? endianness() : (byteOrder == eByteOrderBigEndian);
+    const bool swap = (bigEndian != endianness());
+
+    // convert the whole image first, so that the samples are written with a single large write
+    const std::size_t imageBytes = (std::size_t)width * height * depth * sizeof(float);
+    RamBuffer buffer(imageBytes);
+    float* image = (float*)buffer.getData();
+    if (!image) {
+        setPersistentMessage(Message::eMessageError, "", "PFM: cannot allocate the output buffer");
+        throwSuiteStatusException(kOfxStatErrMemory);
+
+        return;
+    }
+
+    if (depth == 1) {
+        assert(dstNComps == 1);
+        convertRows<1, 1>(swap, pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, image);
+    } else if (depth == 3) {
+        assert(dstNComps == 3 || dstNComps == 4);
+        if (dstNComps == 3) {
+            convertRows<3, 3>(swap, pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, image);
+        } else if (dstNComps == 4) {
+            convertRows<4, 3>(swap, pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, image);
+        }
+    }
+
     std::FILE *const nfile = fopen_utf8(filename.c_str(), "wb");
     if (!nfile) {
         setPersistentMessage(Message::eMessageError, "", "Cannot open file \"" + filename + "\"");
@@ -163,33 +294,19 @@ WritePFMPlugin::encode(const string& filename,
 
         return;
     }
-    int width = (bounds.x2 - bounds.x1);
-    int height = (bounds.y2 - bounds.y1);
-    const int depth = (dstNComps == 1 ? 1 : 3);
-    const unsigned int buf_size = width * depth;
-    vector<float> buffer(buf_size);
-    std::fill(buffer.begin(), buffer.end(), 0.);
-
-    std::fprintf(nfile, "P%c\n%u %u\n%d.0\n", (dstNComps == 1 ? 'f' : 'F'), width, height, endianness() ? 1 : -1);
-
-    for (int y = 0; y < height; ++y) {
-        // now copy to the dstImg
-        if (depth == 1) {
-            assert(dstNComps == 1);
-            copyLine<float, 1, 1>( pixelData, rowBytes, width, height,  dstNCompsStartIndex, pixelDataNComps, y, &buffer.front() );
-        } else if (depth == 3) {
-            assert(dstNComps == 3 || dstNComps == 4);
-            if (dstNComps == 3) {
-                copyLine<float, 3, 3>( pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y, &buffer.front() );
-            } else if (dstNComps == 4) {
-                copyLine<float, 4, 3>( pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y, &buffer.front() );
-            }
-        }
 
-        std::fwrite(&buffer.front(), sizeof(float), buf_size, nfile);
+    std::fprintf(nfile, "P%c\n%u %u\n%d.0\n", (dstNComps == 1 ? 'f' : 'F'), width, height, bigEndian ? 1 : -1);
+
+    // the stdio buffer is bypassed for such a large write
+    std::size_t written = std::fwrite(image, 1, imageBytes, nfile);
+    bool failed = (std::fclose(nfile) != 0);
+    if ( (written != imageBytes) || failed ) {
+        setPersistentMessage(Message::eMessageError, "", "Cannot write file \"" + filename + "\"");
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
     }
-    std::fclose(nfile);
-}
+} // WritePFMPlugin::encode
 
 bool
 WritePFMPlugin::isImageFile(const string& /*fileExtension*/) const
@@ -240,6 +357,22 @@ WritePFMPluginFactory::describeInContext(ImageEffectDescriptor &desc,
                                                                     kSupportsAlpha,
                                                                     "scene_linear", "scene_linear", false);
 
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamByteOrder);
+        param->setLabel(kParamByteOrderLabel);
+        param->setHint(kParamByteOrderHint);
+        assert(param->getNOptions() == eByteOrderNative);
+        param->appendOption(kParamByteOrderOptionNative);
+        assert(param->getNOptions() == eByteOrderLittleEndian);
+        param->appendOption(kParamByteOrderOptionLittleEndian);
+        assert(param->getNOptions() == eByteOrderBigEndian);
+        param->appendOption(kParamByteOrderOptionBigEndian);
+        param->setDefault( (int)eByteOrderNative );
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
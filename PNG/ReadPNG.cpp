@@ -61,6 +61,8 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamShowMetadataLabel "Image Info..."
 #define kParamShowMetadataHint "Shows information and metadata from the image at current time."
 
+#define kPNGDecodeBandRows 16 // number of rows decoded before they are converted to float
+
 
 // All PNG images represent RGBA.
 // Single-channel images are Y
@@ -608,6 +610,7 @@ private:
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
 
     virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual bool decodeScaled(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, unsigned int downscaleLevels, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
     /**
@@ -1143,25 +1146,53 @@ ReadPNGPlugin::decode(const string& filename,
     int realbitdepth;
     int colorType;
     double par;
-    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    int interlaceType;
+    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, &interlaceType, 0, 0, 0, 0, 0, 0, 0, 0);
 
     assert(renderWindow.x1 >= x1 && renderWindow.y1 >= y1 && renderWindow.x2 <= x1 + width && renderWindow.y2 <= y1 + height);
 
+    PixelComponentEnum srcComponents;
+    switch (nChannels) {
+    case 1:
+        srcComponents = ePixelComponentAlpha;
+        break;
+    case 2:
+        srcComponents = ePixelComponentXY;
+        break;
+    case 3:
+        srcComponents = ePixelComponentRGB;
+        break;
+    case 4:
+        srcComponents = ePixelComponentRGBA;
+        break;
+    default:
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        setPersistentMessage(Message::eMessageError, "", "This plug-in only supports images with 1 to 4 channels");
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+
     std::size_t pngRowBytes = nChannels * width;
     if (bitdepth == eBitDepthUShort) {
         pngRowBytes *= sizeof(unsigned short);
     }
 
-    RamBuffer scratchBuffer(pngRowBytes * height);
+    // PNG rows are stored top to bottom: row r of the file is the OFX line bounds.y2 - 1 - (y1 + r).
+    // Only the rows [firstRow, lastRow) cover the render window.
+    int firstRow = std::max(0, bounds.y2 - renderWindow.y2 - y1);
+    int lastRow = std::min(height, bounds.y2 - renderWindow.y1 - y1);
+
+    // Interlaced images need the whole image in memory: all the Adam7 passes must be
+    // read before any row is complete.
+    // Other images are decoded kPNGDecodeBandRows rows at a time into a small buffer, which is
+    // converted to float straight into the destination before the next band is decoded.
+    bool streaming = (interlaceType == PNG_INTERLACE_NONE);
+    int bufferRows = streaming ? std::min(kPNGDecodeBandRows, std::max(lastRow - firstRow, 1)) : height;
+    RamBuffer scratchBuffer(pngRowBytes * bufferRows);
     unsigned char* tmpData = scratchBuffer.getData();
 
-
-    //if (interlace_type != 0) {
-    vector<unsigned char *> row_pointers(height);
-    for (int i = 0; i < height; ++i) {
-        row_pointers[i] = tmpData + i * pngRowBytes;
-    }
-
     // Must call this setjmp in every function that does PNG reads
     if ( setjmp ( png_jmpbuf (png) ) ) {
         png_destroy_read_struct(&png, &info, NULL);
@@ -1171,34 +1202,101 @@ ReadPNGPlugin::decode(const string& filename,
 
         return;
     }
-    png_read_image(png, &row_pointers[0]);
-    png_read_end(png, NULL);
-    /*
-       } else {
-        for (int y = 0; y < height; ++y) {
-            // Must call this setjmp in every function that does PNG reads
-            if (setjmp (png_jmpbuf (png))) {
-                png_destroy_read_struct(&png, &info, NULL);
-                std::fclose(file);
-                setPersistentMessage(Message::eMessageError, "", "PNG library error");
-                throwSuiteStatusException(kOfxStatErrFormat);
-
-                return;
-            }
-            png_read_row (png, (png_bytep)tmpData + y * pngRowBytes, NULL);
+
+    if (!streaming) {
+        vector<unsigned char *> row_pointers(height);
+        for (int i = 0; i < height; ++i) {
+            row_pointers[i] = tmpData + i * pngRowBytes;
         }
-       }
-     */
+        png_read_image(png, &row_pointers[0]);
+        png_read_end(png, NULL);
 
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        file = NULL;
+
+        OfxRectI srcBounds;
+        srcBounds.x1 = x1;
+        srcBounds.y1 = y1;
+        srcBounds.x2 = x1 + width;
+        srcBounds.y2 = y1 + height;
+
+        convertDepthAndComponents(tmpData, renderWindow, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
+
+        return;
+    }
+
+    // skip the rows above the render window: they still have to be inflated, but are not converted
+    for (int row = 0; row < firstRow; ++row) {
+        png_read_row(png, (png_bytep)tmpData, NULL);
+    }
+
+    for (int bandRow = firstRow; bandRow < lastRow && !abort(); bandRow += bufferRows) {
+        int bandEnd = std::min(bandRow + bufferRows, lastRow);
+        for (int row = bandRow; row < bandEnd; ++row) {
+            png_read_row(png, (png_bytep)tmpData + (row - bandRow) * pngRowBytes, NULL);
+        }
+
+        // the band, in the flipped coordinates expected by convertDepthAndComponents
+        OfxRectI srcBounds;
+        srcBounds.x1 = x1;
+        srcBounds.y1 = y1 + bandRow;
+        srcBounds.x2 = x1 + width;
+        srcBounds.y2 = y1 + bandEnd;
+
+        OfxRectI bandWindow = renderWindow;
+        bandWindow.y1 = std::max(renderWindow.y1, bounds.y2 - srcBounds.y2);
+        bandWindow.y2 = std::min(renderWindow.y2, bounds.y2 - srcBounds.y1);
+        if (bandWindow.y1 < bandWindow.y2) {
+            convertDepthAndComponents(tmpData, bandWindow, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
+        }
+    }
+
+    // the rows below the render window are never read, so png_read_end() must not be called
     png_destroy_read_struct(&png, &info, NULL);
     std::fclose(file);
     file = NULL;
+} // ReadPNGPlugin::decode
+
+bool
+ReadPNGPlugin::decodeScaled(const string& filename,
+                            OfxTime /*time*/,
+                            int /*view*/,
+                            bool /*isPlayback*/,
+                            const OfxRectI& renderWindow,
+                            unsigned int downscaleLevels,
+                            float *pixelData,
+                            const OfxRectI& bounds,
+                            PixelComponentEnum pixelComponents,
+                            int /*pixelComponentCount*/,
+                            int rowBytes)
+{
+    if ( (pixelComponents != ePixelComponentRGBA) && (pixelComponents != ePixelComponentRGB) && (pixelComponents != ePixelComponentXY) && (pixelComponents != ePixelComponentAlpha) ) {
+        return false;
+    }
+    if ( (downscaleLevels == 0) || (downscaleLevels >= 31) ) {
+        return false;
+    }
 
-    OfxRectI srcBounds;
-    srcBounds.x1 = x1;
-    srcBounds.y1 = y1;
-    srcBounds.x2 = x1 + width;
-    srcBounds.y2 = y1 + height;
+    png_structp png;
+    png_infop info;
+    FILE* file;
+
+    try {
+        openFile(filename, &png, &info, &file);
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    int x1, y1, width, height;
+    int nChannels;
+    BitDepthEnum bitdepth;
+    int realbitdepth;
+    int colorType;
+    double par;
+    int interlaceType;
+    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, &interlaceType, 0, 0, 0, 0, 0, 0, 0, 0);
 
     PixelComponentEnum srcComponents;
     switch (nChannels) {
@@ -1215,14 +1313,138 @@ ReadPNGPlugin::decode(const string& filename,
         srcComponents = ePixelComponentRGBA;
         break;
     default:
-        setPersistentMessage(Message::eMessageError, "", "This plug-in only supports images with 1 to 4 channels");
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+
+        // let the full resolution decode report the error
+        return false;
+    }
+
+    std::size_t pixelBytes = nChannels;
+    if (bitdepth == eBitDepthUShort) {
+        pixelBytes *= sizeof(unsigned short);
+    }
+    std::size_t pngRowBytes = pixelBytes * width;
+
+    // Each output pixel samples one pixel of the 2^downscaleLevels square it covers at full resolution.
+    // The sample is on a multiple of 2^downscaleLevels (from the top-left corner of the PNG image), so that
+    // interlaced images only need the first Adam7 passes:
+    // - pass 1 has all the pixels which are a multiple of 8,
+    // - passes 1 to 3 have all the pixels which are a multiple of 4,
+    // - passes 1 to 5 have all the pixels which are a multiple of 2.
+    int step = 1 << downscaleLevels;
+    int lastCol = (width - 1) & ~(step - 1);
+    int lastRow = (height - 1) & ~(step - 1);
+    int outWidth = renderWindow.x2 - renderWindow.x1;
+    int outHeight = renderWindow.y2 - renderWindow.y1;
+
+    vector<int> sampleCol(outWidth);
+    for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
+        // first column of the square, from the left of the image, rounded up to a multiple of step
+        int col = x * step - x1;
+        col = ( (col + step - 1) / step ) * step;
+        sampleCol[x - renderWindow.x1] = std::max( 0, std::min(col, lastCol) );
+    }
+    // output rows from top to bottom, so that PNG rows are read in increasing order
+    vector<int> sampleRow(outHeight);
+    for (int k = 0; k < outHeight; ++k) {
+        int y = renderWindow.y2 - 1 - k;
+        // first row of the square, from the top of the image, rounded up to a multiple of step
+        int row = (y1 + height) - (y + 1) * step;
+        row = (row >= 0) ? ( (row + step - 1) / step ) * step : 0;
+        sampleRow[k] = std::max( 0, std::min(row, lastRow) );
+    }
+
+    bool interlaced = (interlaceType != PNG_INTERLACE_NONE);
+    int bandRows = std::min(kPNGDecodeBandRows, std::max(outHeight, 1));
+    RamBuffer bandBuffer(pixelBytes * outWidth * bandRows);
+    unsigned char* bandData = bandBuffer.getData();
+    RamBuffer rowBuffer(pngRowBytes);
+    unsigned char* rowData = rowBuffer.getData();
+
+    // For interlaced images, only the sampled rows are kept, the other rows are all read into rowData.
+    std::size_t nSampledRows = 0;
+    vector<unsigned char*> rowPointers;
+    if (interlaced) {
+        rowPointers.resize(height, rowData);
+        for (int k = 0; k < outHeight; ++k) {
+            if ( (k == 0) || (sampleRow[k] != sampleRow[k - 1]) ) {
+                ++nSampledRows;
+            }
+        }
+    }
+    RamBuffer sampledRowsBuffer(interlaced ? pngRowBytes * nSampledRows : 0);
+    if (interlaced) {
+        unsigned char* sampledRowsData = sampledRowsBuffer.getData();
+        for (int k = 0; k < outHeight; ++k) {
+            if ( (k == 0) || (sampleRow[k] != sampleRow[k - 1]) ) {
+                rowPointers[sampleRow[k]] = sampledRowsData;
+                sampledRowsData += pngRowBytes;
+            }
+        }
+    }
+
+    // Must call this setjmp in every function that does PNG reads
+    if ( setjmp ( png_jmpbuf (png) ) ) {
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        setPersistentMessage(Message::eMessageError, "", "PNG library error");
         throwSuiteStatusException(kOfxStatErrFormat);
 
-        return;
+        return true;
     }
 
-    convertDepthAndComponents(tmpData, renderWindow, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
-} // ReadPNGPlugin::decode
+    if (interlaced) {
+        int nPasses = (downscaleLevels >= 3) ? 1 : ( (downscaleLevels == 2) ? 3 : 5 );
+        for (int pass = 0; pass < nPasses && !abort(); ++pass) {
+            // with interlace handling, each pass is read by reading all the rows of the image
+            for (int row = 0; row < height; ++row) {
+                png_read_row(png, (png_bytep)rowPointers[row], NULL);
+            }
+        }
+    }
+
+    int nextRow = 0; // the next PNG row to be read, for non-interlaced images
+    for (int bandStart = 0; bandStart < outHeight && !abort(); bandStart += bandRows) {
+        int bandEnd = std::min(bandStart + bandRows, outHeight);
+        for (int k = bandStart; k < bandEnd; ++k) {
+            const unsigned char* src;
+            if (interlaced) {
+                src = rowPointers[sampleRow[k]];
+            } else {
+                // skipped rows are inflated, but never converted nor stored
+                while (nextRow <= sampleRow[k]) {
+                    png_read_row(png, (png_bytep)rowData, NULL);
+                    ++nextRow;
+                }
+                src = rowData;
+            }
+            unsigned char* dst = bandData + (k - bandStart) * pixelBytes * outWidth;
+            for (int i = 0; i < outWidth; ++i, dst += pixelBytes) {
+                std::copy(src + sampleCol[i] * pixelBytes, src + (sampleCol[i] + 1) * pixelBytes, dst);
+            }
+        }
+
+        // the band, in the flipped coordinates expected by convertDepthAndComponents
+        OfxRectI srcBounds;
+        srcBounds.x1 = renderWindow.x1;
+        srcBounds.x2 = renderWindow.x2;
+        srcBounds.y1 = bounds.y2 - renderWindow.y2 + bandStart;
+        srcBounds.y2 = srcBounds.y1 + (bandEnd - bandStart);
+
+        OfxRectI bandWindow = renderWindow;
+        bandWindow.y1 = renderWindow.y2 - bandEnd;
+        bandWindow.y2 = renderWindow.y2 - bandStart;
+        convertDepthAndComponents(bandData, bandWindow, srcBounds, srcComponents, bitdepth, pixelBytes * outWidth, pixelData, bounds, pixelComponents, rowBytes);
+    }
+
+    // the end of the image is never read, so png_read_end() must not be called
+    png_destroy_read_struct(&png, &info, NULL);
+    std::fclose(file);
+    file = NULL;
+
+    return true;
+} // ReadPNGPlugin::decodeScaled
 
 bool
 ReadPNGPlugin::getFrameBounds(const string& filename,
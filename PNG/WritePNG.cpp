@@ -23,20 +23,27 @@
 
 
 #include <cstdio> // fopen, fwrite...
+#include <cstdlib>
 #include <vector>
 #include <algorithm>
 
 #include <png.h>
 #include <zlib.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OFX_PNG_USE_SSE2
+#endif
+
 #include "GenericOCIO.h"
 
 #include "GenericWriter.h"
 #include "ofxsMacros.h"
 #include "ofxsFileOpen.h"
-#include "ofxsLut.h"
 #include "ofxsMultiThread.h"
 
+#include "WritePNGParallel.h"
+
 using namespace OFX;
 using namespace OFX::IO;
 #ifdef OFX_IO_USING_OCIO
@@ -113,15 +120,9 @@ enum PNGBitDepthEnum {
 #define kWritePNGParamDitherLabel "Dithering"
 #define kWritePNGParamDitherHint "When checked, conversion from float input buffers to 8-bit PNG will use a dithering algorithm to reduce quantization artifacts. This has no effect when writing to 16bit PNG"
 
-#ifdef OFX_USE_MULTITHREAD_MUTEX
-typedef MultiThread::Mutex Mutex;
-typedef MultiThread::AutoMutex AutoMutex;
-#else
-typedef tthread::fast_mutex Mutex;
-typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
-#endif
-
-static Color::LutManager<Mutex>* gLutManager;
+#define kWritePNGParamParallel "parallelCompression"
+#define kWritePNGParamParallelLabel "Parallel Compression"
+#define kWritePNGParamParallelHint "When checked, the image is split into horizontal bands which are filtered and compressed in parallel, and stitched into a single valid PNG stream. This is much faster at high compression levels, and the file may be very slightly larger. The image is compressed by libpng when a single thread is available, or when it is too small to be split."
 
 
 // Try to deduce endianness
@@ -149,29 +150,6 @@ littleendian (void)
 #endif
 }
 
-/// Change endian-ness of one or more data items that are each 2, 4,
-/// or 8 bytes.  This should work for any of short, unsigned short, int,
-/// unsigned int, float, long long, pointers.
-template<class T>
-inline void
-swap_endian (T *f,
-             int len = 1)
-{
-    for ( char *c = (char *) f; len--; c += sizeof(T) ) {
-        if (sizeof(T) == 2) {
-            std::swap (c[0], c[1]);
-        } else if (sizeof(T) == 4) {
-            std::swap (c[0], c[3]);
-            std::swap (c[1], c[2]);
-        } else if (sizeof(T) == 8) {
-            std::swap (c[0], c[7]);
-            std::swap (c[1], c[6]);
-            std::swap (c[2], c[5]);
-            std::swap (c[3], c[4]);
-        }
-    }
-}
-
 /// Initializes a PNG write struct.
 /// \return empty string on success, C-string error message on failure.
 ///
@@ -353,6 +331,270 @@ convertPseudoRandomHashToRange(unsigned int lastRandomHash,
     return ( (double)lastRandomHash / (double)0x100000000LL ) * (max - min)  + min;
 }
 
+/// The random hash of row y, which only depends on the seed hash and y, so that rows can be dithered in any order.
+inline
+unsigned int
+pseudoRandomHashForRow(unsigned int seedHash,
+                       int y)
+{
+    return generatePseudoRandomHash( seedHash + generatePseudoRandomHash( (unsigned int)y ) );
+}
+
+/// Same result as floatToInt<numvals>(value), but the rounding is done on the float product,
+/// exactly like quantizeSSE2(), so that the scalar and vector code give the same output.
+template<int numvals>
+inline int
+quantize(float value)
+{
+    if ( !(value > 0.f) ) {
+        return 0;
+    } else if (value >= 1.f) {
+        return numvals - 1;
+    }
+    float p = value * (numvals - 1);
+    int t = (int)p;
+
+    return t + ( ( (p - t) >= 0.5f ) ? 1 : 0 );
+}
+
+#ifdef OFX_PNG_USE_SSE2
+/// Four values at once, see quantize().
+template<int numvals>
+inline __m128i
+quantizeSSE2(__m128 v)
+{
+    // _mm_max_ps returns its second operand if the first is a NaN
+    v = _mm_min_ps( _mm_max_ps( v, _mm_setzero_ps() ), _mm_set1_ps(1.f) );
+    __m128 p = _mm_mul_ps( v, _mm_set1_ps( (float)(numvals - 1) ) );
+    __m128i t = _mm_cvttps_epi32(p);
+    __m128 frac = _mm_sub_ps( p, _mm_cvtepi32_ps(t) );
+
+    // the comparison mask is -1 where the fractional part is at least 0.5
+    return _mm_sub_epi32( t, _mm_castps_si128( _mm_cmpge_ps( frac, _mm_set1_ps(0.5f) ) ) );
+}
+
+#endif
+
+/// Quantizes n contiguous values to 8 bits.
+inline void
+quantizeRow8(const float* src,
+             unsigned char* dst,
+             std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFX_PNG_USE_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = quantizeSSE2<256>( _mm_loadu_ps(src + i) );
+        __m128i b = quantizeSSE2<256>( _mm_loadu_ps(src + i + 4) );
+        __m128i c = quantizeSSE2<256>( _mm_loadu_ps(src + i + 8) );
+        __m128i d = quantizeSSE2<256>( _mm_loadu_ps(src + i + 12) );
+        _mm_storeu_si128( (__m128i*)(dst + i), _mm_packus_epi16( _mm_packs_epi32(a, b), _mm_packs_epi32(c, d) ) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = (unsigned char)quantize<256>(src[i]);
+    }
+}
+
+/// Quantizes n contiguous values to 16 bits, big endian as in PNG files.
+inline void
+quantizeRow16(const float* src,
+              unsigned short* dst,
+              std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFX_PNG_USE_SSE2
+    // SSE2 has no unsigned 32 to 16 bits pack: offset the values to use the signed one
+    const __m128i offset32 = _mm_set1_epi32(32768);
+    const __m128i offset16 = _mm_set1_epi16( (short)0x8000 );
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_sub_epi32( quantizeSSE2<65536>( _mm_loadu_ps(src + i) ), offset32 );
+        __m128i b = _mm_sub_epi32( quantizeSSE2<65536>( _mm_loadu_ps(src + i + 4) ), offset32 );
+        __m128i v = _mm_xor_si128( _mm_packs_epi32(a, b), offset16 );
+        // x86 is little endian
+        v = _mm_or_si128( _mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8) );
+        _mm_storeu_si128( (__m128i*)(dst + i), v );
+    }
+#endif
+    bool swap = littleendian();
+    for (; i < n; ++i) {
+        unsigned short v = (unsigned short)quantize<65536>(src[i]);
+        dst[i] = swap ? (unsigned short)( (v << 8) | (v >> 8) ) : v;
+    }
+}
+
+/// Quantizes one row of RGB(A) pixels to 8 bits, diffusing the quantization error of the color
+/// channels from pixel start to the right, and from pixel start - 1 to the left.
+template <int srcNComps, int dstNComps>
+void
+ditherRow(const float* src,
+          unsigned char* dst,
+          int width,
+          int start)
+{
+    assert(srcNComps >= 3 && dstNComps >= 3);
+    assert( width == 0 || (start >= 0 && start < width) );
+
+    for (int backward = 0; backward < 2; ++backward) {
+        int index = backward ? start - 1 : start;
+        // the error is in 1/256 of the 8-bit value, 0x80 rounds to the nearest
+#ifdef OFX_PNG_USE_SSE2
+        const __m128i errorMask = _mm_set1_epi32(0xff);
+        __m128i error = _mm_set1_epi32(0x80);
+#else
+        unsigned error_r = 0x80;
+        unsigned error_g = 0x80;
+        unsigned error_b = 0x80;
+#endif
+
+        while (index < width && index >= 0) {
+            const float* src_pixel = src + index * srcNComps;
+            unsigned char* dst_pixel = dst + index * dstNComps;
+#ifdef OFX_PNG_USE_SSE2
+            __m128i value = quantizeSSE2<0xff01>( _mm_setr_ps(src_pixel[0], src_pixel[1], src_pixel[2], 0.f) );
+            error = _mm_add_epi32( _mm_and_si128(error, errorMask), value );
+            __m128i out = _mm_srli_epi32(error, 8);
+            out = _mm_packs_epi32(out, out);
+            int rgb = _mm_cvtsi128_si32( _mm_packus_epi16(out, out) );
+            dst_pixel[0] = (unsigned char)(rgb & 0xff);
+            dst_pixel[1] = (unsigned char)( (rgb >> 8) & 0xff );
+            dst_pixel[2] = (unsigned char)( (rgb >> 16) & 0xff );
+#else
+            error_r = (error_r & 0xff) + quantize<0xff01>(src_pixel[0]);
+            error_g = (error_g & 0xff) + quantize<0xff01>(src_pixel[1]);
+            error_b = (error_b & 0xff) + quantize<0xff01>(src_pixel[2]);
+            assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
+            dst_pixel[0] = (unsigned char)(error_r >> 8);
+            dst_pixel[1] = (unsigned char)(error_g >> 8);
+            dst_pixel[2] = (unsigned char)(error_b >> 8);
+#endif
+            if (dstNComps == 4) {
+                dst_pixel[3] = (srcNComps == 4) ? (unsigned char)quantize<256>(src_pixel[3]) : 255;
+            }
+
+            if (backward) {
+                --index;
+            } else {
+                ++index;
+            }
+        }
+    }
+} // ditherRow
+
+/**
+ * @brief Converts the float image to the 8 or 16 bits PNG pixels, by bands of rows processed in parallel.
+ *
+ * The dithering noise of each row only depends on the seed and the row number, so the result does
+ * not depend on how the image is split between threads.
+ **/
+class PNGQuantizeProcessor
+    : public MultiThread::Processor
+{
+public:
+    PNGQuantizeProcessor(const float* srcPixelData,
+                         int srcRowElements,
+                         int srcNComps,
+                         int srcStartIndex,
+                         unsigned char* dstPixelData,
+                         std::size_t dstRowBytes,
+                         int dstNComps,
+                         int width,
+                         int height,
+                         PNGBitDepthEnum depth,
+                         bool dither,
+                         unsigned int ditherHash)
+        : _srcPixelData(srcPixelData)
+        , _srcRowElements(srcRowElements)
+        , _srcNComps(srcNComps)
+        , _srcStartIndex(srcStartIndex)
+        , _dstPixelData(dstPixelData)
+        , _dstRowBytes(dstRowBytes)
+        , _dstNComps(dstNComps)
+        , _nComps( std::min(srcNComps, dstNComps) )
+        , _width(width)
+        , _height(height)
+        , _depth(depth)
+        , _dither(dither)
+        , _ditherHash(ditherHash)
+    {
+        // only RGB(A) can be dithered
+        assert( !dither || (depth == ePNGBitDepthUByte && _nComps >= 3) );
+    }
+
+    void process()
+    {
+        unsigned int nThreads = std::min( MultiThread::getNumCPUs(), (unsigned int)std::max(_height, 1) );
+
+        multiThread(nThreads);
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        int y1 = (int)( (long long)_height * threadIndex / threadMax );
+        int y2 = (int)( (long long)_height * (threadIndex + 1) / threadMax );
+
+        for (int y = y1; y < y2; ++y) {
+            processRow(y);
+        }
+    }
+
+    void processRow(int y)
+    {
+        const float* src = _srcPixelData + (std::size_t)y * _srcRowElements + _srcStartIndex;
+        unsigned char* dst = _dstPixelData + (std::size_t)y * _dstRowBytes;
+
+        if (_dither) {
+            int start = convertPseudoRandomHashToRange(pseudoRandomHashForRow(_ditherHash, y), 0, _width);
+            if (_srcNComps == 3) {
+                if (_dstNComps == 3) {
+                    ditherRow<3, 3>(src, dst, _width, start);
+                } else {
+                    ditherRow<3, 4>(src, dst, _width, start);
+                }
+            } else {
+                if (_dstNComps == 3) {
+                    ditherRow<4, 3>(src, dst, _width, start);
+                } else {
+                    ditherRow<4, 4>(src, dst, _width, start);
+                }
+            }
+        } else if ( (_srcNComps == _dstNComps) && (_srcStartIndex == 0) ) {
+            // contiguous components: the whole row is converted by the vector kernels
+            if (_depth == ePNGBitDepthUByte) {
+                quantizeRow8(src, dst, (std::size_t)_width * _dstNComps);
+            } else {
+                quantizeRow16(src, (unsigned short*)dst, (std::size_t)_width * _dstNComps);
+            }
+        } else {
+            for (int x = 0; x < _width; ++x, src += _srcNComps) {
+                if (_depth == ePNGBitDepthUByte) {
+                    quantizeRow8(src, dst + x * _dstNComps, _nComps);
+                } else {
+                    quantizeRow16(src, (unsigned short*)dst + x * _dstNComps, _nComps);
+                }
+            }
+        }
+    } // processRow
+
+    const float* _srcPixelData;
+    int _srcRowElements;
+    int _srcNComps;
+    int _srcStartIndex;
+    unsigned char* _dstPixelData;
+    std::size_t _dstRowBytes;
+    int _dstNComps;
+    int _nComps;
+    int _width;
+    int _height;
+    PNGBitDepthEnum _depth;
+    bool _dither;
+    unsigned int _ditherHash;
+};
+
 class WritePNGPlugin
     : public GenericWriterPlugin
 {
@@ -396,33 +638,11 @@ private:
                      const string& outputColorspace,
                      PNGBitDepthEnum bitdepth);
 
-    template <int srcNComps, int dstNComps>
-    void add_dither_for_components(OfxTime time,
-                                   unsigned int seed,
-                                   const float *src_pixels,
-                                   const OfxRectI& bounds,
-                                   unsigned char* dst_pixels,
-                                   int srcRowElements,
-                                   int dstRowElements,
-                                   int dstNCompsStartIndex);
-
-    void add_dither(OfxTime time,
-                    unsigned int seed,
-                    const float *src_pixels,
-                    const OfxRectI& bounds,
-                    unsigned char* dst_pixels,
-                    int srcRowElements,
-                    int dstRowElements,
-                    int dstNCompsStartIndex,
-                    int srcNComps,
-                    int dstNComps);
-
-
     ChoiceParam* _compression;
     IntParam* _compressionLevel;
     ChoiceParam* _bitdepth;
     BooleanParam* _ditherEnabled;
-    const Color::Lut* _ditherLut;
+    BooleanParam* _parallel;
 };
 
 WritePNGPlugin::WritePNGPlugin(OfxImageEffectHandle handle,
@@ -432,13 +652,14 @@ WritePNGPlugin::WritePNGPlugin(OfxImageEffectHandle handle,
     , _compressionLevel(0)
     , _bitdepth(0)
     , _ditherEnabled(0)
-    , _ditherLut( gLutManager->linearLut() )
+    , _parallel(0)
 {
     _compression = fetchChoiceParam(kWritePNGParamCompression);
     _compressionLevel = fetchIntParam(kWritePNGParamCompressionLevel);
     _bitdepth = fetchChoiceParam(kWritePNGParamBitDepth);
     _ditherEnabled = fetchBooleanParam(kWritePNGParamDither);
-    assert(_compression && _compressionLevel && _bitdepth && _ditherEnabled);
+    _parallel = fetchBooleanParam(kWritePNGParamParallel);
+    assert(_compression && _compressionLevel && _bitdepth && _ditherEnabled && _parallel);
 }
 
 WritePNGPlugin::~WritePNGPlugin()
@@ -590,92 +811,6 @@ WritePNGPlugin::write_info (png_structp& sp,
     png_set_packing (sp);   // Pack 1, 2, 4 bit into bytes
 }
 
-template <int srcNComps, int dstNComps>
-void
-WritePNGPlugin::add_dither_for_components(OfxTime time,
-                                          unsigned int seed,
-                                          const float *src_pixels,
-                                          const OfxRectI& bounds,
-                                          unsigned char* dst_pixels,
-                                          int srcRowElements,
-                                          int dstRowElements,
-                                          int dstNCompsStartIndex)
-{
-    unsigned int randHash = pseudoRandomHashSeed(time, seed);
-
-
-    assert(srcNComps >= 3 && dstNComps >= 3);
-
-    int width = bounds.x2 - bounds.x1;
-
-    for (int y = bounds.y1; y < bounds.y2; ++y,
-         src_pixels += srcRowElements,
-         dst_pixels += dstRowElements) {
-        randHash = generatePseudoRandomHash(randHash);
-        int start = convertPseudoRandomHashToRange( randHash, 0, (bounds.x2 - bounds.x1) );
-
-        for (int backward = 0; backward < 2; ++backward) {
-            int index = backward ? start - 1 : start;
-            assert( backward == 1 || ( index >= 0 && index < width ) );
-            unsigned error_r = 0x80;
-            unsigned error_g = 0x80;
-            unsigned error_b = 0x80;
-
-            while (index < width && index >= 0) {
-                int src_col = index * srcNComps + dstNCompsStartIndex;
-                int dst_col = index * dstNComps;
-                error_r = (error_r & 0xff) + _ditherLut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[src_col]);
-                error_g = (error_g & 0xff) + _ditherLut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[src_col + 1]);
-                error_b = (error_b & 0xff) + _ditherLut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[src_col + 2]);
-                assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
-
-
-                dst_pixels[dst_col] = (unsigned char)(error_r >> 8);
-                dst_pixels[dst_col + 1] = (unsigned char)(error_g >> 8);
-                dst_pixels[dst_col + 2] = (unsigned char)(error_b >> 8);
-
-                if (dstNComps == 4) {
-                    dst_pixels[dst_col + 3] = (srcNComps == 4) ? Color::floatToInt<256>(src_pixels[src_col + 3]) : 255;
-                }
-
-
-                if (backward) {
-                    --index;
-                } else {
-                    ++index;
-                }
-            }
-        }
-    }
-}
-
-void
-WritePNGPlugin::add_dither(OfxTime time,
-                           unsigned int seed,
-                           const float *src_pixels,
-                           const OfxRectI& bounds,
-                           unsigned char* dst_pixels,
-                           int srcRowElements,
-                           int dstRowElements,
-                           int dstNCompsStartIndex,
-                           int srcNComps,
-                           int dstNComps)
-{
-    if (srcNComps == 3) {
-        if (dstNComps == 3) {
-            add_dither_for_components<3, 3>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        } else if (dstNComps == 4) {
-            add_dither_for_components<3, 4>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        }
-    } else if (srcNComps == 4) {
-        if (dstNComps == 3) {
-            add_dither_for_components<4, 3>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        } else if (dstNComps == 4) {
-            add_dither_for_components<4, 4>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        }
-    }
-}
-
 void
 WritePNGPlugin::encode(const string& filename,
                        const OfxTime time,
@@ -717,24 +852,26 @@ WritePNGPlugin::encode(const string& filename,
 
     int compression_i;
     _compression->getValue(compression_i);
+    int compressionStrategy;
     switch (compression_i) {
     case 1:
-        png_set_compression_strategy(png, Z_FILTERED);
+        compressionStrategy = Z_FILTERED;
         break;
     case 2:
-        png_set_compression_strategy(png, Z_HUFFMAN_ONLY);
+        compressionStrategy = Z_HUFFMAN_ONLY;
         break;
     case 3:
-        png_set_compression_strategy(png, Z_RLE);
+        compressionStrategy = Z_RLE;
         break;
     case 4:
-        png_set_compression_strategy(png, Z_FIXED);
+        compressionStrategy = Z_FIXED;
         break;
     case 0:
     default:
-        png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
+        compressionStrategy = Z_DEFAULT_STRATEGY;
         break;
     }
+    png_set_compression_strategy(png, compressionStrategy);
 
     PNGBitDepthEnum pngDepth = (PNGBitDepthEnum)_bitdepth->getValueAtTime(time);
     string ocioColorspace;
@@ -753,70 +890,47 @@ WritePNGPlugin::encode(const string& filename,
     RamBuffer scratchBuffer(scratchBufBytes);
     int nComps = std::min(dstNComps, pixelDataNComps);
     const int srcRowElements = rowBytes / sizeof(float);
-    const size_t numPixels = (size_t)(bounds.x2 - bounds.x1) * (size_t)(bounds.y2 - bounds.y1);
-
-    assert(srcRowElements == (bounds.x2 - bounds.x1) * pixelDataNComps);
-    assert(scratchBufBytes == numPixels * dstNComps * bitDepthSize);
 
-    const float* src_pixels = pixelData;
+    assert( srcRowElements == (bounds.x2 - bounds.x1) * pixelDataNComps );
+    assert( scratchBufBytes == (size_t)(bounds.x2 - bounds.x1) * (size_t)(bounds.y2 - bounds.y1) * dstNComps * bitDepthSize );
 
-    if (pngDepth == ePNGBitDepthUByte) {
-        bool ditherEnabled = _ditherEnabled->getValue();
+    bool dither = (pngDepth == ePNGBitDepthUByte) && (nComps >= 3) && _ditherEnabled->getValue();
+    const unsigned int ditherSeed = 2000;
+    PNGQuantizeProcessor processor(pixelData, srcRowElements, pixelDataNComps, dstNCompsStartIndex,
+                                   scratchBuffer.getData(), pngRowBytes, dstNComps,
+                                   bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
+                                   pngDepth, dither, pseudoRandomHashSeed(time, ditherSeed) );
+    processor.process();
 
-        unsigned char* dstPixelData = scratchBuffer.getData();
-        unsigned char* dst_pixels = dstPixelData;
-
-        // no dither
-        if ( !ditherEnabled || (nComps < 3) ) {
-            for ( size_t i = 0; i < numPixels; ++i,
-                 dst_pixels += dstNComps,
-                 src_pixels += pixelDataNComps) {
-                assert(src_pixels == pixelData + i * pixelDataNComps);
-                assert(dst_pixels == dstPixelData + i * dstNComps);
-                for (int c = 0; c < nComps; ++c) {
-                    dst_pixels[c] = floatToInt<256>(src_pixels[dstNCompsStartIndex + c]);
-                }
-
-            }
-        } else {
-            assert(nComps >= 3);
-            const unsigned int ditherSeed = 2000;
-            add_dither(time, ditherSeed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex, pixelDataNComps, dstNComps);
-        }
-    } else {
-        assert(pngDepth == ePNGBitDepthUShort);
-
-        unsigned short* dstPixelData = reinterpret_cast<unsigned short*>( scratchBuffer.getData() );
-        unsigned short* dst_pixels = dstPixelData;
-
-        for ( size_t i = 0; i < numPixels; ++i,
-             dst_pixels += dstNComps,
-             src_pixels += pixelDataNComps) {
-            assert(src_pixels == pixelData + i * pixelDataNComps);
-            assert(dst_pixels == dstPixelData + i * dstNComps);
-            for (int c = 0; c < nComps; ++c) {
-                dst_pixels[c] = floatToInt<65536>(src_pixels[dstNCompsStartIndex + c]);
-            }
-        }
-        // PNG is always big endian
-        if ( littleendian() ) {
-            swap_endian ( dstPixelData, numPixels * dstNComps );
-        }
-    }
-
-
-    // Y is top down in PNG, so invert it now
-    for (int y = (bounds.y2 - bounds.y1 - 1); y >= 0; --y) {
+    // a single band would only be slower than libpng
+    if ( _parallel->getValueAtTime(time) && (Png::parallel_band_count(bounds.y2 - bounds.y1, pngRowBytes) > 1) ) {
         if ( setjmp ( png_jmpbuf(png) ) ) {
             destroy_write_struct(png, info);
             std::fclose(file);
             setPersistentMessage(Message::eMessageError, "", "PNG library error");
             throwSuiteStatusException(kOfxStatFailed);
         }
-        png_write_row (png, (png_byte*)scratchBuffer.getData() + y * pngRowBytes);
-    }
+        if ( !Png::write_parallel_idat(png, scratchBuffer.getData(), bounds.y2 - bounds.y1, pngRowBytes, dstNComps * bitDepthSize, compressionLevel, compressionStrategy) ) {
+            destroy_write_struct(png, info);
+            std::fclose(file);
+            setPersistentMessage(Message::eMessageError, "", "PNG: zlib compression failed");
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        Png::write_end(png);
+    } else {
+        // Y is top down in PNG, so invert it now
+        for (int y = (bounds.y2 - bounds.y1 - 1); y >= 0; --y) {
+            if ( setjmp ( png_jmpbuf(png) ) ) {
+                destroy_write_struct(png, info);
+                std::fclose(file);
+                setPersistentMessage(Message::eMessageError, "", "PNG library error");
+                throwSuiteStatusException(kOfxStatFailed);
+            }
+            png_write_row (png, (png_byte*)scratchBuffer.getData() + y * pngRowBytes);
+        }
 
-    finish_image(png, info);
+        finish_image(png, info);
+    }
     destroy_write_struct(png, info);
     std::fclose(file);
 } // WritePNGPlugin::encode
@@ -900,13 +1014,11 @@ WritePNGPluginFactory::load()
 {
     _extensions.clear();
     _extensions.push_back("png");
-    gLutManager = new Color::LutManager<Mutex>;
 }
 
 void
 WritePNGPluginFactory::unload()
 {
-    delete gLutManager;
 }
 
 /** @brief The basic describe function, passed a plugin descriptor */
@@ -954,6 +1066,17 @@ WritePNGPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         param->setHint(kWritePNGParamCompressionLevelHint);
         param->setRange(0, 9);
         param->setDefault(6);
+        param->setLayoutHint(eLayoutHintNoNewLine);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kWritePNGParamParallel);
+        param->setLabel(kWritePNGParamParallelLabel);
+        param->setHint(kWritePNGParamParallelHint);
+        param->setDefault(false);
         if (page) {
             page->addChild(*param);
         }
@@ -0,0 +1,200 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Standalone benchmark for the PNG writer plugin (not part of the plugin).
+ * Compares the write throughput of the serial encoder of the plugin, which passes the rows to libpng,
+ * with its parallel encoder (Png::write_parallel_idat()), for all the zlib compression levels.
+ *
+ * make benchmark && ./$(OS)-$(BITS)-$(CONFIG)/WritePNGBenchmark [width [height [file]]]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cstddef> // size_t
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include <png.h>
+#include <zlib.h>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsThreadSuite.h"
+
+#include "WritePNGParallel.h"
+
+using std::vector;
+
+// the support library needs the plugins of the binary: there are none
+void
+OFX::Plugin::getPluginIDs(OFX::PluginFactoryArray& /*ids*/)
+{
+}
+
+static double
+now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// Writes an 8 bit RGBA image (rows from bottom to top) to a PNG file, with the serial or the parallel encoder
+// of the plugin. Returns the size of the file, or 0 on error
+static long
+writePNG(const char* filename,
+         bool parallel,
+         int level,
+         const unsigned char* pixelData,
+         int width,
+         int height)
+{
+    FILE* file = std::fopen(filename, "wb");
+
+    if (!file) {
+        return 0;
+    }
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if ( !info || setjmp( png_jmpbuf(png) ) ) {
+        png_destroy_write_struct(&png, &info);
+        std::fclose(file);
+
+        return 0;
+    }
+    png_init_io(png, file);
+    png_set_compression_level(png, level);
+    png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    const std::size_t rowBytes = (std::size_t)width * 4;
+    if (parallel) {
+        if ( !Png::write_parallel_idat(png, pixelData, height, rowBytes, 4, level, Z_DEFAULT_STRATEGY) ) {
+            png_destroy_write_struct(&png, &info);
+            std::fclose(file);
+
+            return 0;
+        }
+        Png::write_end(png);
+    } else {
+        // Y is top down in PNG
+        for (int y = height - 1; y >= 0; --y) {
+            png_write_row( png, (png_bytep)(pixelData + y * rowBytes) );
+        }
+        png_write_end(png, info);
+    }
+    png_destroy_write_struct(&png, &info);
+    long size = std::ftell(file);
+    std::fclose(file);
+
+    return size;
+}
+
+// Returns the best time of a few runs, and the size of the file
+static double
+benchmark(const char* filename,
+          bool parallel,
+          int level,
+          const unsigned char* pixelData,
+          int width,
+          int height,
+          long* size)
+{
+    double best = 0.;
+
+    for (int run = 0; run < 3; ++run) {
+        double start = now();
+        *size = writePNG(filename, parallel, level, pixelData, width, height);
+        double elapsed = now() - start;
+        if ( (run == 0) || (elapsed < best) ) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+int
+main(int argc,
+     char** argv)
+{
+    int width = (argc > 1) ? std::atoi(argv[1]) : 3840;
+    int height = (argc > 2) ? std::atoi(argv[2]) : 2160;
+    const char* filename = (argc > 3) ? argv[3] : "WritePNGBenchmark.png";
+
+    if ( (width <= 0) || (height <= 0) ) {
+        std::fprintf(stderr, "usage: %s [width [height [file]]]\n", argv[0]);
+
+        return 1;
+    }
+    // the parallel encoder is multithreaded by the OFX thread suite: use the one of the support library
+    ofxsThreadSuiteCheck();
+
+    // smooth gradients with a little noise, like a rendered image
+    vector<unsigned char> pixels( (std::size_t)width * height * 4 );
+    unsigned int seed = 1;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            for (int chan = 0; chan < 4; ++chan) {
+                seed = seed * 1103515245u + 12345u;
+                float noise = ( (seed >> 16) & 0xff ) / 255.f - 0.5f;
+                float value = ( chan == 3 ? 1.f :
+                                0.5f * std::sin(x * 0.002f * (chan + 1) + y * 0.003f) + 0.5f + 0.01f * noise );
+                pixels[( (std::size_t)y * width + x ) * 4 + chan] = (unsigned char)( std::min(std::max(value, 0.f), 1.f) * 255.f + 0.5f );
+            }
+        }
+    }
+
+    const double megabytes = (double)width * height * 4 / 1e6;
+    std::printf("%dx%d RGBA 8 bit, %u threads\n", width, height, OFX::MultiThread::getNumCPUs() );
+    std::printf("%-5s %13s %10s %15s %10s %8s\n", "level", "serial (MB/s)", "size (MB)", "parallel (MB/s)", "size (MB)", "speedup");
+    for (int level = Z_NO_COMPRESSION; level <= Z_BEST_COMPRESSION; ++level) {
+        long serialSize, parallelSize;
+        double serialTime = benchmark(filename, false, level, &pixels[0], width, height, &serialSize);
+        double parallelTime = benchmark(filename, true, level, &pixels[0], width, height, &parallelSize);
+        if ( (serialSize == 0) || (parallelSize == 0) ) {
+            std::fprintf(stderr, "cannot write %s\n", filename);
+
+            return 1;
+        }
+        std::printf("%-5d %13.1f %10.2f %15.1f %10.2f %7.2fx\n", level,
+                    megabytes / serialTime, serialSize / 1e6, megabytes / parallelTime, parallelSize / 1e6, serialTime / parallelTime);
+    }
+    std::remove(filename);
+
+    return 0;
+} // main
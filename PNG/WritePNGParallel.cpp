@@ -0,0 +1,436 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Parallel compression of the image data of PNG files, shared by the PNG writer plugin
+ * and its standalone benchmark.
+ */
+
+#include "WritePNGParallel.h"
+
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+
+using namespace OFX;
+
+using std::vector;
+
+namespace Png {
+#define kPNGEncodeMinBandBytes (256 * 1024) // minimum number of uncompressed bytes in a band compressed by a thread
+#define kPNGEncodeWindowSize 32768 // size of the deflate window, used to prime each band with the end of the previous one
+#define kPNGFilterChunkBytes 1024 // number of bytes filtered between two comparisons with the best filter of a row
+
+/// Paeth predictor, see https://www.w3.org/TR/PNG/#9Filter-type-4-Paeth
+static inline unsigned char
+paethPredictor(int a,
+               int b,
+               int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+
+    if ( (pa <= pb) && (pa <= pc) ) {
+        return (unsigned char)a;
+    } else if (pb <= pc) {
+        return (unsigned char)b;
+    }
+
+    return (unsigned char)c;
+}
+
+/// The cost of a filtered byte in the filter selection heuristic: its absolute value as a signed byte
+static inline unsigned int
+filterCost(unsigned char v)
+{
+    return (v < 128) ? v : (256 - v);
+}
+
+/// Filters the bytes [start, end) of a PNG row with one filter type, and returns the sum of their costs.
+/// out receives the filtered bytes at the same offsets. prev is NULL for the first row, and is only used by Average
+/// (Up and Paeth are never used on the first row). Each filter has its own loop, with the first pixel, which has no
+/// left neighbour, apart, so that the loops do not test the filter type or the row boundaries for each byte.
+static inline unsigned long
+filterBytes(int filter,
+            const unsigned char* row,
+            const unsigned char* prev,
+            std::size_t start,
+            std::size_t end,
+            int bpp,
+            unsigned char* out)
+{
+    unsigned long sum = 0;
+    std::size_t i = start;
+    // the end of the first pixel in [start, end)
+    const std::size_t firstEnd = std::max( start, std::min( (std::size_t)bpp, end ) );
+
+    switch (filter) {
+    case 0: // None
+        for (; i < end; ++i) {
+            out[i] = row[i];
+            sum += filterCost(out[i]);
+        }
+        break;
+    case 1: // Sub
+        for (; i < firstEnd; ++i) {
+            out[i] = row[i];
+            sum += filterCost(out[i]);
+        }
+        for (; i < end; ++i) {
+            out[i] = (unsigned char)(row[i] - row[i - bpp]);
+            sum += filterCost(out[i]);
+        }
+        break;
+    case 2: // Up
+        for (; i < end; ++i) {
+            out[i] = (unsigned char)(row[i] - prev[i]);
+            sum += filterCost(out[i]);
+        }
+        break;
+    case 3: // Average
+        if (prev) {
+            for (; i < firstEnd; ++i) {
+                out[i] = (unsigned char)( row[i] - (prev[i] >> 1) );
+                sum += filterCost(out[i]);
+            }
+            for (; i < end; ++i) {
+                out[i] = (unsigned char)( row[i] - ( (row[i - bpp] + prev[i]) >> 1 ) );
+                sum += filterCost(out[i]);
+            }
+        } else {
+            for (; i < firstEnd; ++i) {
+                out[i] = row[i];
+                sum += filterCost(out[i]);
+            }
+            for (; i < end; ++i) {
+                out[i] = (unsigned char)( row[i] - (row[i - bpp] >> 1) );
+                sum += filterCost(out[i]);
+            }
+        }
+        break;
+    case 4: // Paeth
+    default:
+        // without left neighbour, the Paeth predictor is the pixel above
+        for (; i < firstEnd; ++i) {
+            out[i] = (unsigned char)(row[i] - prev[i]);
+            sum += filterCost(out[i]);
+        }
+        for (; i < end; ++i) {
+            out[i] = (unsigned char)( row[i] - paethPredictor(row[i - bpp], prev[i], prev[i - bpp]) );
+            sum += filterCost(out[i]);
+        }
+        break;
+    } // switch
+
+    return sum;
+} // filterBytes
+
+/// Filters one PNG row with each of the five filter types, and keeps the one with the minimum sum
+/// of absolute differences (the same heuristic as libpng).
+/// dst receives the filter type byte followed by rowBytes filtered bytes. prev is NULL for the first row.
+/// candidate must hold rowBytes + 1 bytes.
+static inline void
+filterRow(const unsigned char* row,
+          const unsigned char* prev,
+          std::size_t rowBytes,
+          int bpp,
+          unsigned char* dst,
+          unsigned char* candidate)
+{
+    unsigned long bestSum = (unsigned long)-1;
+
+    for (int filter = 0; filter < 5; ++filter) {
+        if ( !prev && ( (filter == 2) || (filter == 4) ) ) {
+            // Up and Paeth are the same as None and Sub on the first row
+            continue;
+        }
+        unsigned char* out = (filter == 0) ? dst : candidate;
+        out[0] = (unsigned char)filter;
+        // the row is filtered by chunks, and the filters stop as soon as they are worse than the best one
+        unsigned long sum = 0;
+        for (std::size_t start = 0; start < rowBytes && sum < bestSum; start += kPNGFilterChunkBytes) {
+            sum += filterBytes( filter, row, prev, start, std::min(start + kPNGFilterChunkBytes, rowBytes), bpp, out + 1 );
+        }
+        // None is tried first and written directly to dst
+        if (sum < bestSum) {
+            bestSum = sum;
+            if (filter != 0) {
+                std::copy(candidate, candidate + rowBytes + 1, dst);
+            }
+        }
+    }
+} // filterRow
+
+int
+parallel_band_count(int height,
+                    std::size_t rowBytes)
+{
+    std::size_t imageBytes = (std::size_t)height * (rowBytes + 1);
+    int nBands = (int)std::min( (std::size_t)MultiThread::getNumCPUs(), imageBytes / kPNGEncodeMinBandBytes );
+
+    nBands = std::max(1, std::min(nBands, height));
+    // bands have the same number of rows, except the last one
+    int bandRows = (height + nBands - 1) / nBands;
+
+    return (height + bandRows - 1) / bandRows;
+}
+
+/**
+ * @brief Filters and deflates horizontal bands of a PNG image in parallel.
+ *
+ * This is the approach of pigz: each band is compressed as raw deflate data by its own z_stream,
+ * primed with the last 32k of the previous band so that the compression ratio is barely affected.
+ * All bands but the last one end with a sync flush (an empty stored block), so that their
+ * outputs can be concatenated into a single deflate stream. Row filtering uses the previous
+ * image row, so it does not depend on the band boundaries.
+ **/
+class PNGBandEncoder
+    : public MultiThread::Processor
+{
+public:
+    PNGBandEncoder(const unsigned char* pixelData,
+                   int height,
+                   std::size_t rowBytes,
+                   int bpp,
+                   int level,
+                   int strategy)
+        : _pixelData(pixelData)
+        , _height(height)
+        , _rowBytes(rowBytes)
+        , _bpp(bpp)
+        , _level(level)
+        , _strategy(strategy)
+        , _filtering(true)
+        , _filtered( (std::size_t)height * (rowBytes + 1) )
+        , _bandRows(0)
+        , _bands()
+        , _bandAdler()
+        , _bandOk()
+    {
+        int nBands = parallel_band_count(height, rowBytes);
+        _bandRows = (height + nBands - 1) / nBands;
+        _bands.resize(nBands);
+        _bandAdler.resize(nBands);
+        _bandOk.resize(nBands, 0);
+    }
+
+    /// Filter and compress the image. Returns false if zlib failed.
+    bool encode()
+    {
+        int nBands = (int)_bands.size();
+
+        // bands are primed with the filtered data of the previous band, so all rows must be filtered first
+        _filtering = true;
+        multiThread(nBands);
+        _filtering = false;
+        multiThread(nBands);
+
+        return std::find(_bandOk.begin(), _bandOk.end(), 0) == _bandOk.end();
+    }
+
+    int getNBands() const
+    {
+        return (int)_bands.size();
+    }
+
+    /// The deflate data of a band, to be written in order.
+    const vector<unsigned char>& getBand(int band) const
+    {
+        return _bands[band];
+    }
+
+    /// The Adler-32 checksum of the whole filtered image, for the zlib trailer.
+    unsigned long getAdler() const
+    {
+        unsigned long adler = adler32(0L, Z_NULL, 0);
+
+        for (std::size_t band = 0; band < _bands.size(); ++band) {
+            adler = adler32_combine( adler, _bandAdler[band], (z_off_t)bandBytes(band) );
+        }
+
+        return adler;
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadIndex,
+                                     unsigned int threadMax) OVERRIDE FINAL
+    {
+        for (int band = (int)threadIndex; band < (int)_bands.size(); band += (int)threadMax) {
+            if (_filtering) {
+                filterBand(band);
+            } else {
+                _bandOk[band] = deflateBand(band);
+            }
+        }
+    }
+
+    std::size_t bandBytes(int band) const
+    {
+        int y1 = band * _bandRows;
+        int y2 = std::min(y1 + _bandRows, _height);
+
+        return (std::size_t)(y2 - y1) * (_rowBytes + 1);
+    }
+
+    // Y is top down in PNG
+    const unsigned char* pngRow(int y) const
+    {
+        return _pixelData + (std::size_t)(_height - 1 - y) * _rowBytes;
+    }
+
+    void filterBand(int band)
+    {
+        int y1 = band * _bandRows;
+        int y2 = std::min(y1 + _bandRows, _height);
+        vector<unsigned char> candidate(_rowBytes + 1);
+
+        for (int y = y1; y < y2; ++y) {
+            filterRow(pngRow(y), y ? pngRow(y - 1) : NULL, _rowBytes, _bpp,
+                      &_filtered[y * (_rowBytes + 1)], &candidate[0]);
+        }
+    }
+
+    bool deflateBand(int band)
+    {
+        std::size_t start = (std::size_t)band * _bandRows * (_rowBytes + 1);
+        std::size_t length = bandBytes(band);
+        bool last = ( band == (int)_bands.size() - 1 );
+        const unsigned char* in = &_filtered[start];
+
+        _bandAdler[band] = adler32(adler32(0L, Z_NULL, 0), in, (uInt)length);
+
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        // raw deflate: the zlib header and trailer are written once for the whole image
+        if (deflateInit2(&zs, _level, Z_DEFLATED, -MAX_WBITS, 8, _strategy) != Z_OK) {
+            return false;
+        }
+        if (start > 0) {
+            std::size_t dictLength = std::min(start, (std::size_t)kPNGEncodeWindowSize);
+            if (deflateSetDictionary(&zs, in - dictLength, (uInt)dictLength) != Z_OK) {
+                deflateEnd(&zs);
+
+                return false;
+            }
+        }
+
+        vector<unsigned char>& out = _bands[band];
+        // leave room for the empty stored block of the sync flush
+        out.resize(deflateBound(&zs, (uLong)length) + 16);
+        zs.next_in = const_cast<Bytef*>(in);
+        zs.avail_in = (uInt)length;
+        zs.next_out = &out[0];
+        zs.avail_out = (uInt)out.size();
+        int ret;
+        for (;;) {
+            ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+            if ( (ret == Z_STREAM_ERROR) || (zs.avail_out > 0) || (ret == Z_STREAM_END) ) {
+                break;
+            }
+            // output buffer full: grow it
+            std::size_t done = out.size();
+            out.resize(done * 2);
+            zs.next_out = &out[done];
+            zs.avail_out = (uInt)(out.size() - done);
+        }
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+
+        return last ? (ret == Z_STREAM_END) : (ret == Z_OK);
+    } // deflateBand
+
+    const unsigned char* _pixelData; // the image rows, bottom to top
+    int _height;
+    std::size_t _rowBytes;
+    int _bpp;                        // bytes per complete pixel, used by the filters
+    int _level;
+    int _strategy;
+    bool _filtering;                 // first pass: filter, second pass: deflate
+    vector<unsigned char> _filtered; // filter type byte + filtered row, for each row
+    int _bandRows;
+    vector<vector<unsigned char> > _bands;
+    vector<unsigned long> _bandAdler;
+    vector<char> _bandOk;
+};
+
+bool
+write_parallel_idat(png_structp sp,
+                    const unsigned char* pixelData,
+                    int height,
+                    std::size_t rowBytes,
+                    int bpp,
+                    int level,
+                    int strategy)
+{
+    PNGBandEncoder encoder(pixelData, height, rowBytes, bpp, level, strategy);
+
+    if ( !encoder.encode() ) {
+        return false;
+    }
+
+    // zlib header (RFC 1950), with the same compression level hint as deflateInit()
+    unsigned char header[2];
+    int levelFlags;
+    if ( (strategy >= Z_HUFFMAN_ONLY) || (level < 2) ) {
+        levelFlags = 0;
+    } else if (level < 6) {
+        levelFlags = 1;
+    } else if (level == 6) {
+        levelFlags = 2;
+    } else {
+        levelFlags = 3;
+    }
+    header[0] = 0x78; // deflate, 32k window
+    header[1] = (unsigned char)(levelFlags << 6);
+    header[1] += 31 - ( (header[0] << 8) + header[1] ) % 31;
+
+    unsigned long adler = encoder.getAdler();
+    unsigned char trailer[4];
+    trailer[0] = (unsigned char)( (adler >> 24) & 0xff );
+    trailer[1] = (unsigned char)( (adler >> 16) & 0xff );
+    trailer[2] = (unsigned char)( (adler >> 8) & 0xff );
+    trailer[3] = (unsigned char)(adler & 0xff);
+
+    // the concatenation of all IDAT chunks is the zlib stream
+    png_write_chunk(sp, (png_bytep)"IDAT", header, 2);
+    for (int band = 0; band < encoder.getNBands(); ++band) {
+        const vector<unsigned char>& data = encoder.getBand(band);
+        if ( !data.empty() ) {
+            png_write_chunk(sp, (png_bytep)"IDAT", (png_bytep)&data[0], data.size());
+        }
+    }
+    png_write_chunk(sp, (png_bytep)"IDAT", trailer, 4);
+
+    return true;
+} // write_parallel_idat
+
+void
+write_end(png_structp sp)
+{
+    png_write_chunk(sp, (png_bytep)"IEND", NULL, 0);
+}
+} // namespace Png
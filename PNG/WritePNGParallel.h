@@ -0,0 +1,47 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2017 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Parallel compression of the image data of PNG files, shared by the PNG writer plugin
+ * and its standalone benchmark.
+ */
+
+#ifndef WritePNGParallel_h
+#define WritePNGParallel_h
+
+#include <cstddef> // size_t
+
+#include <png.h>
+
+namespace Png {
+/// Writes the image data of a PNG file as IDAT chunks, filtered and compressed by horizontal bands in parallel.
+/// pixelData holds the rows of the image from bottom to top. The PNG header must have been written, and the
+/// file must be finished with write_end(). Returns false if compression failed.
+bool write_parallel_idat(png_structp sp, const unsigned char* pixelData, int height, std::size_t rowBytes, int bpp, int level, int strategy);
+
+/// The number of bands compressed in parallel by write_parallel_idat(), from the number of CPUs and the image size.
+/// With a single band, the parallel encoder is slower than libpng, which filters the rows faster.
+int parallel_band_count(int height, std::size_t rowBytes);
+
+/// Finishes a PNG file written by write_parallel_idat() with the IEND chunk.
+/// png_write_end() cannot be used, because it refuses to write the end of a file unless libpng itself has written
+/// an IDAT chunk. The ancillary chunks are all written before the image data, by png_write_info().
+void write_end(png_structp sp);
+} // namespace Png
+
+#endif // WritePNGParallel_h